@@ -0,0 +1,122 @@
+#include "Agent.h"
+
+#include <qjson/parser.h>
+#include <qjson/serializer.h>
+
+#include <cerrno>
+#include <cstring>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Read from the coordinator this much at a time
+#define READ_CHUNK 4096
+
+Agent::Agent() : Logger("agent"), m_fd(-1) {
+}
+
+Agent::~Agent() {
+    if (m_fd >= 0)
+        close(m_fd);
+}
+
+bool Agent::join(const QString & address) {
+    QByteArray host = address.section(':', 0, -2).toUtf8();
+    QByteArray port = address.section(':', -1).toUtf8();
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *addrs;
+    int err = getaddrinfo(host.constData(), port.constData(), &hints, &addrs);
+    if (err != 0) {
+        log(Error, "cannot resolve " + address + ": " + gai_strerror(err));
+        return false;
+    }
+    for (struct addrinfo *ai = addrs; ai && m_fd < 0; ai = ai->ai_next) {
+        m_fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (m_fd >= 0 && ::connect(m_fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+            close(m_fd);
+            m_fd = -1;
+        }
+    }
+    freeaddrinfo(addrs);
+    if (m_fd < 0) {
+        log(Error, "cannot connect to " + address + ": " + strerror(errno));
+        return false;
+    }
+
+    QVariantMap hello;
+    hello["type"] = "hello";
+    if (!sendMessage(hello))
+        return false;
+    if (!readMessage(&m_config) || m_config["type"] != "config") {
+        log(Error, "no run from the coordinator");
+        return false;
+    }
+    log(Info, "agent " + m_config["agent"].toString() + " of "
+              + m_config["agents"].toString());
+    return true;
+}
+
+bool Agent::waitStart() {
+    QVariantMap ready;
+    ready["type"] = "ready";
+    if (!sendMessage(ready))
+        return false;
+    QVariantMap start;
+    if (!readMessage(&start) || start["type"] != "start") {
+        log(Error, "no start from the coordinator");
+        return false;
+    }
+    return true;
+}
+
+void Agent::publish(const Stats::Snapshot & snapshot) {
+    if (m_fd < 0)
+        return;
+    QVariantMap stats;
+    stats["type"] = "stats";
+    stats["snapshot"] = snapshot.toVariant();
+    if (!sendMessage(stats)) {
+        // carry on without the coordinator
+        close(m_fd);
+        m_fd = -1;
+    }
+}
+
+bool Agent::sendMessage(const QVariantMap & message) {
+    QByteArray line = QJson::Serializer().serialize(message) + "\n";
+    const char *p = line.constData();
+    int left = line.size();
+    while (left > 0) {
+        ssize_t n = send(m_fd, p, left, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            log(Error, QString("lost the coordinator: ") + strerror(errno));
+            return false;
+        }
+        p += n;
+        left -= n;
+    }
+    return true;
+}
+
+bool Agent::readMessage(QVariantMap *message) {
+    int end;
+    while ((end = m_input.indexOf('\n')) < 0) {
+        char buf[READ_CHUNK];
+        ssize_t n = recv(m_fd, buf, sizeof(buf), 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        m_input.append(buf, n);
+    }
+    bool ok;
+    *message = QJson::Parser().parse(m_input.left(end), &ok).toMap();
+    m_input.remove(0, end + 1);
+    return ok;
+}
@@ -0,0 +1,44 @@
+#ifndef AGENT_H
+#define AGENT_H
+
+#include <QByteArray>
+#include <QString>
+#include <QVariant>
+
+#include "Logger.h"
+#include "Stats.h"
+
+// The agent end of a distributed run (see Coordinator).
+
+// An agent gets its part of the run from the coordinator before it sets
+// anything else up, since worker processes have to be forked before the
+// QCoreApplication exists. So it talks to the coordinator with a plain
+// blocking socket: joining and waiting for the start happen before the
+// event loop runs, and afterwards it only writes a stats line whenever
+// Stats publishes a snapshot.
+
+class Agent : public Stats::Sink, private Logger {
+  public:
+    Agent();
+    virtual ~Agent();
+
+    // Connect to the coordinator at HOST:PORT and wait for the run;
+    // false on failure
+    bool join(const QString & address);
+    // The config message from the coordinator
+    const QVariantMap & config() const { return m_config; }
+    // Report ready and wait for the coordinator to start everyone
+    bool waitStart();
+
+    void publish(const Stats::Snapshot & snapshot);
+
+  private:
+    bool sendMessage(const QVariantMap & message);
+    bool readMessage(QVariantMap *message);
+
+    int m_fd;
+    QByteArray m_input;
+    QVariantMap m_config;
+};
+
+#endif
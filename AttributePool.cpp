@@ -0,0 +1,140 @@
+#include "AttributePool.h"
+
+#include <QtAlgorithms> // for qSort
+
+__thread AttributePool *AttributePool::c_instance = 0;
+
+AttributePool *AttributePool::instance() {
+    if (!c_instance)
+        c_instance = new AttributePool;
+    return c_instance;
+}
+
+AttributePool::AttributePool() {
+    m_sets << QVector<int>();
+    m_set_ids.insert(QByteArray(), 0);
+    m_insert_first = id(Attribute("insertorder", "first"));
+}
+
+int AttributePool::id(const Attribute & attr) {
+    QHash<Attribute, int>::const_iterator it = m_ids.constFind(attr);
+    if (it != m_ids.constEnd())
+        return it.value();
+
+    int key = m_key_ids.value(attr.key, -1);
+    if (key < 0) {
+        key = m_key_ids.size();
+        m_key_ids.insert(attr.key, key);
+    }
+    int id = m_attributes.size();
+    m_attributes << attr;
+    m_keys << key;
+    m_ids.insert(attr, id);
+    return id;
+}
+
+int AttributePool::set(QVector<int> ids) {
+    if (ids.isEmpty())
+        return 0;
+    if (ids.size() > 1) {
+        qSort(ids);
+        int n = 1;
+        for (int i = 1; i < ids.size(); i++) {
+            if (ids[i] != ids[n - 1])
+                ids[n++] = ids[i];
+        }
+        ids.resize(n);
+    }
+
+    const char *raw = reinterpret_cast<const char *>(ids.constData());
+    int len = ids.size() * sizeof(int);
+    // Look it up without copying, but keep a copy of its own in the hash
+    QHash<QByteArray, int>::const_iterator it =
+        m_set_ids.constFind(QByteArray::fromRawData(raw, len));
+    if (it != m_set_ids.constEnd())
+        return it.value();
+
+    int set = m_sets.size();
+    m_sets << ids;
+    m_set_ids.insert(QByteArray(raw, len), set);
+    return set;
+}
+
+int AttributePool::set(const QList<Attribute> & attributes) {
+    QVector<int> ids;
+    ids.reserve(attributes.length());
+    Q_FOREACH (const Attribute & attr, attributes) {
+        ids << id(attr);
+    }
+    return set(ids);
+}
+
+int AttributePool::merge(int set, int changes, bool insert) {
+    if (changes == 0)
+        return set;
+    quint64 pair = (quint64(set) << 33) | (quint64(changes) << 1) | insert;
+    QHash<quint64, int>::const_iterator it = m_merged.constFind(pair);
+    if (it != m_merged.constEnd())
+        return it.value();
+
+    QVector<int> merged = m_sets[set];
+    Q_FOREACH (int change, m_sets[changes]) {
+        bool found = false;
+        for (int a = 0; a < merged.size(); a++) {
+            if (m_keys[merged[a]] == m_keys[change]) {
+                if (m_attributes[change].value.isEmpty() && insert) {
+                    merged.remove(a);
+                } else {
+                    merged[a] = change;
+                }
+                found = true;
+                break;
+            }
+        }
+
+        if (!found)
+            merged << change;
+    }
+
+    int result = this->set(merged);
+    m_merged.insert(pair, result);
+    return result;
+}
+
+int AttributePool::follow(int set, int other) {
+    if (set == 0 || other == 0)
+        return set;
+    quint64 pair = (quint64(set) << 32) | quint64(other);
+    QHash<quint64, int>::const_iterator it = m_followed.constFind(pair);
+    if (it != m_followed.constEnd())
+        return it.value();
+
+    QVector<int> left = m_sets[set];
+    Q_FOREACH (int attr, m_sets[other]) {
+        for (int a = 0; a < left.size(); a++) {
+            if (m_keys[left[a]] == m_keys[attr]) {
+                if (m_attributes[attr].value <= m_attributes[left[a]].value)
+                    left.remove(a);
+                break;
+            }
+        }
+    }
+
+    int result = this->set(left);
+    m_followed.insert(pair, result);
+    return result;
+}
+
+Attribute::Attribute(const QString & key, const QString & value) {
+    this->key = key;
+    this->value = value;
+}
+
+bool Attribute::operator< (const Attribute & other) const {
+    return this->key < other.key
+        || (this->key == other.key && this->value < other.value);
+}
+
+bool Attribute::operator== (const Attribute & other) const {
+    return this->key == other.key && this->value == other.value;
+}
@@ -0,0 +1,90 @@
+#ifndef ATTRIBUTEPOOL_H
+#define ATTRIBUTEPOOL_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QList>
+#include <QString>
+#include <QVector>
+
+class Attribute {
+  public:
+    Attribute(const QString & key, const QString & value);
+
+    QString key;
+    QString value; // may be empty when used with Keep ops
+
+    bool operator< (const Attribute & other) const;
+    bool operator== (const Attribute & other) const;
+};
+
+inline uint qHash(const Attribute & attr) {
+    return qHash(attr.key) ^ (qHash(attr.value) * 31);
+}
+
+// Numbers for the attributes in changesets, and for the sets of them
+// that ops carry.
+
+// Each attribute is stored once and gets a small number, in the order
+// they are first seen, and so does each distinct set of them. An op
+// only holds the number of its set, so ops compare their attributes
+// with one integer comparison. Putting attributes together, as apply()
+// and follow() do for Keep ops, is worked out once for each pair of
+// sets and remembered, since there are only a few sets to begin with,
+// like one per author.
+
+// The pool is not the one sent to the server: a changeset makes that
+// from the attributes its ops use (see Changeset::attributes()), and
+// maps the server's pool to these numbers when parsing.
+
+// Changesets use the instance of the thread they were made in, which
+// is where their client runs, so there is no locking.
+
+class AttributePool {
+  public:
+    // The instance of the calling thread
+    static AttributePool *instance();
+
+    // The number of attr, adding it if it's new
+    int id(const Attribute & attr);
+    const Attribute & attribute(int id) const { return m_attributes[id]; }
+
+    // Sets are vectors of attribute numbers in increasing order, and
+    // set 0 is the empty one. These take the numbers in any order, and
+    // drop duplicates.
+    int set(QVector<int> ids);
+    int set(const QList<Attribute> & attributes);
+    const QVector<int> & ids(int set) const { return m_sets[set]; }
+
+    // The set after the changes of a Keep op are applied to it. An
+    // attribute replaces the one with the same key, and one with an
+    // empty value removes it from an Insert.
+    int merge(int set, int changes, bool insert);
+    // What is left of set once the other set went in first on the same
+    // text: where both have a key, the lexically earlier value wins.
+    int follow(int set, int other);
+    // Whether an Insert with these attributes goes before others at
+    // the same place
+    bool insertsFirst(int set) const {
+        return m_sets[set].contains(m_insert_first);
+    }
+
+  private:
+    AttributePool();
+
+    QVector<Attribute> m_attributes;
+    QHash<Attribute, int> m_ids;
+    QVector<int> m_keys;  // key number of each attribute
+    QHash<QString, int> m_key_ids;
+
+    QVector<QVector<int> > m_sets;
+    QHash<QByteArray, int> m_set_ids;  // keyed by the raw bytes of the ids
+
+    QHash<quint64, int> m_merged;
+    QHash<quint64, int> m_followed;
+    int m_insert_first;
+
+    static __thread AttributePool *c_instance;  // one per thread
+};
+
+#endif
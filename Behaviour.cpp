@@ -0,0 +1,120 @@
+#include "Behaviour.h"
+
+#include <QVariantMap>
+#include <QtGlobal>
+
+#include <cmath>
+#include <cstdlib>
+
+namespace {
+
+    // uniform in (0, 1], so the log is finite
+    static double unit() {
+        return (qrand() + 1.0) / (RAND_MAX + 1.0);
+    }
+
+    static bool number(const QVariantMap & map, const char *key,
+                       double *value) {
+        if (!map.contains(key))
+            return false;
+        bool ok;
+        *value = map[key].toDouble(&ok);
+        return ok;
+    }
+
+}
+
+Distribution Distribution::uniform(double min, double max) {
+    Distribution d;
+    d.m_kind = Uniform;
+    d.m_a = min;
+    d.m_b = max;
+    return d;
+}
+
+bool Distribution::parse(const QVariant & value) {
+    if (value.type() != QVariant::Map) {
+        bool ok;
+        m_kind = Constant;
+        m_a = value.toDouble(&ok);
+        return ok && m_a >= 0;
+    }
+    QVariantMap map = value.toMap();
+    QString dist = map["dist"].toString();
+    if (dist == "constant") {
+        m_kind = Constant;
+        return number(map, "value", &m_a) && m_a >= 0;
+    } else if (dist == "uniform") {
+        m_kind = Uniform;
+        return number(map, "min", &m_a) && number(map, "max", &m_b)
+               && m_a >= 0 && m_b >= m_a;
+    } else if (dist == "exponential") {
+        m_kind = Exponential;
+        return number(map, "mean", &m_a) && m_a >= 0;
+    } else if (dist == "normal") {
+        m_kind = Normal;
+        return number(map, "mean", &m_a) && number(map, "stddev", &m_b)
+               && m_b >= 0;
+    }
+    return false;
+}
+
+double Distribution::sample() const {
+    switch (m_kind) {
+        case Constant:
+            return m_a;
+        case Uniform:
+            return m_a + (m_b - m_a) * (qrand() / (RAND_MAX + 1.0));
+        case Exponential:
+            return -std::log(unit()) * m_a;
+        case Normal: {
+            // Box-Muller
+            double z = std::sqrt(-2 * std::log(unit()))
+                       * std::cos(2 * M_PI * unit());
+            return qMax(0.0, m_a + m_b * z);
+        }
+    }
+    return m_a;
+}
+
+int Distribution::sampleInt(int min) const {
+    if (m_kind == Uniform) {
+        // Each whole number in the range equally likely; rounding a
+        // continuous sample would give the ends half their share
+        int lo = int(std::ceil(m_a));
+        int hi = int(std::floor(m_b));
+        if (hi >= lo)
+            return qMax(min, lo + qrand() % (hi - lo + 1));
+    }
+    return qMax(min, int(sample() + 0.5));
+}
+
+int Distribution::sampleMsecs() const {
+    return int(sample() * 1000);
+}
+
+Behaviour::Behaviour()
+  : action(Lurk), think(10), edits(3), edit_size(Distribution::uniform(1, 20)),
+    reconnect(true), reconnect_delay(Distribution::uniform(1, 10)),
+    session(0) {
+}
+
+bool Behaviour::parseAction(const QString & name, Action *action) {
+    if (name == "lurk")
+        *action = Lurk;
+    else if (name == "draw")
+        *action = Draw;
+    else if (name == "badfollow")
+        *action = BadFollow;
+    else if (name == "oldreconnect")
+        *action = OldReconnect;
+    else if (name == "disconnect")
+        *action = Disconnect;
+    else if (name == "blackhat")
+        *action = Blackhat;
+    else if (name == "replay")
+        *action = Replay;
+    else
+        return false;
+    return true;
+}
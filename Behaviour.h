@@ -0,0 +1,72 @@
+#ifndef BEHAVIOUR_H
+#define BEHAVIOUR_H
+
+#include <QString>
+#include <QVariant>
+
+// A random quantity, like a think time in seconds, given in a scenario
+// file either as a plain number or as an object:
+//   {"dist": "constant", "value": V}
+//   {"dist": "uniform", "min": A, "max": B}
+//   {"dist": "exponential", "mean": M}
+//   {"dist": "normal", "mean": M, "stddev": S}
+// Samples are never negative.
+
+class Distribution {
+  public:
+    enum Kind { Constant, Uniform, Exponential, Normal };
+
+    Distribution(double value = 0) : m_kind(Constant), m_a(value), m_b(0) { }
+    static Distribution uniform(double min, double max);
+
+    // false if value is not one of the forms above
+    bool parse(const QVariant & value);
+
+    double sample() const;
+    // Rounded, and at least min; a uniform one picks each whole
+    // number in its range with the same chance
+    int sampleInt(int min) const;
+    // A sample of seconds in milliseconds
+    int sampleMsecs() const;
+
+  private:
+    Kind m_kind;
+    double m_a;
+    double m_b;
+};
+
+// What a client does, compiled from its client type or scenario class
+// (see Scenario).
+
+// Clients used to compare their type name to a list of strings whenever
+// their timer went off. A Behaviour is made once per client class and
+// shared by its clients, so they only switch on the action and sample
+// the distributions.
+
+struct Behaviour {
+    enum Action {
+        Lurk,          // join and stay
+        Draw,          // make random edits
+        BadFollow,     // send a changeset the server can't follow
+        OldReconnect,  // reconnect claiming to be at rev 0
+        Disconnect,    // connect and drop before CLIENT_VARS
+        Blackhat,      // send other clients a disconnect message
+        Replay         // send what Replay hands it, from a capture file
+    };
+
+    // What a client of type lurk does
+    Behaviour();
+    // name is one of the client types of --clients, like draw
+    static bool parseAction(const QString & name, Action *action);
+
+    Action action;
+    Distribution think;      // secs between a drawer's changesets
+    Distribution edits;      // edits per changeset
+    Distribution edit_size;  // characters inserted or deleted per edit
+    bool reconnect;          // reconnect after losing the connection
+    Distribution reconnect_delay;  // secs before reconnecting
+    // secs to stay connected before reconnecting, 0 for as long as it lasts
+    Distribution session;
+};
+
+#endif
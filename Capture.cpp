@@ -0,0 +1,75 @@
+#include "Capture.h"
+
+#include <QFile>
+#include <QMutexLocker>
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+// Write out the buffer when it gets this big
+#define FLUSH_BYTES (256 * 1024)
+
+const char Capture::c_magic[8] = { 'E', 'D', 'T', 'R', 'A', 'C', 'E', '1' };
+int Capture::c_fd = -1;
+QMutex Capture::c_lock;
+QByteArray Capture::c_buf;
+
+bool Capture::open(const QString & path) {
+    int fd = ::open(QFile::encodeName(path).constData(),
+                    O_RDWR | O_APPEND | O_CREAT, 0644);
+    if (fd < 0) {
+        qCritical("cannot open %s: %s", qPrintable(path), strerror(errno));
+        return false;
+    }
+    char magic[sizeof(c_magic)];
+    ssize_t got = pread(fd, magic, sizeof(magic), 0);
+    bool ok;
+    if (got == 0)
+        ok = write(fd, c_magic, sizeof(c_magic)) == sizeof(c_magic);
+    else
+        ok = got == sizeof(magic) && memcmp(magic, c_magic, sizeof(magic)) == 0;
+    if (!ok) {
+        qCritical("%s is not a capture file", qPrintable(path));
+        ::close(fd);
+        return false;
+    }
+    c_fd = fd;
+    return true;
+}
+
+void Capture::record(quint32 client, Type type, const QByteArray & payload) {
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    Record header;
+    header.usecs = qint64(tv.tv_sec) * 1000000 + tv.tv_usec;
+    header.client = client;
+    header.type = type;
+    header.unused = 0;
+    header.length = payload.size();
+
+    QMutexLocker lock(&c_lock);
+    c_buf.append(reinterpret_cast<const char *>(&header), sizeof(header));
+    c_buf.append(payload);
+    if (c_buf.size() >= FLUSH_BYTES)
+        flushLocked();
+}
+
+void Capture::flush() {
+    QMutexLocker lock(&c_lock);
+    flushLocked();
+}
+
+void Capture::flushLocked() {
+    if (c_fd < 0 || c_buf.isEmpty())
+        return;
+    // One write per buffer, so that with O_APPEND the records of several
+    // processes don't get mixed up
+    ssize_t written = write(c_fd, c_buf.constData(), c_buf.size());
+    if (written != c_buf.size())
+        qWarning("capture write failed: %s",
+                 written < 0 ? strerror(errno) : "short write");
+    c_buf.clear();
+}
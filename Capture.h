@@ -0,0 +1,56 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <QByteArray>
+#include <QMutex>
+#include <QString>
+#include <QtGlobal>
+
+// Records what the clients send, for replaying it later (see Replay).
+
+// A capture file starts with the 8 bytes "EDTRACE1", followed by the
+// records one after the other, each a Record header and then its
+// payload, all in host byte order and without padding. Records are only
+// ever appended, so several runs, or worker processes, can add to one
+// file, and a file cut off in the middle of a record is still readable
+// up to there. Records from different processes can be out of order by
+// a buffer's worth; Replay sends a late record as soon as it gets to it.
+
+// A production proxy can write the same format: the payload of a
+// Changes record is just the changeset, and anything else can be kept
+// as a Packet, the socket.io packet as it went out.
+
+class Capture {
+  public:
+    enum Type {
+        Changes = 1,  // changeset of a USER_CHANGES
+        Packet = 2    // a whole socket.io packet
+    };
+
+    struct Record {
+        qint64 usecs;     // wall clock time in usecs since the epoch
+        quint32 client;   // number of the sending client
+        quint16 type;
+        quint16 unused;
+        quint32 length;   // of the payload that follows
+    } __attribute__((packed));
+
+    static const char c_magic[8];
+
+    // Open path for appending, creating it if needed. Worker processes
+    // forked after this share the file.
+    static bool open(const QString & path);
+    static bool enabled() { return c_fd >= 0; }
+    // Thread-safe; the records are buffered until flush()
+    static void record(quint32 client, Type type, const QByteArray & payload);
+    static void flush();
+
+  private:
+    static void flushLocked();
+
+    static int c_fd;
+    static QMutex c_lock;
+    static QByteArray c_buf;
+};
+
+#endif
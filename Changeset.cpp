@@ -1,12 +1,119 @@
 #include "Changeset.h"
 
-#include <QMap>
-#include <QRegExp>
+#include "Rope.h"
+
+#include <QtAlgorithms> // for qLowerBound and qSort
+
+#include <climits> // for INT_MAX
+
+// Ops go into the assembler in order, and come out merged where possible,
+// with each run of Deletes and Inserts between two Keeps put in the
+// order Deletes first, and without the implicit Keep at the end. That is
+// the canonical form that etherpad requires. Each op is looked at once,
+// so building a changeset this way is linear.
+// The text of an Insert that comes from the assembler's own bank stays
+// where it is, and only text from another bank is appended, so the cost
+// doesn't grow with the text a changeset already holds. Inserts that
+// would merge but whose text is apart in the bank stay separate ops; see
+// m_split.
+class Changeset::Assembler {
+  public:
+    Assembler(QVector<Op> & ops, QString & bank)
+      : m_ops(ops), m_bank(bank), m_split(false) { }
+
+    // bank is where the text of an Insert is
+    void append(const Op & op, const QString & bank);
+    void finish();
+    // Were Inserts left apart that canonical form has as one?
+    bool split() const { return m_split; }
+
+  private:
+    bool merge(QVector<Op> & ops, const Op & op);
+    void flush();
+
+    QVector<Op> & m_ops;
+    QString & m_bank;
+    // The Deletes and Inserts since the last Keep
+    QVector<Op> m_deletes;
+    QVector<Op> m_inserts;
+    bool m_split;
+};
+
+bool Changeset::Assembler::merge(QVector<Op> & ops, const Op & op) {
+    if (ops.isEmpty())
+        return false;
+    Op & last = ops.last();
+    // A multiline op cannot be merged with a following single line op,
+    // but the other way around is ok. Once the single line op is
+    // followed by another multiline one, it can all be one op.
+    if (last.opType != op.opType || last.attributes != op.attributes
+        || (last.lines > 0 && op.lines == 0))
+        return false;
+    // Inserts only merge if their text is next to each other in the bank
+    if (op.opType == Insert && last.bank + last.chars != op.bank) {
+        m_split = true;
+        return false;
+    }
+    last.lines += op.lines;
+    last.chars += op.chars;
+
+    int n = ops.size();
+    if (last.lines > 0 && n > 1 && ops[n - 2].opType == last.opType
+        && ops[n - 2].attributes == last.attributes) {
+        if (last.opType == Insert
+            && ops[n - 2].bank + ops[n - 2].chars != last.bank) {
+            m_split = true;
+        } else {
+            ops[n - 2].lines += last.lines;
+            ops[n - 2].chars += last.chars;
+            ops.resize(n - 1);
+        }
+    }
+    return true;
+}
 
-#include <QtAlgorithms> // for qSort
+void Changeset::Assembler::append(const Op & op, const QString & bank) {
+    if (op.chars == 0)
+        return;
+
+    if (op.opType == Keep) {
+        flush();
+        if (!merge(m_ops, op))
+            m_ops << op;
+    } else if (op.opType == Delete) {
+        if (!merge(m_deletes, op))
+            m_deletes << op;
+    } else {
+        Op insert = op;
+        if (&bank != &m_bank) {
+            insert.bank = m_bank.length();
+            m_bank.append(bank.midRef(op.bank, op.chars));
+        }
+        if (!merge(m_inserts, insert))
+            m_inserts << insert;
+    }
+}
+
+void Changeset::Assembler::flush() {
+    // These can't merge with a Keep, so they can go in as they are
+    m_ops += m_deletes;
+    m_ops += m_inserts;
+    m_deletes.resize(0);
+    m_inserts.resize(0);
+}
+
+void Changeset::Assembler::finish() {
+    flush();
+    // Remove implicit Keep at end. It can be two ops, if the text ends
+    // without a newline.
+    while (!m_ops.isEmpty() && m_ops.last().opType == Keep
+           && m_ops.last().attributes == 0)
+        m_ops.resize(m_ops.size() - 1);
+}
 
 Changeset::Changeset(QObject *parent)
-  : QObject(parent), m_orig_len(0), m_new_len(0), m_tidy(true),
+  : QObject(parent), m_orig_len(0), m_new_len(0),
+    m_pool(AttributePool::instance()), m_tidy(true), m_split(false),
     m_attributes_valid(false) {
 }
 
@@ -23,14 +130,41 @@ QString Changeset::toString() const {
         result.append("<" + QString::number(m_orig_len - m_new_len, 36));
 
     QString charbank;
-    QList<Attribute> apool = attributes();
-    for (int i = 0; i < m_ops.length(); i++) {
-        if (i == m_ops.length() - 1 && m_ops[i].opType == Keep
-            && m_ops[i].attributes.isEmpty()) {
+    int n = m_ops.size();
+    for (int i = 0; i < n; i++) {
+        const Op & op = m_ops[i];
+        if (i == n - 1 && op.opType == Keep && op.attributes == 0)
             continue;  // final Keep is always implicit
+        if (op.opType != Insert) {
+            appendOp(result, op);
+            continue;
+        }
+
+        // Inserts left split by the Assembler go out merged: one op up
+        // to the last newline of the run, and one for the rest
+        int end = i + 1;
+        int tail = op.lines > 0 ? i + 1 : i;
+        while (end < n && m_ops[end].opType == Insert
+               && m_ops[end].attributes == op.attributes) {
+            if (m_ops[end].lines > 0)
+                tail = end + 1;
+            end++;
         }
-        result.append(m_ops[i].toString(apool));
-        charbank.append(m_ops[i].charbank);
+        int bounds[3] = { i, tail, end };
+        for (int part = 0; part < 2; part++) {
+            if (bounds[part] == bounds[part + 1])
+                continue;
+            Op merged = op;
+            merged.lines = 0;
+            merged.chars = 0;
+            for (int k = bounds[part]; k < bounds[part + 1]; k++) {
+                merged.lines += m_ops[k].lines;
+                merged.chars += m_ops[k].chars;
+                charbank.append(m_bank.midRef(m_ops[k].bank, m_ops[k].chars));
+            }
+            appendOp(result, merged);
+        }
+        i = end - 1;
     }
 
     result.append("$");
@@ -38,19 +172,38 @@ QString Changeset::toString() const {
     return result;
 }
 
-QList<Attribute> Changeset::attributes() const {
+const QVector<int> & Changeset::attributeIds() const {
     if (!m_attributes_valid) {
         tidyOps();
-        QMap<Attribute, bool> pool;
+        m_attribute_ids.resize(0);
+        int last = 0;
         Q_FOREACH (const Op & op, m_ops) {
-            Q_FOREACH (const Attribute & attr, op.attributes) {
-                pool[attr] = true;
+            // neighbouring ops often have the same attributes
+            if (op.attributes != last) {
+                m_attribute_ids += m_pool->ids(op.attributes);
+                last = op.attributes;
             }
         }
-        m_attributes = pool.keys();
+        // Sort and drop duplicates here rather than with m_pool->set(),
+        // which would keep the union as a set no op uses
+        qSort(m_attribute_ids);
+        int n = 0;
+        for (int i = 0; i < m_attribute_ids.size(); i++) {
+            if (n == 0 || m_attribute_ids[i] != m_attribute_ids[n - 1])
+                m_attribute_ids[n++] = m_attribute_ids[i];
+        }
+        m_attribute_ids.resize(n);
         m_attributes_valid = true;
     }
-    return m_attributes;
+    return m_attribute_ids;
+}
+
+QList<Attribute> Changeset::attributes() const {
+    QList<Attribute> apool;
+    Q_FOREACH (int id, attributeIds()) {
+        apool << m_pool->attribute(id);
+    }
+    return apool;
 }
 
 // Some code duplication between the addXXX functions,
@@ -73,9 +226,9 @@ void Changeset::addInsert(const QString & text,
     new_op.opType = Insert;
     new_op.lines = lines;
     new_op.chars = text.length();
-    new_op.charbank = text;
-    new_op.attributes = attributes;
-    qSort(new_op.attributes);
+    new_op.bank = m_bank.length();
+    new_op.attributes = m_pool->set(attributes);
+    m_bank.append(text);
 
     m_ops << new_op;
     m_new_len += new_op.chars;
@@ -105,8 +258,8 @@ void Changeset::addKeep(int lines, int chars,
     new_op.opType = Keep;
     new_op.lines = lines;
     new_op.chars = chars;
-    new_op.attributes = attributes;
-    qSort(new_op.attributes);
+    new_op.bank = 0;
+    new_op.attributes = m_pool->set(attributes);
 
     m_ops << new_op;
     m_orig_len += new_op.chars;
@@ -135,6 +288,8 @@ void Changeset::addDelete(int lines, int chars) {
     new_op.opType = Delete;
     new_op.lines = lines;
     new_op.chars = chars;
+    new_op.bank = 0;
+    new_op.attributes = 0;
 
     m_ops << new_op;
     m_orig_len += new_op.chars;
@@ -147,275 +302,559 @@ void Changeset::apply(const Changeset * other) {
 
     tidyOps();
     other->tidyOps();
-    QList<Op> x_ops = other->m_ops;
+    const QVector<Op> & x_ops = other->m_ops;
 
+    QVector<Op> out;
+    out.reserve(m_ops.size() + x_ops.size());
+    Assembler assembler(out, m_bank);
+
+    // Walk both op lists over the text in between the two changesets,
+    // taking the same amount of it off both sides each time, and build
+    // the result from scratch. An op that runs out is taken off its
+    // list, and a list that runs out continues as the implicit Keep.
     int a = 0;
     int b = 0;
-    while (a < m_ops.length() && b < x_ops.length()) {
-        if (m_ops[a].opType == Delete) {
-            // The deleted text is already gone in the world of x_ops,
-            // so there's no interaction.
-            a++;
-            continue;
+    Op op_a;
+    Op op_b;
+    bool has_a = false;
+    bool has_b = false;
+    forever {
+        if (!has_a && a < m_ops.size()) {
+            op_a = m_ops[a++];
+            has_a = true;
         }
-
-        if (x_ops[b].opType == Insert) {
-            m_ops.insert(a, x_ops[b]);
-            m_new_len += x_ops[b].chars;
-            a++;
-            b++;
-            continue;
+        if (!has_b && b < x_ops.size()) {
+            op_b = x_ops[b++];
+            has_b = true;
         }
-
-        // make the ops equal size
-        // The loop will still terminate because only one of the lists
-        // will grow but in the cases that follow, both a and b get closer
-        // to the end of their lists.
-        if (m_ops[a].chars < x_ops[b].chars) {
-            Op split_op;
-            split_op.splitFrom(x_ops[b], m_ops[a].lines, m_ops[a].chars);
-            x_ops.insert(b, split_op);
-        } else if (m_ops[a].chars > x_ops[b].chars) {
-            Op split_op;
-            split_op.splitFrom(m_ops[a], x_ops[b].lines, x_ops[b].chars);
-            m_ops.insert(a, split_op);
+        if (!has_a && !has_b)
+            break;
+
+        if (has_a && op_a.opType == Delete) {
+            // The deleted text is already gone in the world of the other
+            // changeset, so there's no interaction.
+            assembler.append(op_a, m_bank);
+            has_a = false;
+        } else if (has_b && op_b.opType == Insert) {
+            assembler.append(op_b, other->m_bank);
+            has_b = false;
+        } else if (!has_b) {
+            assembler.append(op_a, m_bank);
+            has_a = false;
+        } else if (!has_a) {
+            // Leftover ops from the other changeset replace the implicit Keep
+            assembler.append(op_b, other->m_bank);
+            has_b = false;
+        } else {
+            Op piece = op_a;
+            if (op_a.chars > op_b.chars) {
+                piece.lines = op_b.lines;
+                piece.chars = op_b.chars;
+            }
+            op_a.lines -= piece.lines;
+            op_a.chars -= piece.chars;
+            if (op_a.opType == Insert)
+                op_a.bank += piece.chars;
+            op_b.lines -= piece.lines;
+            op_b.chars -= piece.chars;
+            has_a = op_a.chars > 0;
+            has_b = op_b.chars > 0;
+
+            if (op_b.opType == Keep) {
+                piece.attributes = m_pool->merge(piece.attributes,
+                                                 op_b.attributes,
+                                                 piece.opType == Insert);
+                assembler.append(piece, m_bank);
+            } else if (piece.opType == Keep) {
+                // delete by replacing the Keep
+                piece.opType = Delete;
+                piece.attributes = 0;
+                assembler.append(piece, m_bank);
+            }
+            // else delete by undoing the insert
         }
+    }
+    assembler.finish();
 
-        if (x_ops[b].opType == Keep) {
-            m_ops[a].mergeAttributes(x_ops[b].attributes);
-            a++;
-            b++;
-            continue;
-        }
+    qSwap(m_ops, out);
+    m_new_len = other->newLen();
+    m_tidy = true;
+    m_split = assembler.split();
+    m_attributes_valid = false;
+    compactBank();
+}
 
-        // x_ops[b] must be a Delete
-        m_new_len -= x_ops[b].chars;
+void Changeset::follow(const Changeset * other, bool insert_first) {
+    if (other->origLen() != m_orig_len) {
+        m_errors << "following changeset with wrong orig length";
+        return;
+    }
 
-        if (m_ops[a].opType == Insert) {
-            // delete by undoing the insert
-            m_ops.removeAt(a);
-            b++;
+    tidyOps();
+    other->tidyOps();
+    // Which of two Inserts goes first is decided for whole ops
+    if (m_split)
+        compactBank(true);
+    if (other->m_split)
+        other->compactBank(true);
+    const QVector<Op> & a_ops = other->m_ops;
+    QVector<Op> out;
+    out.reserve(m_ops.size() + a_ops.size());
+    Assembler assembler(out, m_bank);
+
+    // Walk both op lists over the original text, the way etherpad's
+    // follow() does. An op that runs out is taken off its list, and a
+    // list that runs out continues as the implicit Keep. The other's
+    // Inserts refer to its own bank, so they only ever go in as Keeps.
+    int a = 0;
+    int b = 0;
+    Op op_a;
+    Op op_b;
+    bool has_a = false;
+    bool has_b = false;
+    int old_pos = 0;  // position in the other changeset's new text
+    int new_len = 0;
+    forever {
+        if (!has_a && a < a_ops.size()) {
+            op_a = a_ops[a++];
+            has_a = true;
+        }
+        if (!has_b && b < m_ops.size()) {
+            op_b = m_ops[b++];
+            has_b = true;
+        }
+        if (!has_a && !has_b)
+            break;
+
+        bool insert_a = has_a && op_a.opType == Insert;
+        bool insert_b = has_b && op_b.opType == Insert;
+        if (insert_a || insert_b) {
+            bool other_goes;
+            if (!insert_b) {
+                other_goes = true;
+            } else if (!insert_a) {
+                other_goes = false;
+            } else if (m_pool->insertsFirst(op_a.attributes)
+                       != m_pool->insertsFirst(op_b.attributes)) {
+                other_goes = m_pool->insertsFirst(op_a.attributes);
+            } else if ((other->m_bank.at(op_a.bank) == '\n')
+                       != (m_bank.at(op_b.bank) == '\n')) {
+                // don't break up a line with a newline
+                other_goes = m_bank.at(op_b.bank) == '\n';
+            } else {
+                other_goes = !insert_first;
+            }
+            if (other_goes) {
+                // the other's text is already there
+                Op keep;
+                keep.opType = Keep;
+                keep.lines = op_a.lines;
+                keep.chars = op_a.chars;
+                keep.bank = 0;
+                keep.attributes = 0;
+                assembler.append(keep, m_bank);
+                old_pos += keep.chars;
+                new_len += keep.chars;
+                has_a = false;
+            } else {
+                assembler.append(op_b, m_bank);
+                new_len += op_b.chars;
+                has_b = false;
+            }
+        } else if (has_a && op_a.opType == Delete) {
+            // The text is gone, and with it whatever this one did to it
+            if (!has_b) {
+                has_a = false;
+            } else if (op_a.chars <= op_b.chars) {
+                op_b.lines -= op_a.lines;
+                op_b.chars -= op_a.chars;
+                has_a = false;
+                has_b = op_b.chars > 0;
+            } else {
+                op_a.lines -= op_b.lines;
+                op_a.chars -= op_b.chars;
+                has_b = false;
+            }
+        } else if (has_b && op_b.opType == Delete) {
+            // deleting text the other one kept
+            Op del = op_b;
+            if (!has_a) {
+                has_b = false;
+            } else if (op_b.chars <= op_a.chars) {
+                op_a.lines -= op_b.lines;
+                op_a.chars -= op_b.chars;
+                has_b = false;
+                has_a = op_a.chars > 0;
+            } else {
+                del.lines = op_a.lines;
+                del.chars = op_a.chars;
+                op_b.lines -= op_a.lines;
+                op_b.chars -= op_a.chars;
+                has_a = false;
+            }
+            assembler.append(del, m_bank);
+            old_pos += del.chars;
+        } else if (!has_a) {
+            assembler.append(op_b, m_bank);
+            old_pos += op_b.chars;
+            new_len += op_b.chars;
+            has_b = false;
+        } else if (!has_b) {
+            has_a = false;
         } else {
-            // delete by replacing the Keep
-            m_ops[a] = x_ops[b];
-            a++;
-            b++;
+            // both Keep
+            Op keep = op_b;
+            keep.attributes =
+                m_pool->follow(op_b.attributes, op_a.attributes);
+            if (op_a.chars <= op_b.chars) {
+                keep.lines = op_a.lines;
+                keep.chars = op_a.chars;
+                op_b.lines -= op_a.lines;
+                op_b.chars -= op_a.chars;
+                has_a = false;
+                has_b = op_b.chars > 0;
+            } else {
+                op_a.lines -= op_b.lines;
+                op_a.chars -= op_b.chars;
+                has_b = false;
+            }
+            assembler.append(keep, m_bank);
+            old_pos += keep.chars;
+            new_len += keep.chars;
         }
     }
 
-    // Leftover ops from the other changeset will replace the implicit Keep
-    while (b < x_ops.length()) {
-        m_ops << x_ops[b];
-        if (x_ops[b].opType == Delete)
-            m_new_len -= x_ops[b].chars;
-        else if (x_ops[b].opType == Insert)
-            m_new_len += x_ops[b].chars;
-        b++;
+    assembler.finish();
+
+    qSwap(m_ops, out);
+    m_orig_len = other->newLen();
+    m_new_len = new_len + m_orig_len - old_pos;
+    m_tidy = true;
+    m_split = assembler.split();
+    m_attributes_valid = false;
+    compactBank();
+}
+
+void Changeset::applyTo(Rope *text) const {
+    if (text->length() != m_orig_len)
+        m_errors << "applying changeset to text of the wrong length";
+
+    tidyOps();
+    int pos = 0;
+    Q_FOREACH (const Op & op, m_ops) {
+        if (op.opType == Keep) {
+            pos += op.chars;
+        } else if (op.opType == Delete) {
+            text->remove(pos, op.chars);
+        } else {
+            text->insert(pos, m_bank.constData() + op.bank, op.chars);
+            pos += op.chars;
+        }
     }
+}
 
-    m_tidy = false;
+bool Changeset::isIdentity() const {
+    tidyOps();
+    return m_ops.isEmpty() && m_orig_len == m_new_len;
 }
 
-void Changeset::follow(const Changeset * other) { // stub
+void Changeset::clear(int len) {
+    m_orig_len = len;
+    m_new_len = len;
+    m_ops.clear();
+    m_bank.clear();
+    m_tidy = true;
+    m_split = false;
+    m_attributes_valid = false;
 }
 
-// Numbers in the changeset are base-36 so [0-9a-z] matches a digit
+void Changeset::assign(const Changeset * other) {
+    m_orig_len = other->m_orig_len;
+    m_new_len = other->m_new_len;
+    m_ops = other->m_ops;
+    m_bank = other->m_bank;
+    m_tidy = other->m_tidy;
+    m_split = other->m_split;
+    m_attributes_valid = false;
+}
+
+// Numbers in the changeset are base-36, with digits [0-9a-z].
 // Prefix tokens are * for attribute spec, | for line count.
 // Op tokens are + for insert, - for delete, = for keep.
 // The changeset starts with special ops : (orig length) followed
 // by < or > (total change in length).
 // After the ops is a $ sign followed by all the characters to be inserted.
-#define OP_RE "([*][0-9a-z]+)*([|][0-9a-z]+)?[=+-][0-9a-z]+"
-#define CHANGESET_RE "Z:([0-9a-z]+)([<>])([0-9a-z]+)(" OP_RE ")+([$](.*))?"
+
+namespace {
+
+    // Reads the tokens of a changeset in order, straight from the string.
+    // After a syntax error every read returns false and error() is set.
+    class ChangesetReader {
+      public:
+        ChangesetReader(const QString & changeset)
+          : m_start(changeset.constData()), m_p(m_start),
+            m_end(m_start + changeset.length()), m_error(false),
+            m_canonical(true) { }
+
+        bool error() const { return m_error; }
+        // Whether the numbers so far were written the way
+        // QString::number() writes them
+        bool canonical() const { return m_canonical; }
+        int pos() const { return m_p - m_start; }
+
+        // The next character, or 0 at the end
+        ushort peek() const { return m_p < m_end ? m_p->unicode() : 0; }
+        bool skip(char c) {
+            if (peek() != c)
+                return false;
+            m_p++;
+            return true;
+        }
+        bool readNumber(int *value);
+        bool fail() { m_error = true; m_p = m_end; return false; }
+
+      private:
+        const QChar *m_start;
+        const QChar *m_p;
+        const QChar *m_end;
+        bool m_error;
+        bool m_canonical;
+    };
+
+    bool ChangesetReader::readNumber(int *value) {
+        const QChar *start = m_p;
+        qint64 result = 0;
+        for (; m_p < m_end; m_p++) {
+            ushort c = m_p->unicode();
+            int digit;
+            if (c >= '0' && c <= '9')
+                digit = c - '0';
+            else if (c >= 'a' && c <= 'z')
+                digit = c - 'a' + 10;
+            else
+                break;
+            result = result * 36 + digit;
+            if (result > INT_MAX)
+                return fail();
+        }
+        if (m_p == start)
+            return fail();
+        if (*start == '0' && m_p - start > 1)
+            m_canonical = false;  // leading zero
+        *value = int(result);
+        return true;
+    }
+
+}
 
 void Changeset::parse(const QString & changeset,
                       const QList<Attribute> & apool) {
-    QRegExp changesetMatcher(CHANGESET_RE);
-    QRegExp numberMatcher("[0-9a-z]+");
+    ChangesetReader reader(changeset);
 
-    if (!changeset.startsWith("Z:")) {
+    if (!reader.skip('Z') || !reader.skip(':')) {
         m_errors << "not a changeset";
         return;
     }
 
-    if (!changesetMatcher.exactMatch(changeset)) {
-        m_errors << "changeset syntax error";
-        return;
+    // The canonical form is what toString() would make of the ops, so
+    // check the rules it follows along the way instead of comparing.
+    bool canonical = true;
+    int difference = 0;
+    ushort sign = 0;
+    if (reader.readNumber(&m_orig_len)) {
+        sign = reader.peek();
+        if (reader.skip('>') || reader.skip('<'))
+            reader.readNumber(&difference);
+        else
+            reader.fail();
     }
-
-    m_orig_len = changesetMatcher.cap(1).toInt(0, 36);
-    int difference = changesetMatcher.cap(3).toInt(0, 36);
-    if (changesetMatcher.cap(2) == ">")
+    if (sign == '>')
         m_new_len = m_orig_len + difference;
     else
         m_new_len = m_orig_len - difference;
-
-    QString charbank = changesetMatcher.cap(8);
-    int charbank_used = 0;
-
-    // pos(4) unhelpfully gives the position of the *last* op, so avoid it.
-    int pos = changesetMatcher.pos(3) + changesetMatcher.cap(3).length();
-    while (pos < changeset.length() && changeset[pos] != '$') {
+    if (sign == '<' && difference == 0)
+        canonical = false;
+
+    int first = m_ops.size();
+    int kept = 0;
+    int deleted = 0;
+    int inserted = 0;  // also where the next insert's text starts
+    bool after_insert = false;  // was there an Insert since the last Keep?
+    // The numbers of apool's attributes in m_pool, looked up when first used
+    QVector<int> ids(apool.length(), -1);
+    QVector<int> attributes;
+    while (!reader.error() && reader.peek() != '$' && reader.peek() != 0) {
         Op op;
+        attributes.resize(0);
 
-        while (changeset[pos] == '*') {
-            numberMatcher.indexIn(changeset, pos + 1);
-            pos += 1 + numberMatcher.matchedLength();
-            int a = numberMatcher.cap(0).toInt(0, 36);
-
+        // The numbers depend on apool, so their order isn't checked
+        while (reader.skip('*')) {
+            int a;
+            if (!reader.readNumber(&a))
+                break;
             if (a >= apool.length()) {
                 m_errors << "changeset attribute out of range";
             } else {
-                op.attributes << apool[a];
+                if (ids[a] < 0)
+                    ids[a] = m_pool->id(apool[a]);
+                attributes << ids[a];
             }
         }
 
         op.lines = 0;
-        if (changeset[pos] == '|') {
-            numberMatcher.indexIn(changeset, pos + 1);
-            pos += 1 + numberMatcher.matchedLength();
-            op.lines = numberMatcher.cap(0).toInt(0, 36);
+        if (reader.skip('|')) {
+            reader.readNumber(&op.lines);
+            if (op.lines == 0)
+                canonical = false;
         }
 
-        op.opType = changeset[pos] == '=' ? Keep
-                  : changeset[pos] == '+' ? Insert
-                  : Delete;
-        
-        numberMatcher.indexIn(changeset, pos + 1);
-        pos += 1 + numberMatcher.matchedLength();
-        op.chars = numberMatcher.cap(0).toInt(0, 36);
-
-        if (op.opType == Insert) {
-            op.charbank = charbank.mid(charbank_used, op.chars);
-            charbank_used += op.chars;
-            if (op.charbank.length() != op.chars)
-                m_errors << "charset charbank is too short";
-            if (op.lines > 0 && !op.charbank.endsWith('\n'))
-                m_errors << "multiline insert does not end with newline";
-            Q_FOREACH (const Attribute & attr, op.attributes) {
-                if (attr.value.isEmpty())
+        if (reader.skip('='))
+            op.opType = Keep;
+        else if (reader.skip('+'))
+            op.opType = Insert;
+        else if (reader.skip('-'))
+            op.opType = Delete;
+        else
+            reader.fail();
+        op.chars = 0;
+        if (!reader.readNumber(&op.chars))
+            break;
+
+        op.bank = 0;
+        if (op.opType == Keep) {
+            kept += op.chars;
+            after_insert = false;
+        } else if (op.opType == Delete) {
+            deleted += op.chars;
+            // Deletes go before Inserts
+            if (after_insert)
+                canonical = false;
+        } else {
+            op.bank = inserted;
+            inserted += op.chars;
+            after_insert = true;
+            Q_FOREACH (int id, attributes) {
+                if (m_pool->attribute(id).value.isEmpty())
                     m_errors << "changeset inserts empty attribute";
             }
         }
 
-        if (op.opType == Delete && !op.attributes.isEmpty())
+        if (op.opType == Delete && !attributes.isEmpty())
             m_errors << "changeset has delete with attributes";
+        op.attributes = op.opType == Delete ? 0 : m_pool->set(attributes);
+
+        if (op.chars == 0)
+            canonical = false;
+        // It should not have been possible to merge it with the one before
+        if (m_ops.size() > first) {
+            const Op & prev = m_ops.last();
+            if (prev.opType == op.opType && prev.attributes == op.attributes
+                && (prev.lines == 0 || op.lines > 0))
+                canonical = false;
+        }
 
         m_ops << op;
     }
 
-    if (m_errors.isEmpty() && this->toString() != changeset)
-        m_errors << "changeset not in canonical form";
-}
-
-void Changeset::tidyOps() const {
-    int i = 0;
-    while (i < m_ops.length()) {
-        // Remove empty ops
-        if (m_ops[i].chars == 0) {
-            m_ops.removeAt(i);
-            continue;
-        }
+    if (reader.error() || m_ops.size() == first) {
+        m_ops.resize(first);
+        m_errors << "changeset syntax error";
+        return;
+    }
 
-        if (i == m_ops.length() - 1) {
-            // Remove implicit Keep at end
-            if (m_ops[i].opType == Keep && m_ops[i].attributes.isEmpty()) {
-                m_ops.removeAt(i);
-            }
-        } else {
-            // Make sure Delete comes before Insert
-            if (m_ops[i].opType == Insert && m_ops[i + 1].opType == Delete) {
-                m_ops.swap(i, i + 1);
-                // Recheck previous op now that it has a new neighbor.
-                // This is guaranteed to terminate eventually because
-                // the swaps only go in one direction.
-                if (i > 0)
-                    i--;
-                continue;
-            }
+    // The final Keep is always implicit
+    if (m_ops.last().opType == Keep && m_ops.last().attributes == 0)
+        canonical = false;
 
-            // Merge neighboring ops if possible
-            // A multiline op cannot be merged with a following single line op,
-            // but the other way around is ok.
-            if (m_ops[i].opType == m_ops[i + 1].opType
-                && m_ops[i].attributes == m_ops[i + 1].attributes
-                && (m_ops[i].lines == 0 || m_ops[i + 1].lines > 0)) {
-                m_ops[i].lines += m_ops[i + 1].lines;
-                m_ops[i].chars += m_ops[i + 1].chars;
-                m_ops[i].charbank.append(m_ops[i + 1].charbank);
-                m_ops.removeAt(i + 1);
-                continue;
-            }
+    // The inserts' text stays where it is in the charbank
+    if (reader.skip('$'))
+        m_bank = changeset.mid(reader.pos());
+    else
+        canonical = false;
+    if (inserted > m_bank.length()) {
+        m_errors << "charset charbank is too short";
+    } else {
+        if (inserted < m_bank.length())
+            canonical = false;
+        for (int i = first; i < m_ops.size(); i++) {
+            const Op & op = m_ops[i];
+            if (op.opType == Insert && op.lines > 0
+                && (op.chars == 0 || m_bank.at(op.bank + op.chars - 1) != '\n'))
+                m_errors << "multiline insert does not end with newline";
         }
-        i++;
     }
+
+    if (kept + deleted > m_orig_len
+        || m_orig_len - deleted + inserted != m_new_len)
+        m_errors << "changeset lengths do not add up";
+
+    canonical = canonical && reader.canonical();
+    if (m_errors.isEmpty() && !canonical)
+        m_errors << "changeset not in canonical form";
+    m_tidy = canonical;
+    m_split = false;
     m_attributes_valid = false;
-    m_tidy = true;
 }
 
-QString Changeset::Op::toString(const QList<Attribute> & apool) const {
-    QString result;
-    Q_FOREACH (const Attribute & attr, attributes) {
-        result.append("*" + QString::number(apool.indexOf(attr), 36));
-    }
-    if (lines > 0) {
-        result.append("|" + QString::number(lines, 36));
-    }
-    result.append(opType == Keep ? '=' : opType == Insert ? '+' : '-');
-    result.append(QString::number(chars, 36));
-    return result;
-}
+void Changeset::tidyOps() const {
+    if (m_tidy)
+        return;
 
-void Changeset::Op::splitFrom(Op & other, int lines, int chars) {
-    this->opType = other.opType;
-    this->lines = lines;
-    other.lines -= lines;
-    this->chars = chars;
-    other.chars -= chars;
-    if (this->opType == Insert) {
-        this->charbank = other.charbank.left(chars);
-        other.charbank = other.charbank.mid(chars);
+    QVector<Op> ops;
+    ops.reserve(m_ops.size());
+    Assembler assembler(ops, m_bank);
+    Q_FOREACH (const Op & op, m_ops) {
+        assembler.append(op, m_bank);
     }
-    this->attributes = other.attributes;
-}
+    assembler.finish();
 
-void Changeset::Op::mergeAttributes(const QList<Attribute> & attributes) {
-    bool needs_sort = false;
-
-    Q_FOREACH(const Attribute & attr, attributes) {
-        bool found = false;
-        for (int a = 0; a < this->attributes.length(); a++) {
-            if (this->attributes[a].key == attr.key) {
-                if (attr.value.isEmpty() && opType == Insert) {
-                    this->attributes.removeAt(a);
-                } else {
-                    this->attributes[a] = attr;
-                }
-                found = true;
-                break;
-            }
-        }
+    qSwap(m_ops, ops);
+    m_attributes_valid = false;
+    m_tidy = true;
+    m_split = assembler.split();
+    compactBank();
+}
 
-        if (!found) {
-            this->attributes << attr;
-            needs_sort = true;
+void Changeset::compactBank(bool force) const {
+    if (!force) {
+        int used = 0;
+        Q_FOREACH (const Op & op, m_ops) {
+            if (op.opType == Insert)
+                used += op.chars;
         }
+        // Copying the used text is paid for by the unused text
+        // appended since the last time
+        if (m_bank.length() - used <= used)
+            return;
     }
 
-    if (needs_sort)
-        qSort(this->attributes);
-}
-
-Attribute::Attribute(const QString & key, const QString & value) {
-    this->key = key;
-    this->value = value;
-}
+    // The text of every Insert comes from another bank, so it all
+    // ends up in order and split Inserts are merged
+    QVector<Op> ops;
+    ops.reserve(m_ops.size());
+    QString bank;
+    Assembler assembler(ops, bank);
+    Q_FOREACH (const Op & op, m_ops) {
+        assembler.append(op, m_bank);
+    }
+    assembler.finish();
 
-bool Attribute::operator< (const Attribute & other) const {
-    return this->key < other.key
-        || (this->key == other.key && this->value < other.value);
+    qSwap(m_ops, ops);
+    qSwap(m_bank, bank);
+    m_split = false;
 }
 
-bool Attribute::operator== (const Attribute & other) const {
-    return this->key == other.key && this->value == other.value;
+void Changeset::appendOp(QString & result, const Op & op) const {
+    const QVector<int> & apool = attributeIds();
+    Q_FOREACH (int id, m_pool->ids(op.attributes)) {
+        int index = qLowerBound(apool, id) - apool.constBegin();
+        result.append('*');
+        result.append(QString::number(index, 36));
+    }
+    if (op.lines > 0) {
+        result.append('|');
+        result.append(QString::number(op.lines, 36));
+    }
+    result.append(op.opType == Keep ? '=' : op.opType == Insert ? '+' : '-');
+    result.append(QString::number(op.chars, 36));
 }
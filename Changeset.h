@@ -5,17 +5,11 @@
 #include <QObject>
 #include <QString>
 #include <QStringList>
+#include <QVector>
 
-class Attribute {
-  public:
-    Attribute(const QString & key, const QString & value);
-
-    QString key;
-    QString value; // may be empty when used with Keep ops
+#include "AttributePool.h"
 
-    bool operator< (const Attribute & other) const;
-    bool operator== (const Attribute & other) const;
-};
+class Rope;
 
 class Changeset : public QObject {
     Q_OBJECT
@@ -33,13 +27,27 @@ class Changeset : public QObject {
     void addDelete(const QString & text);
     void addDelete(int lines, int chars);
 
+    // Make this the identity on a text of length len
+    void clear(int len = 0);
+    // Make this a copy of other
+    void assign(const Changeset * other);
+
     // apply() takes a changeset that's based on this one and folds it in,
     // so that this changeset applies the new changes too.
     void apply(const Changeset * other);
 
     // follow() takes a changeset that's based on the same revision as this one
     // and rebases this one so that it can be applied after the other one.
-    void follow(const Changeset * other);
+    // Where both insert at the same place, the other one's text goes first
+    // unless insert_first is set, as etherpad does it: an insert with the
+    // insertorder:first attribute still goes first, and otherwise text
+    // starting with a newline goes after text that doesn't.
+    void follow(const Changeset * other, bool insert_first = false);
+
+    // Make the changes to text, in place
+    void applyTo(Rope *text) const;
+    // Does it leave the text and attributes as they are?
+    bool isIdentity() const;
 
     QString toString() const;
     int origLen() const { return m_orig_len; }
@@ -55,30 +63,50 @@ class Changeset : public QObject {
 
   private:
     enum OpType { Keep, Insert, Delete };
-    class Op {
-      public:
+    // Ops are plain records kept in one array. The text of an Insert is
+    // a range of the changeset's character bank, and the attributes are
+    // a set in the AttributePool, so ops can be copied, split, merged and
+    // compared by adjusting numbers, without touching any text.
+    // The bank can also hold text that no op uses any more, and the
+    // inserts' text is not necessarily in order; compactBank() tidies
+    // it up when that's worth it.
+    struct Op {
         OpType opType;
         // if lines > 0, the op must be for text that ends with a newline
         int lines;
         int chars;
-        QString charbank;  // only for Insert
-        // the attribute list is kept sorted
-        QList<Attribute> attributes;  // not for Delete.
-
-        QString toString(const QList<Attribute> & apool) const;
-        void splitFrom(Op & other, int lines, int chars);
-        void mergeAttributes(const QList<Attribute> & attributes);
+        int bank;  // only for Insert: where its text starts in m_bank
+        int attributes;  // set number in m_pool; 0 for Delete
     };
 
+    // The attribute numbers the ops use, in order, which are numbered
+    // from 0 to make the apool that goes with toString()
+    const QVector<int> & attributeIds() const;
+    void appendOp(QString & result, const Op & op) const;
+    // Copy the inserts' text to a new bank in order, which also merges
+    // split Inserts. Without force, only when most of the bank is unused.
+    void compactBank(bool force = false) const;
+
+    // Builds a canonical op list and bank from ops appended in order
+    class Assembler;
+
     int m_orig_len;
     int m_new_len;
     // These are all 'mutable' just so that tidyOps() and attributes()
     // can be const. It's a pity, but that's what you get for delaying
     // expensive operations until they're needed.
-    mutable QList<Op> m_ops;
+    mutable QVector<Op> m_ops;
+    // The text of the Insert ops. The add methods, apply() and follow()
+    // append to it, and compactBank() drops the text no longer used.
+    mutable QString m_bank;
+    AttributePool *m_pool;
     mutable bool m_tidy; // are ops in canonical form?
-    // The attribute list is recalculated from m_ops when needed.
-    mutable QList<Attribute> m_attributes;
+    // Are there Inserts that canonical form merges, kept as separate
+    // ops because their text is apart in the bank? toString() merges
+    // them, and follow() first joins them with compactBank().
+    mutable bool m_split;
+    // The attributes are recalculated from m_ops when needed.
+    mutable QVector<int> m_attribute_ids;
     mutable bool m_attributes_valid;
     mutable QStringList m_errors;
 };
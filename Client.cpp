@@ -1,18 +1,24 @@
 #include "Client.h"
 
+#include "Stats.h"
+
 #include <QVariantMap>
 
 #include <QtGlobal>
 
 #include <qjson/serializer.h>
 
-#include "XhrClient.h"
+const Behaviour Client::c_lurk;
 
-Client::Client(QUrl padurl, const QString & name, QObject *parent)
+Client::Client(QUrl padurl, const QString & name,
+               Transport::Kind transport, QObject *parent)
   : QObject(parent), Logger(name), m_padurl(padurl), m_pad(name)  {
 
     m_state = CsCreated;
+    Stats::instance()->gauge("clients." + stateName(m_state), 1);
     m_logic = "lurk";
+    m_commit_stat = "commit.lurk";
+    m_behaviour = &c_lurk;
 
     QUrl baseurl(padurl);
     // Strip off p/PADNAME
@@ -23,36 +29,62 @@ Client::Client(QUrl padurl, const QString & name, QObject *parent)
 
     m_pad_id = m_padurl.path().section('/', -1, -1);
 
-    m_xhr = new XhrClient(padurl, baseurl, name, this);
-    connect(m_xhr, SIGNAL(ready()), SLOT(transportReady()));
-    connect(m_xhr, SIGNAL(disconnected()), SLOT(transportDisconnected()));
-    connect(m_xhr, SIGNAL(received_message(QVariant, QString)),
-                   SLOT(received_message(QVariant, QString)));
+    m_transport = Transport::create(transport, padurl, baseurl, name, this);
+    connect(m_transport, SIGNAL(ready()), SLOT(transportReady()));
+    connect(m_transport, SIGNAL(disconnected()),
+                         SLOT(transportDisconnected()));
+    connect(m_transport, SIGNAL(received_message(Message, QByteArray)),
+                         SLOT(received_message(Message, QByteArray)));
 
     m_kick.setSingleShot(true);
     connect(&m_kick, SIGNAL(timeout()), SLOT(kick()));
+    m_session.setSingleShot(true);
+    connect(&m_session, SIGNAL(timeout()), SLOT(endSession()));
 
     m_author_name = QString("robot") + name;
+    m_open_loop = false;
+    m_trace_id = 0;
+    m_join_started = -1;
+    m_vars_requested = -1;
 }
 
 Client::~Client() {
-    delete m_xhr;
+    Stats::instance()->gauge("clients." + stateName(m_state), -1);
+    delete m_transport;
 }
 
-void Client::setLogic(const QString & logic) {
+void Client::setBehaviour(const QString & logic, const Behaviour *behaviour) {
     m_logic = logic;
+    m_commit_stat = "commit." + logic;
+    m_behaviour = behaviour;
+}
+
+void Client::dropCommits() {
+    // The server won't acknowledge them on a new connection, and the
+    // waiting edits are lost when CLIENT_VARS resets the pad.
+    int edits = m_edits_waiting.length();
+    Q_FOREACH(const QList<qint64> & commit, m_commits_sent)
+        edits += commit.length();
+    if (edits > 0)
+        Stats::instance()->count("error.commit_lost", edits);
+    m_commits_sent.clear();
+    m_edits_waiting.clear();
+    m_pad.unsubmit();
 }
 
 void Client::start() {
+    dropCommits();
     changeState(CsStarting);
     kickAfter(10);
-    m_xhr->start();
+    m_join_started = Stats::usecs();
+    m_vars_requested = -1;
+    m_transport->start();
 }
 
 void Client::end() {
     log(Info, "terminating");
-    delete m_xhr;
-    m_xhr = 0;
+    delete m_transport;
+    m_transport = 0;
 }
 
 namespace {
@@ -72,50 +104,68 @@ namespace {
 void Client::transportReady() {
     // send CLIENT_READY message to server
 
-    QString token = m_xhr->getCookie("token");
+    QString token = m_transport->getCookie("token");
     if (token.isEmpty()) {
         token = QString("t.") + randomChars(20);
-        m_xhr->setCookie("token", token);
+        m_transport->setCookie("token", token);
     }
     
     QVariantMap msg;
     msg["component"] = "pad";
     msg["type"] = "CLIENT_READY";
     msg["padId"] = m_pad_id;
-    msg["sessionID"] = m_xhr->getCookie("sessionID");
-    msg["password"] = m_xhr->getCookie("password");
+    msg["sessionID"] = m_transport->getCookie("sessionID");
+    msg["password"] = m_transport->getCookie("password");
     msg["token"] = token;
     msg["protocolVersion"] = 2;
 
-    if (m_logic == "oldreconnect" && m_pad.rev() > 0) {
+    Behaviour::Action action = m_behaviour->action;
+    if (action == Behaviour::OldReconnect && m_pad.rev() > 0) {
         log(Info, "Sending CLIENT_VARS with reconnect and rev 0");
         msg["reconnect"] = true;
         msg["client_rev"] = 0; // lie!
         changeState(CsActive); // we won't get CLIENT_VARS on reconnect
-    } else if (m_logic == "disconnect") {
+    } else if (action == Behaviour::Disconnect) {
         log(Info, "Skipping GETVARS");
     } else {
         changeState(CsGettingVars);
+        m_vars_requested = Stats::usecs();
     }
     log(Info, "Sending initial CLIENT_READY");
-    m_xhr->send(msg);
+    Stats::instance()->count("sent.CLIENT_READY");
+    m_transport->send(msg);
 
-    if (m_logic == "disconnect") {
+    if (action == Behaviour::Disconnect) {
         log(Info, "Disconnecting");
-        m_xhr->disconnect();
+        m_transport->disconnect();
     }
 }
 
 void Client::transportDisconnected() {
     changeState(CsDisconnected);
-    kickAfter(1, 10);
+    if (m_behaviour->reconnect) {
+        kickAfter(m_behaviour->reconnect_delay);
+    } else {
+        log(Info, "staying disconnected");
+        m_kick.stop();
+    }
 }
 
 void Client::changeState(ClientState state) {
     if (m_state == state)
         return;
     log(Info, stateName(m_state) + " -> " + stateName(state));
+    Stats::instance()->gauge("clients." + stateName(m_state), -1);
+    Stats::instance()->gauge("clients." + stateName(state), 1);
     m_state = state;
+
+    if (state != CsActive) {
+        m_session.stop();
+    } else {
+        int msecs = m_behaviour->session.sampleMsecs();
+        if (msecs > 0)
+            m_session.start(msecs);
+    }
 }
 
 QString Client::stateName(ClientState state) {
@@ -134,12 +184,8 @@ void Client::kickAfter(int secs) {
     m_elapsed.start();
 }
 
-void Client::kickAfter(int secs_min, int secs_max) {
-    // convert to milliseconds
-    secs_min *= 1000;
-    secs_max *= 1000;
-    int msecs = qrand() % (secs_max - secs_min + 1) + secs_min;
-    m_kick.start(msecs);
+void Client::kickAfter(const Distribution & secs) {
+    m_kick.start(secs.sampleMsecs());
     m_elapsed.start();
 }
 
@@ -148,7 +194,7 @@ int Client::elapsedSecs() {
 }
 
 void Client::makeRandomEdit() {
-    int chars = qrand() % 20 + 1;
+    int chars = m_behaviour->edit_size.sampleInt(1);
     int len = m_pad.getNewLen() - 1; // subtract final newline
     if (chars >= len || qrand() & 1024) { // coinflip
         QList<Attribute> attrs;
@@ -168,6 +214,7 @@ void Client::kick() {
             break;
 
         case CsStarting:
+            Stats::instance()->count("error.timeout_transport");
             log(Error, "transport not ready after "
                        + QString::number(elapsedSecs()) + " seconds");
             log(Info, "retrying start");
@@ -175,6 +222,7 @@ void Client::kick() {
             break;
 
         case CsGettingVars:
+            Stats::instance()->count("error.timeout_vars");
             log(Error, "did not get client vars after "
                        + QString::number(elapsedSecs()) + " seconds");
             log(Info, "retrying CLIENT_READY");
@@ -182,18 +230,26 @@ void Client::kick() {
             break;
 
         case CsActive:
-            if (m_logic == "badfollow") {
-                sendBadFollow();
-            } else if (m_logic == "draw") {
-                for (int i = 1; i <= 3; i++)
-                    makeRandomEdit();
-                sendChangeset(m_pad.toChangeset(), m_pad.attributes());
-                kickAfter(10);
-            } else if (m_logic == "oldreconnect") {
-                if (m_pad.rev() > 0) {
-                    log(Info, "disconnecting for oldreconnect");
-                    start();
-                }
+            switch (m_behaviour->action) {
+                case Behaviour::BadFollow:
+                    sendBadFollow();
+                    break;
+                case Behaviour::Draw:
+                    if (m_open_loop)
+                        break;
+                    for (int i = m_behaviour->edits.sampleInt(1); i > 0; i--)
+                        makeRandomEdit();
+                    commitEdits(Stats::usecs());
+                    kickAfter(m_behaviour->think);
+                    break;
+                case Behaviour::OldReconnect:
+                    if (m_pad.rev() > 0) {
+                        log(Info, "disconnecting for oldreconnect");
+                        start();
+                    }
+                    break;
+                default:
+                    break;
             }
             break;
 
@@ -204,73 +260,209 @@ void Client::kick() {
     }
 }
 
-void Client::received_message(QVariant message, QString orig_text) {
-    QVariantMap msg = message.toMap();
-    if (msg["disconnect"].isValid()) {
-        QString disconnect_msg = msg["disconnect"].toString();
-        log(Warning, "received disconnect message: " + disconnect_msg);
-        changeState(CsDisconnected);
-        kickAfter(10);
-        return;
+void Client::endSession() {
+    log(Info, "session over, reconnecting");
+    start();
+}
+
+void Client::received_message(const Message & msg, QByteArray orig_text) {
+    Stats::instance()->count("received." + Message::typeName(msg.type));
+    switch (msg.type) {
+        case Message::Disconnect:
+            Stats::instance()->count("error.disconnect_message");
+            log(Warning, "received disconnect message: " + msg.disconnect);
+            changeState(CsDisconnected);
+            if (m_behaviour->reconnect) {
+                kickAfter(m_behaviour->reconnect_delay);
+            } else {
+                log(Info, "staying disconnected");
+                m_kick.stop();
+            }
+            return;
+
+        case Message::ClientVars:
+            if (m_state != CsGettingVars)
+                log(Error, "Received CLIENT_VARS in state " + stateName(m_state));
+            if (m_vars_requested >= 0) {
+                qint64 now = Stats::usecs();
+                Stats::instance()->record("join.vars", now - m_vars_requested);
+                Stats::instance()->record("join.total", now - m_join_started);
+                if (!m_bucket.isEmpty())
+                    Stats::instance()->record("pads." + m_bucket + ".join",
+                                              now - m_join_started);
+                m_vars_requested = -1;
+            }
+            getClientVars(msg);
+            changeState(CsActive);
+            if (m_behaviour->action == Behaviour::Draw)
+                kickAfter(m_behaviour->think);
+            else
+                kickAfter(10);
+            return;
+
+        case Message::UserNewInfo:
+            if (m_state != CsActive)
+                log(Error, "Received COLLABROOM in state " + stateName(m_state));
+            log(Verbose, "received USER_NEWINFO " + msg.infoUserId
+                         + " " + msg.infoName);
+            return;
+
+        case Message::UserLeave:
+            if (m_state != CsActive)
+                log(Error, "Received COLLABROOM in state " + stateName(m_state));
+            log(Verbose, "received USER_LEAVE " + msg.infoUserId);
+            return;
+
+        case Message::AcceptCommit:
+            if (m_state != CsActive)
+                log(Error, "Received COLLABROOM in state " + stateName(m_state));
+            acceptCommit(msg.newRev);
+            return;
+
+        case Message::NewChanges:
+            if (!m_bucket.isEmpty())
+                Stats::instance()->count("pads." + m_bucket + ".received");
+            if (m_state != CsActive)
+                log(Error, "Received COLLABROOM in state " + stateName(m_state));
+            m_pad.newChanges(msg.newRev, msg.changeset, msg.apool);
+            return;
+
+        case Message::Collabroom:
+            if (m_state != CsActive)
+                log(Error, "Received COLLABROOM in state " + stateName(m_state));
+            break;
+
+        case Message::Unknown:
+            break;
     }
-    if (msg["type"].toString() == "CLIENT_VARS") {
-        if (m_state != CsGettingVars)
-            log(Error, "Received CLIENT_VARS in state " + stateName(m_state));
-        getClientVars(msg["data"].toMap());
-        changeState(CsActive);
-        kickAfter(10);
+    log(Info, "Received unknown message " + QString::fromUtf8(orig_text));
+}
+
+void Client::acceptCommit(int new_rev) {
+    // The server handles a connection's commits in order, so the
+    // acknowledgement is for the oldest one outstanding.
+    if (m_commits_sent.isEmpty()) {
+        log(Warning, "received ACCEPT_COMMIT for rev "
+                     + QString::number(new_rev) + " without a pending commit");
         return;
     }
-    if (msg["type"].toString() == "COLLABROOM") {
-        if (m_state != CsActive) {
-            log(Error, "Received COLLABROOM in state " + stateName(m_state));
-        }
-        QVariantMap data = msg["data"].toMap();
-        if (data["type"].toString() == "USER_NEWINFO") {
-            QVariantMap info = data["userInfo"].toMap();
-            log(Verbose, "received USER_NEWINFO " + info["userId"].toString()
-                         + " " + info["name"].toString());
-            return;
-        }
-        if (data["type"].toString() == "USER_LEAVE") {
-            QVariantMap info = data["userInfo"].toMap();
-            log(Verbose, "received USER_LEAVE " + info["userId"].toString());
-            return;
-        }
+    m_pad.acceptCommit(new_rev);
+    qint64 now = Stats::usecs();
+    QList<qint64> intended = m_commits_sent.dequeue();
+    Q_FOREACH(qint64 usecs, intended) {
+        Stats::instance()->record(m_commit_stat, now - usecs);
+        if (!m_bucket.isEmpty())
+            Stats::instance()->record("pads." + m_bucket + ".commit",
+                                      now - usecs);
     }
-    log(Info, "Received unknown message " + orig_text);
+    log(Verbose, "commit accepted as rev " + QString::number(new_rev)
+                 + " after " + QString::number((now - intended[0]) / 1000.0)
+                 + " ms");
+
+    if (m_commits_sent.isEmpty())
+        sendWaitingEdits();
 }
 
-void Client::sendUserInfo() {
-    QVariantMap msg;
-    QVariantMap data;
-    QVariantMap info;
+void Client::edit(qint64 intended_usecs) {
+    makeRandomEdit();
+    commitEdits(intended_usecs);
+}
 
-    info["userId"] = m_author_id;
-    info["name"] = m_author_name;
-    info["colorId"] = m_color;
-    info["ip"] = "127.0.0.1";
-    info["userAgent"] = "Anonymous";
+void Client::commitEdits(qint64 intended_usecs) {
+    m_edits_waiting << intended_usecs;
+    // Like in the editor, only one commit may be outstanding; the rest
+    // wait for its ACCEPT_COMMIT and then go out together.
+    if (m_commits_sent.isEmpty())
+        sendWaitingEdits();
+}
 
-    data["type"] = "USERINFO_UPDATE";
-    data["userInfo"] = info;
+void Client::replay(Capture::Type type, const QByteArray & payload,
+                    qint64 intended_usecs) {
+    if (type == Capture::Changes) {
+        makeEdits(QString::fromUtf8(payload));
+        commitEdits(intended_usecs);
+    } else {
+        if (Capture::enabled())
+            Capture::record(m_trace_id, Capture::Packet, payload);
+        m_transport->send_raw(payload);
+    }
+}
 
-    msg["type"] = "COLLABROOM";
-    msg["component"] = "pad";
-    msg["data"] = data;
+void Client::makeEdits(const QString & changeset) {
+    // Z:ORIG>DIFF followed by ops like *0|2=1c+5-3, then $ and the
+    // inserted text. Attributes and line counts don't matter here: the
+    // text goes in with this client's author attribute.
+    int bank = changeset.indexOf('$');
+    if (!changeset.startsWith("Z:") || bank < 0) {
+        log(Warning, "cannot replay changeset " + changeset);
+        return;
+    }
+    int i = 2;
+    while (i < bank && changeset[i] != '=' && changeset[i] != '+'
+           && changeset[i] != '-' && changeset[i] != '|'
+           && changeset[i] != '*')
+        i++;  // skip the lengths
+
+    QList<Attribute> attrs;
+    attrs << Attribute("author", m_author_id);
+    int pos = 0;
+    int chars = bank + 1;
+    while (i < bank) {
+        QChar op = changeset[i++];
+        int start = i;
+        while (i < bank && changeset[i].isLetterOrNumber())
+            i++;
+        int n = changeset.mid(start, i - start).toInt(0, 36);
+        // the final newline stays where it is
+        int len = m_pad.getNewLen() - 1;
+        if (op == '=') {
+            pos += n;
+        } else if (op == '+') {
+            m_pad.insertAt(qMin(pos, len), changeset.mid(chars, n), attrs);
+            chars += n;
+            pos += n;
+        } else if (op == '-') {
+            n = qMin(n, len - pos);
+            if (n > 0)
+                m_pad.deleteAt(pos, n);
+        }
+    }
+}
 
+void Client::sendWaitingEdits() {
+    if (m_edits_waiting.isEmpty())
+        return;
+    if (!m_pad.hasChanges()) {
+        // like a replayed changeset that had nothing left to do here
+        m_edits_waiting.clear();
+        return;
+    }
+    QString changeset = m_pad.toChangeset();
+    QList<Attribute> attributes = m_pad.attributes();
+    m_pad.submit();
+    sendChangeset(changeset, attributes, m_edits_waiting);
+    m_edits_waiting.clear();
+}
+
+void Client::sendUserInfo() {
     log(Verbose, "sending userinfo update " + m_author_id + " "
                  + m_color + " " + m_author_name);
 
-    if (m_logic == "blackhat") {
-        msg["disconnect"] = "mysterious server error";
+    QString disconnect;
+    if (m_behaviour->action == Behaviour::Blackhat) {
+        disconnect = "mysterious server error";
         log(Info, "sending force-disconnect message to other clients");
     }
 
-    m_xhr->send(msg);
+    Stats::instance()->count("sent.USERINFO_UPDATE");
+    const QByteArray & packet = m_writer.userInfoUpdate(
+        m_author_id, m_author_name, m_color, disconnect);
+    if (Capture::enabled())
+        Capture::record(m_trace_id, Capture::Packet, packet);
+    m_transport->send_raw(packet);
 }
 
-void Client::getClientVars(QVariantMap vars) {
+void Client::getClientVars(const Message & vars) {
     // Known keys we don't care about
     //   abiwordAvailable    string "yes" or "no"
     //   clientIp            string "127.0.0.1" (literally)
@@ -293,76 +485,54 @@ void Client::getClientVars(QVariantMap vars) {
     //   initialRevisionList []
     //   savedRevisions      []
 
-    if (vars["padId"].toString() != m_pad_id) {
-        log(Warning, "Received client vars for pad " + vars["padId"].toString()
+    if (vars.padId != m_pad_id) {
+        log(Warning, "Received client vars for pad " + vars.padId
                      + " instead of expected " + m_pad_id);
     }
-    if (vars["globalPadId"].toString() != m_pad_id) {
-        log(Warning, "Received global pad id " + vars["globalPadId"].toString()
+    if (vars.globalPadId != m_pad_id) {
+        log(Warning, "Received global pad id " + vars.globalPadId
                      + " instead of expected " + m_pad_id);
     }
 
-    m_author_id = vars["userId"].toString();
+    m_author_id = vars.userId;
     log(Verbose, "received author id " + m_author_id);
 
     //   colorPalette        ["#ffc7c7", ...]
-    QVariantList palette = vars["colorPalette"].toList();
+    const QStringList & palette = vars.colorPalette;
     //   userColor           int (index into colorPalette)
-    int colorindex = vars["userColor"].toInt();
+    int colorindex = vars.userColor;
     if (colorindex < 0 || colorindex >= palette.length()) {
         log(Error, "Received userColor " + QString::number(colorindex)
             + " into palette size " + QString::number(palette.length()));
         m_color = "#7f7f7f";
     } else {
-        m_color = palette[colorindex].toString();
+        m_color = palette[colorindex];
         log(Trace, "got assigned color " + m_color);
     }
 
-    if (vars["userName"].toString().isEmpty()) {
+    if (vars.userName.isEmpty()) {
         sendUserInfo();
     } else {
-        m_author_name = vars["userName"].toString();
+        m_author_name = vars.userName;
         log(Info, "accepting author name " + m_author_name);
     }
 
-    QVariantMap collabvars = vars["collab_client_vars"].toMap();
-    // Known collab vars we don't care about
-    //   clientIp            string "127.0.0.1" (literally)
-    //   time                int (msecs since epoch)
-    //
-    // Known collab vars to use later
-    //   historicalAuthorData
-    //     map indexed by author ids, values are maps with keys
-    //        colorId, name (can be null), padIds
-    //       where padIds is a map with pad names as keys and all values 1
+    // collab_client_vars
+    //   apool, rev, initialAttributedText, padId, globalPadId
+    // (see Message.cpp for the ones that are skipped)
 
-    if (collabvars["globalPadId"].toString() != m_pad_id) {
+    if (vars.collabGlobalPadId != m_pad_id) {
         log(Warning, "Received collabvars global pad id "
-                     + collabvars["globalPadId"].toString()
+                     + vars.collabGlobalPadId
                      + " instead of expected " + m_pad_id);
     }
-    if (collabvars["padId"].toString() != m_pad_id) {
+    if (vars.collabPadId != m_pad_id) {
         log(Warning, "Received collabvars pad id "
-                     + collabvars["padId"].toString()
+                     + vars.collabPadId
                      + " instead of expected " + m_pad_id);
     }
 
-    //   apool["numToAttrib"]
-    //     map indexed by numeric strings, values are [attrib, value]
-    //   apool["nextNum"]    int, highest attrib + 1
-    QVariantMap apool_data = collabvars["apool"].toMap()["numToAttrib"].toMap();
-    int nextNum = collabvars["apool"].toMap()["nextNum"].toInt();
-    QList<Attribute> apool;
-    for (int i = 0; i < nextNum; i++) {
-        QVariantList attrib_data = apool_data[QString::number(i)].toList();
-        apool << Attribute(attrib_data[0].toString(),
-                           attrib_data[1].toString());
-    }
-
-    m_pad.setInitialText(collabvars["rev"].toInt(),
-        collabvars["initialAttributedText"].toMap()["text"].toString(),
-        collabvars["initialAttributedText"].toMap()["attribs"].toString(),
-        apool);
+    m_pad.setInitialText(vars.rev, vars.text, vars.attribs, vars.apool);
     log(Info, "received rev " + QString::number(m_pad.rev()));
 }
 
@@ -394,42 +564,25 @@ void Client::sendBadFollow() {
     msg["component"] = "pad";
     msg["data"] = data;
 
+    Stats::instance()->count("sent.USER_CHANGES");
     log(Warning, "sending bad follow changeset for rev "
                   + data["baseRev"].toString());
-    m_xhr->send(msg);
+    m_transport->send(msg);
 }
 
 void Client::sendChangeset(const QString & changeset,
-                           const QList<Attribute> & attributes) {
-    QVariantMap msg;
-    QVariantMap data;
-    QVariantMap apool;
-    QVariantMap num_to_attrib;
-    QVariantMap attrib_to_num;
-
-    // apool is sent in a particularly inefficient format.
-    for (int i = 0; i < attributes.length(); i++) {
-        QVariantList l;
-        l << attributes[i].key;
-        l << attributes[i].value;
-        num_to_attrib[QString::number(i)] = l;
-        attrib_to_num[attributes[i].key + "," + attributes[i].value] = i;
+                           const QList<Attribute> & attributes,
+                           const QList<qint64> & intended_usecs) {
+    if (log_enabled(Info)) {
+        // Jump through hoops to make sure newlines in changeset don't
+        // spoil the log
+        log(Info, "sending changeset for rev " + QString::number(m_pad.rev())
+            + ": " + QString::fromUtf8(QJson::Serializer().serialize(changeset)));
     }
-    apool["numToAttrib"] = num_to_attrib;
-    apool["attribToNum"] = attrib_to_num;
-    apool["nextNum"] = attributes.length();
-
-    data["type"] = "USER_CHANGES";
-    data["baseRev"] = m_pad.rev();
-    data["changeset"] = changeset;
-    data["apool"] = apool;
-
-    msg["type"] = "COLLABROOM";
-    msg["component"] = "pad";
-    msg["data"] = data;
-
-    // Jump through hoops to make sure newlines in changeset don't spoil the log
-    log(Info, "sending changeset for rev " + data["baseRev"].toString() + ": "
-        + QString::fromUtf8(QJson::Serializer().serialize(changeset)));
-    m_xhr->send(msg);
+    Stats::instance()->count("sent.USER_CHANGES");
+    if (Capture::enabled())
+        Capture::record(m_trace_id, Capture::Changes, changeset.toUtf8());
+    m_commits_sent.enqueue(intended_usecs);
+    m_transport->send_raw(m_writer.userChanges(m_pad.rev(), changeset,
+                                               attributes));
 }
@@ -3,21 +3,25 @@
 
 #include <QElapsedTimer>
 #include <QObject>
+#include <QQueue>
 #include <QString>
 #include <QTimer>
 #include <QUrl>
 #include <QVariant>
 
+#include "Behaviour.h"
+#include "Capture.h"
 #include "Logger.h"
+#include "MessageWriter.h"
 #include "Pad.h"
-
-class XhrClient;
+#include "Transport.h"
 
 class Client : public QObject, private Logger {
     Q_OBJECT
 
   public:
-    Client(QUrl padurl, const QString & name, QObject *parent = 0);
+    Client(QUrl padurl, const QString & name,
+           Transport::Kind transport = Transport::Xhr, QObject *parent = 0);
     virtual ~Client();
     void start();
 
@@ -26,41 +30,87 @@ class Client : public QObject, private Logger {
     };
     static QString stateName(ClientState state);
 
-    void setLogic(const QString & logic);
+    // logic is the client type or scenario class, naming the stats; the
+    // behaviour must outlive the client
+    void setBehaviour(const QString & logic, const Behaviour *behaviour);
+    // The client number in capture files (see Capture)
+    void setTraceId(quint32 id) { m_trace_id = id; }
+    // Also keep stats under pads.BUCKET (see PadSet)
+    void setPadBucket(const QString & bucket) { m_bucket = bucket; }
+
+    // In open-loop mode the client doesn't edit on its own schedule;
+    // OpenLoop calls edit() with the time each edit was due instead.
+    void setOpenLoop(bool open_loop) { m_open_loop = open_loop; }
+    bool isActive() const { return m_state == CsActive; }
+    void edit(qint64 intended_usecs);
+    // Send a record of a capture file, due at intended_usecs
+    void replay(Capture::Type type, const QByteArray & payload,
+                qint64 intended_usecs);
 
   protected slots:
     void transportReady();
     void transportDisconnected();
-    void received_message(QVariant message, QString orig_text);
+    void received_message(const Message & msg, QByteArray orig_text);
 
   private slots:
     void end();
     void kick();
+    void endSession();
 
   private:
     void changeState(ClientState state);
     void kickAfter(int secs);
-    void kickAfter(int secs_min, int secs_max);
+    void kickAfter(const Distribution & secs);
     int elapsedSecs();
-    void getClientVars(QVariantMap vars);
+    void getClientVars(const Message & vars);
+    void acceptCommit(int new_rev);
     void sendUserInfo();
     void sendBadFollow();
     void sendChangeset(const QString & changeset,
-                       const QList<Attribute> & attributes);
+                       const QList<Attribute> & attributes,
+                       const QList<qint64> & intended_usecs);
+    // Send the edits made so far, or have them wait for the outstanding
+    // commit
+    void commitEdits(qint64 intended_usecs);
+    void sendWaitingEdits();
+    void dropCommits();
     void makeRandomEdit();
+    // Make the edits of a changeset, as far as they fit the pad
+    void makeEdits(const QString & changeset);
 
     ClientState m_state;
     QString m_logic;
+    QString m_commit_stat;  // commit.LOGIC
+    const Behaviour *m_behaviour;
+    QString m_bucket;  // pad popularity bucket, or empty
+    quint32 m_trace_id;
     QUrl m_padurl;
-    XhrClient *m_xhr;
+    Transport *m_transport;
+    MessageWriter m_writer;
     QTimer m_kick;
+    QTimer m_session;  // ends a session of limited length
     QElapsedTimer m_elapsed;
+    bool m_open_loop;
+    // For the USER_CHANGES not yet accepted, if any, the times
+    // (from Stats::usecs()) its edits were due. Edits can wait for an
+    // earlier commit to be accepted, and that wait counts towards the
+    // latency. There is only ever one, since the pad changes are rebased
+    // over the changes of others until they are sent.
+    QQueue<QList<qint64> > m_commits_sent;
+    // Edits made locally but not sent yet
+    QList<qint64> m_edits_waiting;
+    // usecs when the current join started and CLIENT_READY was sent,
+    // or -1 when not waiting for CLIENT_VARS
+    qint64 m_join_started;
+    qint64 m_vars_requested;
     QString m_pad_id;
     // filled in from CLIENT_VARS message
     QString m_author_id;
     QString m_author_name;  // constructor fills in a default
     QString m_color;
     Pad m_pad;
+
+    static const Behaviour c_lurk;
 };
 
 #endif
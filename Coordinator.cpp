@@ -0,0 +1,163 @@
+#include "Coordinator.h"
+
+#include <QCoreApplication>
+#include <QHostAddress>
+#include <QTcpSocket>
+
+#include <qjson/parser.h>
+#include <qjson/serializer.h>
+
+// Refuse to buffer more than this much of an unfinished line
+#define MAX_LINE (16 * 1024 * 1024)
+// How long after the end of the run to wait for the agents
+#define GRACE_SECS 30
+
+Coordinator::Coordinator(int agents, const Run & run, QObject *parent)
+  : QObject(parent), Logger("coordinator"), m_agents(agents), m_run(run),
+    m_connected(0), m_finished(0), m_started(false) {
+    for (int i = 0; i < agents; i++)
+        m_snapshots << Stats::Snapshot();
+    connect(&m_server, SIGNAL(newConnection()), SLOT(accept_connection()));
+}
+
+bool Coordinator::listen(quint16 port) {
+    if (!m_server.listen(QHostAddress::Any, port)) {
+        log(Error, "cannot listen on port " + QString::number(port) + ": "
+                   + m_server.errorString());
+        return false;
+    }
+    log(Info, "waiting for " + QString::number(m_agents) + " agents on port "
+              + QString::number(port));
+    return true;
+}
+
+Stats::Snapshot Coordinator::read() const {
+    Stats::Snapshot total;
+    Q_FOREACH(const Stats::Snapshot & snapshot, m_snapshots)
+        total.add(snapshot);
+    return total;
+}
+
+QVariantMap Coordinator::configFor(int number) const {
+    // Client number i of each class goes to agent i % agents, so every
+    // agent gets the same mix
+    Scenario mine = m_run.scenario.slice(number, m_agents);
+    int drawers = m_run.scenario.drawers();
+
+    QVariantMap config;
+    config["type"] = "config";
+    config["agent"] = number;
+    config["agents"] = m_agents;
+    config["url"] = m_run.url;
+    config["pads"] = m_run.pads;
+    config["pad_dist"] = m_run.pad_dist;
+    config["scenario"] = mine.toVariant();
+    config["rate"] = drawers > 0 ? m_run.rate * mine.drawers() / drawers
+                                 : 0.0;
+    config["duration"] = m_run.duration;
+    config["profile"] = m_run.profile;
+    config["phases"] = m_run.phases;
+    return config;
+}
+
+void Coordinator::accept_connection() {
+    while (m_server.hasPendingConnections()) {
+        QTcpSocket *socket = m_server.nextPendingConnection();
+        if (m_connected == m_agents) {
+            log(Warning, "turning away an extra agent from "
+                         + socket->peerAddress().toString());
+            socket->abort();
+            socket->deleteLater();
+            continue;
+        }
+        Link link;
+        link.number = m_connected++;
+        link.ready = false;
+        m_links.insert(socket, link);
+        connect(socket, SIGNAL(readyRead()), SLOT(read_lines()));
+        connect(socket, SIGNAL(disconnected()), SLOT(drop_connection()));
+        log(Info, "agent " + QString::number(link.number) + " connected from "
+                  + socket->peerAddress().toString());
+    }
+}
+
+void Coordinator::read_lines() {
+    QTcpSocket *socket = qobject_cast<QTcpSocket *>(sender());
+    if (!socket || !m_links.contains(socket))
+        return;
+    QByteArray & input = m_links[socket].input;
+    input += socket->readAll();
+    int end;
+    while ((end = input.indexOf('\n')) >= 0) {
+        QByteArray line = input.left(end);
+        input.remove(0, end + 1);
+        bool ok;
+        QVariantMap message = QJson::Parser().parse(line, &ok).toMap();
+        if (!ok) {
+            log(Warning, "bad line from agent "
+                         + QString::number(m_links[socket].number));
+            continue;
+        }
+        handle(socket, message);
+        if (!m_links.contains(socket))
+            return;
+    }
+    if (input.size() > MAX_LINE)
+        socket->abort();
+}
+
+void Coordinator::handle(QTcpSocket *socket, const QVariantMap & message) {
+    Link & link = m_links[socket];
+    QString type = message["type"].toString();
+    if (type == "hello") {
+        send(socket, configFor(link.number));
+    } else if (type == "ready") {
+        link.ready = true;
+        int ready = 0;
+        Q_FOREACH(const Link & other, m_links)
+            if (other.ready)
+                ready++;
+        if (ready < m_agents || m_started)
+            return;
+        log(Info, "starting " + QString::number(m_agents) + " agents");
+        QVariantMap start;
+        start["type"] = "start";
+        Q_FOREACH(QTcpSocket *agent, m_links.keys())
+            send(agent, start);
+        m_started = true;
+        QTimer::singleShot((m_run.duration + GRACE_SECS) * 1000, this,
+                           SLOT(deadline()));
+        emit started();
+    } else if (type == "stats") {
+        m_snapshots[link.number] =
+            Stats::Snapshot::fromVariant(message["snapshot"].toMap());
+    }
+}
+
+void Coordinator::send(QTcpSocket *socket, const QVariantMap & message) {
+    socket->write(QJson::Serializer().serialize(message) + "\n");
+}
+
+void Coordinator::drop_connection() {
+    QTcpSocket *socket = qobject_cast<QTcpSocket *>(sender());
+    if (!socket || !m_links.contains(socket))
+        return;
+    int number = m_links[socket].number;
+    m_links.remove(socket);
+    socket->deleteLater();
+    if (!m_started) {
+        log(Error, "agent " + QString::number(number)
+                   + " left before the start");
+        qApp->exit(1);
+        return;
+    }
+    log(Verbose, "agent " + QString::number(number) + " finished");
+    if (++m_finished == m_agents)
+        qApp->quit();
+}
+
+void Coordinator::deadline() {
+    log(Warning, QString::number(m_agents - m_finished)
+                 + " agents still running, reporting without them");
+    qApp->quit();
+}
@@ -0,0 +1,94 @@
+#ifndef COORDINATOR_H
+#define COORDINATOR_H
+
+#include <QByteArray>
+#include <QList>
+#include <QMap>
+#include <QObject>
+#include <QString>
+#include <QTcpServer>
+#include <QTimer>
+#include <QVariant>
+
+#include "Logger.h"
+#include "Scenario.h"
+#include "Stats.h"
+
+class QTcpSocket;
+
+// Hands a run out to agent processes on other machines, starts them
+// together and reports for all of them.
+
+// The coordinator waits for the given number of agents to connect (see
+// Agent). Each one gets a slice of every client class, its share of the
+// open-loop rate, and the URL, drawings, duration, load profile and
+// phases. When all of them have their part, they are told to start at
+// once. From then on each agent sends its Stats snapshot every second
+// and when it finishes, and the coordinator merges them into one report
+// like it does for worker processes. It runs no clients of its own, and
+// quits when all agents have disconnected, or a while after the end of
+// the run.
+
+// The protocol is JSON, one object per line, with a "type":
+//   agent -> coordinator   hello
+//   coordinator -> agent   config {agent, agents, url, pads, pad_dist,
+//                                  scenario, rate, duration, profile,
+//                                  phases}
+//   agent -> coordinator   ready
+//   coordinator -> agent   start
+//   agent -> coordinator   stats {snapshot}
+// An agent that loses the coordinator carries on with its run.
+
+class Coordinator : public QObject, public Stats::Source, private Logger {
+    Q_OBJECT
+
+  public:
+    struct Run {
+        QString url;
+        int pads;
+        QString pad_dist;
+        Scenario scenario;  // from --clients or --scenario
+        double rate;
+        int duration;
+        QString profile;
+        QString phases;
+    };
+
+    Coordinator(int agents, const Run & run, QObject *parent = 0);
+
+    bool listen(quint16 port);
+
+    Stats::Snapshot read() const;
+
+  signals:
+    // All agents were told to start
+    void started();
+
+  private slots:
+    void accept_connection();
+    void read_lines();
+    void drop_connection();
+    void deadline();
+
+  private:
+    struct Link {
+        int number;
+        QByteArray input;
+        bool ready;
+    };
+
+    QVariantMap configFor(int number) const;
+    void handle(QTcpSocket *socket, const QVariantMap & message);
+    void send(QTcpSocket *socket, const QVariantMap & message);
+
+    int m_agents;
+    Run m_run;
+    QTcpServer m_server;
+    QMap<QTcpSocket *, Link> m_links;
+    int m_connected;  // agents that have connected so far
+    int m_finished;   // agents that disconnected after the start
+    bool m_started;
+    QList<Stats::Snapshot> m_snapshots;  // latest, by agent number
+};
+
+#endif
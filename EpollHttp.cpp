@@ -0,0 +1,618 @@
+#include "EpollHttp.h"
+
+#include <QDateTime>
+#include <QSocketNotifier>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <strings.h>  // for strncasecmp()
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#ifndef IP_BIND_ADDRESS_NO_PORT
+#define IP_BIND_ADDRESS_NO_PORT 24
+#endif
+
+#define EVENTS_PER_WAIT 256
+#define SCRATCH_SIZE 65536
+#define MAX_HEADER_SIZE 65536
+
+bool EpollHttp::c_enabled = false;
+QList<QByteArray> EpollHttp::c_sources;
+__thread EpollHttp *EpollHttp::c_instance = 0;
+
+EpollHttp::EpollHttp() : Logger("epoll") {
+    m_next_source = 0;
+    m_scratch = static_cast<char *>(malloc(SCRATCH_SIZE));
+
+    // Every simulated client needs two sockets, so the default
+    // limit of 1024 open files doesn't go far.
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &limit) == 0)
+            log(Verbose, "raised open file limit to "
+                         + QString::number(limit.rlim_cur));
+    }
+
+    m_epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (m_epoll < 0) {
+        log(Error, QString("epoll_create1 failed: ") + strerror(errno));
+        m_notifier = 0;
+        return;
+    }
+    m_notifier = new QSocketNotifier(m_epoll, QSocketNotifier::Read, this);
+    connect(m_notifier, SIGNAL(activated(int)), SLOT(process()));
+}
+
+EpollHttp::~EpollHttp() {
+    if (m_epoll >= 0)
+        close(m_epoll);
+    free(m_scratch);
+}
+
+EpollHttp *EpollHttp::instance() {
+    if (!c_instance)
+        c_instance = new EpollHttp;
+    return c_instance;
+}
+
+bool EpollHttp::setSourceAddresses(const QStringList & addresses) {
+    c_sources.clear();
+    Q_FOREACH(QString address, addresses) {
+        struct sockaddr_storage addr;
+        memset(&addr, 0, sizeof(addr));
+        QByteArray ip = address.toLatin1();
+        struct sockaddr_in *in4 = reinterpret_cast<struct sockaddr_in *>(&addr);
+        struct sockaddr_in6 *in6 = reinterpret_cast<struct sockaddr_in6 *>(&addr);
+        if (inet_pton(AF_INET, ip.constData(), &in4->sin_addr) == 1) {
+            in4->sin_family = AF_INET;
+        } else if (inet_pton(AF_INET6, ip.constData(), &in6->sin6_addr) == 1) {
+            in6->sin6_family = AF_INET6;
+        } else {
+            return false;
+        }
+        c_sources << QByteArray(reinterpret_cast<const char *>(&addr),
+                                sizeof(addr));
+    }
+    return true;
+}
+
+int EpollHttp::attach(Connection *conn) {
+    if (!m_free_slots.isEmpty()) {
+        int slot = m_free_slots.last();
+        m_free_slots.pop_back();
+        m_connections[slot] = conn;
+        return slot;
+    }
+    m_connections.append(conn);
+    return m_connections.size() - 1;
+}
+
+void EpollHttp::detach(int slot) {
+    m_connections[slot] = 0;
+    m_free_slots.append(slot);
+}
+
+// (Re)register a connection's socket for the events it needs now
+void EpollHttp::watch(Connection *conn, bool add) {
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLRDHUP;
+    if (conn->m_watch_output)
+        event.events |= EPOLLOUT;
+    event.data.u64 = (quint64(conn->m_slot) << 32) | conn->m_generation;
+    if (epoll_ctl(m_epoll, add ? EPOLL_CTL_ADD : EPOLL_CTL_MOD,
+                  conn->m_fd, &event) < 0)
+        log(Error, QString("epoll_ctl failed: ") + strerror(errno));
+}
+
+void EpollHttp::bind_source(int fd, int family) {
+    for (int tries = 0; tries < c_sources.size(); tries++) {
+        const QByteArray & source = c_sources[m_next_source];
+        m_next_source = (m_next_source + 1) % c_sources.size();
+        const struct sockaddr *addr =
+            reinterpret_cast<const struct sockaddr *>(source.constData());
+        if (addr->sa_family != family)
+            continue;
+        // Let connect() pick the port, so that ports are only
+        // unique per destination rather than per source address.
+        int one = 1;
+        setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one));
+        socklen_t len = family == AF_INET ? sizeof(struct sockaddr_in)
+                                          : sizeof(struct sockaddr_in6);
+        if (bind(fd, addr, len) < 0)
+            log(Error, QString("bind to source address failed: ")
+                       + strerror(errno));
+        return;
+    }
+}
+
+bool EpollHttp::resolve(const QString & host, int port,
+                        struct sockaddr_storage *addr, socklen_t *addrlen) {
+    QString key = host + ":" + QString::number(port);
+    QByteArray cached = m_resolved.value(key);
+    if (cached.isEmpty()) {
+        struct addrinfo hints;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        struct addrinfo *result = 0;
+        int err = getaddrinfo(host.toUtf8().constData(),
+                              QByteArray::number(port).constData(),
+                              &hints, &result);
+        if (err != 0 || !result) {
+            log(Error, "cannot resolve " + host + ": " + gai_strerror(err));
+            return false;
+        }
+        cached = QByteArray(reinterpret_cast<const char *>(result->ai_addr),
+                            result->ai_addrlen);
+        freeaddrinfo(result);
+        m_resolved[key] = cached;
+    }
+    memset(addr, 0, sizeof(*addr));
+    memcpy(addr, cached.constData(), cached.size());
+    *addrlen = cached.size();
+    return true;
+}
+
+void EpollHttp::process() {
+    struct epoll_event events[EVENTS_PER_WAIT];
+
+    // Don't hog the event loop; the notifier fires again if there's more
+    for (int round = 0; round < 16; round++) {
+        int n = epoll_wait(m_epoll, events, EVENTS_PER_WAIT, 0);
+        if (n < 0 && errno != EINTR)
+            log(Error, QString("epoll_wait failed: ") + strerror(errno));
+        if (n <= 0)
+            break;
+
+        for (int i = 0; i < n; i++) {
+            int slot = events[i].data.u64 >> 32;
+            quint32 generation = events[i].data.u64 & 0xffffffff;
+            Connection *conn = m_connections.value(slot);
+            // The connection may have been closed or reopened by
+            // an earlier event in this batch.
+            if (!conn || conn->m_generation != generation || conn->m_fd < 0)
+                continue;
+            conn->handle(events[i].events);
+        }
+
+        if (n < EVENTS_PER_WAIT)
+            break;
+    }
+}
+
+void EpollHttp::Buffer::reserve(int len) {
+    if (len <= capacity)
+        return;
+    int new_capacity = capacity ? capacity : 256;
+    while (new_capacity < len)
+        new_capacity *= 2;
+    data = static_cast<char *>(realloc(data, new_capacity));
+    capacity = new_capacity;
+}
+
+void EpollHttp::Buffer::append(const char *bytes, int len) {
+    reserve(size + len);
+    memcpy(data + size, bytes, len);
+    size += len;
+}
+
+void EpollHttp::Buffer::appendNumber(qint64 number) {
+    char digits[24];
+    int len = snprintf(digits, sizeof(digits), "%lld", (long long) number);
+    append(digits, len);
+}
+
+void EpollHttp::Buffer::consume(int len) {
+    if (len >= size) {
+        clear();
+        return;
+    }
+    memmove(data, data + len, size - len);
+    size -= len;
+}
+
+void EpollHttp::Buffer::swap(Buffer & other) {
+    qSwap(data, other.data);
+    qSwap(size, other.size);
+    qSwap(capacity, other.capacity);
+}
+
+void EpollHttp::Buffer::clear() {
+    size = 0;
+    // Give back memory after an unusually large response, since there
+    // may be tens of thousands of these buffers.
+    if (capacity > SCRATCH_SIZE) {
+        free(data);
+        data = 0;
+        capacity = 0;
+    }
+}
+
+EpollHttp::Connection::Connection(Listener *listener, int channel)
+  : m_listener(listener), m_channel(channel), m_generation(0), m_fd(-1),
+    m_state(Closed), m_watch_output(false), m_eof(false),
+    m_addrlen(0), m_pending(0) {
+    memset(&m_addr, 0, sizeof(m_addr));
+    m_slot = EpollHttp::instance()->attach(this);
+    reset_response();
+}
+
+EpollHttp::Connection::~Connection() {
+    close_fd();
+    EpollHttp::instance()->detach(m_slot);
+}
+
+bool EpollHttp::Connection::setTarget(const QUrl & url) {
+    int port = url.port(80);
+    if (!EpollHttp::instance()->resolve(url.host(), port, &m_addr, &m_addrlen))
+        return false;
+
+    m_headers = "Host: " + url.host().toUtf8();
+    if (url.port() != -1)
+        m_headers += ":" + QByteArray::number(port);
+    m_headers += "\r\n";
+    if (!url.userName().isEmpty()) {
+        QByteArray credentials =
+            (url.userName() + ":" + url.password()).toUtf8();
+        m_headers += "Authorization: Basic " + credentials.toBase64() + "\r\n";
+    }
+    return true;
+}
+
+void EpollHttp::Connection::request(const char *method,
+        const QByteArray & path, const QByteArray & extra_headers,
+        const QByteArray & body) {
+    m_out.append(method, strlen(method));
+    m_out.append(" ", 1);
+    m_out.append(path);
+    if (path.contains('?'))
+        m_out.append("&t=", 3);
+    else
+        m_out.append("?t=", 3);
+    m_out.appendNumber(QDateTime::currentMSecsSinceEpoch());
+    m_out.append(" HTTP/1.1\r\n", 11);
+    m_out.append(m_headers);
+    m_out.append(extra_headers);
+    if (!body.isEmpty() || strcmp(method, "POST") == 0) {
+        m_out.append("Content-Type: text/plain;charset=UTF-8\r\n", 40);
+        m_out.append("Content-Length: ", 16);
+        m_out.appendNumber(body.size());
+        m_out.append("\r\n", 2);
+    }
+    m_out.append("\r\n", 2);
+    m_out.append(body);
+    m_pending++;
+
+    if (m_state == Closed)
+        open();
+    else if (m_state == Open)
+        flush();
+}
+
+void EpollHttp::Connection::open() {
+    if (m_addrlen == 0) {
+        fail("no target address");
+        return;
+    }
+
+    m_fd = socket(m_addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (m_fd < 0) {
+        fail(QString("socket failed: ") + strerror(errno));
+        return;
+    }
+    int one = 1;
+    setsockopt(m_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    EpollHttp::instance()->bind_source(m_fd, m_addr.ss_family);
+
+    m_eof = false;
+    if (::connect(m_fd, reinterpret_cast<struct sockaddr *>(&m_addr),
+                  m_addrlen) == 0) {
+        m_state = Open;
+        m_watch_output = true;
+    } else if (errno == EINPROGRESS) {
+        m_state = Connecting;
+        m_watch_output = true;  // writable means connected
+    } else {
+        int err = errno;
+        fail(QString("connect failed: ") + strerror(err));
+        return;
+    }
+    EpollHttp::instance()->watch(this, true);
+}
+
+void EpollHttp::Connection::close_fd() {
+    if (m_fd >= 0) {
+        // closing also removes the fd from the epoll set
+        close(m_fd);
+        m_fd = -1;
+    }
+    m_state = Closed;
+    m_watch_output = false;
+    m_generation++;
+}
+
+void EpollHttp::Connection::abort() {
+    close_fd();
+    m_in.clear();
+    m_out.clear();
+    m_pending = 0;
+    reset_response();
+}
+
+void EpollHttp::Connection::fail(const QString & error) {
+    int pending = m_pending;
+    abort();
+    // An idle keep-alive connection going away is not an error
+    if (pending > 0)
+        m_listener->http_error(m_channel, error);
+}
+
+void EpollHttp::Connection::watch_output(bool enable) {
+    if (m_watch_output == enable)
+        return;
+    m_watch_output = enable;
+    EpollHttp::instance()->watch(this, false);
+}
+
+void EpollHttp::Connection::handle(quint32 events) {
+    if (m_state == Connecting) {
+        if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+            return;
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(m_fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err != 0) {
+            fail(QString("connect failed: ") + strerror(err));
+            return;
+        }
+        m_state = Open;
+    }
+
+    if (m_out.size > 0)
+        flush();
+    else if (events & EPOLLOUT)
+        watch_output(false);
+
+    if (m_fd >= 0 && (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+        read();
+}
+
+void EpollHttp::Connection::flush() {
+    while (m_out.size > 0) {
+        ssize_t n = send(m_fd, m_out.data, m_out.size, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                watch_output(true);
+                return;
+            }
+            if (errno == EINTR)
+                continue;
+            fail(QString("send failed: ") + strerror(errno));
+            return;
+        }
+        m_out.consume(n);
+    }
+    watch_output(false);
+}
+
+void EpollHttp::Connection::read() {
+    char *scratch = EpollHttp::instance()->m_scratch;
+    for (;;) {
+        ssize_t n = recv(m_fd, scratch, SCRATCH_SIZE, 0);
+        if (n > 0) {
+            m_in.append(scratch, n);
+            if (n < SCRATCH_SIZE)
+                break;
+        } else if (n == 0) {
+            m_eof = true;
+            break;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        } else {
+            fail(QString("recv failed: ") + strerror(errno));
+            return;
+        }
+    }
+
+    parse_responses();
+
+    if (m_eof && m_fd >= 0) {
+        if (m_pending > 0)
+            fail("connection closed by server");
+        else
+            abort();
+    }
+}
+
+void EpollHttp::Connection::reset_response() {
+    m_header_len = 0;
+    m_status = 0;
+    m_content_length = -1;
+    m_chunked = false;
+    m_close = false;
+}
+
+// Returns false if the headers are not complete yet
+bool EpollHttp::Connection::parse_headers() {
+    const char *end = static_cast<const char *>(
+        memmem(m_in.data, m_in.size, "\r\n\r\n", 4));
+    if (!end) {
+        if (m_in.size > MAX_HEADER_SIZE)
+            fail("response headers too long");
+        return false;
+    }
+    m_header_len = end - m_in.data + 4;
+
+    // status line: HTTP/1.1 200 OK
+    const char *line = m_in.data;
+    const char *eol = static_cast<const char *>(
+        memchr(line, '\n', m_header_len));
+    const char *space = static_cast<const char *>(memchr(line, ' ', eol - line));
+    m_status = space ? atoi(space + 1) : 0;
+    if (eol - line >= 8 && memcmp(line, "HTTP/1.0", 8) == 0)
+        m_close = true;
+
+    for (line = eol + 1; line < end; line = eol + 1) {
+        eol = static_cast<const char *>(memchr(line, '\n', end + 2 - line));
+        const char *colon = static_cast<const char *>(
+            memchr(line, ':', eol - line));
+        if (!colon)
+            continue;
+        int name_len = colon - line;
+        const char *value = colon + 1;
+        while (*value == ' ' || *value == '\t')
+            value++;
+        int value_len = eol - value;
+        while (value_len > 0 && (value[value_len - 1] == '\r'
+                                 || value[value_len - 1] == ' '))
+            value_len--;
+
+        if (name_len == 14 && strncasecmp(line, "Content-Length", 14) == 0) {
+            m_content_length = strtoll(value, 0, 10);
+        } else if (name_len == 17
+                   && strncasecmp(line, "Transfer-Encoding", 17) == 0) {
+            m_chunked = value_len >= 7 && strncasecmp(value, "chunked", 7) == 0;
+        } else if (name_len == 10 && strncasecmp(line, "Connection", 10) == 0) {
+            if (value_len >= 5 && strncasecmp(value, "close", 5) == 0)
+                m_close = true;
+            else if (value_len >= 10 && strncasecmp(value, "keep-alive", 10) == 0)
+                m_close = false;
+        } else if (name_len == 10 && strncasecmp(line, "Set-Cookie", 10) == 0) {
+            m_listener->http_set_cookie(QByteArray(value, value_len));
+        }
+    }
+    return true;
+}
+
+// Decode a chunked body in place, so that it ends up right after the
+// headers. Returns the body length, or -1 if it's not complete yet.
+// *end is set to the end of the encoded body in m_in.
+int EpollHttp::Connection::dechunk(int *end) {
+    // First check that the whole body is there
+    int pos = m_header_len;
+    for (;;) {
+        const char *crlf = static_cast<const char *>(
+            memmem(m_in.data + pos, m_in.size - pos, "\r\n", 2));
+        if (!crlf)
+            return -1;
+        long size = strtol(m_in.data + pos, 0, 16);
+        pos = crlf - m_in.data + 2;
+        if (size == 0) {
+            // skip trailers up to the empty line
+            for (;;) {
+                crlf = static_cast<const char *>(
+                    memmem(m_in.data + pos, m_in.size - pos, "\r\n", 2));
+                if (!crlf)
+                    return -1;
+                bool empty = crlf == m_in.data + pos;
+                pos = crlf - m_in.data + 2;
+                if (empty)
+                    break;
+            }
+            break;
+        }
+        if (pos + size + 2 > m_in.size)
+            return -1;
+        pos += size + 2;
+    }
+    *end = pos;
+
+    // Then move the chunk data together
+    int read = m_header_len;
+    int write = m_header_len;
+    for (;;) {
+        const char *crlf = static_cast<const char *>(
+            memmem(m_in.data + read, *end - read, "\r\n", 2));
+        long size = strtol(m_in.data + read, 0, 16);
+        read = crlf - m_in.data + 2;
+        if (size == 0)
+            break;
+        memmove(m_in.data + write, m_in.data + read, size);
+        write += size;
+        read += size + 2;
+    }
+    return write - m_header_len;
+}
+
+void EpollHttp::Connection::parse_responses() {
+    while (m_fd >= 0 && m_in.size > 0) {
+        if (m_header_len == 0 && !parse_headers())
+            return;
+
+        int body_len;
+        int end;
+        if (m_chunked) {
+            body_len = dechunk(&end);
+            if (body_len < 0)
+                return;
+        } else if (m_content_length >= 0) {
+            if (m_in.size - m_header_len < m_content_length)
+                return;
+            body_len = m_content_length;
+            end = m_header_len + body_len;
+        } else if (m_status == 204 || m_status == 304) {
+            body_len = 0;
+            end = m_header_len;
+        } else {
+            // body runs until the server closes the connection
+            if (!m_eof)
+                return;
+            body_len = m_in.size - m_header_len;
+            end = m_in.size;
+            m_close = true;
+        }
+
+        int status = m_status;
+        int body_start = m_header_len;
+        bool close = m_close;
+        m_pending--;
+        reset_response();
+
+        if (close) {
+            // Anything pipelined behind this response is lost with the
+            // connection. Keep the response data while the listener runs,
+            // since it may already start a new connection.
+            Buffer held;
+            held.swap(m_in);
+            int lost = m_pending;
+            m_pending = 0;
+            m_out.clear();
+            close_fd();
+            deliver(status, QByteArray::fromRawData(held.data + body_start,
+                                                    body_len));
+            if (lost > 0)
+                m_listener->http_error(m_channel, "connection closed with "
+                    + QString::number(lost) + " requests pending");
+            return;
+        }
+
+        // The listener may queue the next request or abort from inside
+        // the callback, so the response is consumed only if the
+        // connection is still the same afterwards.
+        quint32 generation = m_generation;
+        deliver(status, QByteArray::fromRawData(m_in.data + body_start,
+                                                body_len));
+        if (generation != m_generation)
+            return;
+        m_in.consume(end);
+    }
+}
+
+void EpollHttp::Connection::deliver(int status, const QByteArray & body) {
+    if (status < 200 || status >= 400)
+        m_listener->http_error(m_channel,
+                               "HTTP status " + QString::number(status));
+    else
+        m_listener->http_reply(m_channel, status, body);
+}
@@ -0,0 +1,179 @@
+#ifndef EPOLLHTTP_H
+#define EPOLLHTTP_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QList>
+#include <QObject>
+#include <QString>
+#include <QStringList>
+#include <QUrl>
+#include <QVector>
+
+#include <cstdlib>  // for free()
+#include <sys/socket.h>
+
+#include "Logger.h"
+
+class QSocketNotifier;
+
+// A small non-blocking HTTP/1.1 client engine built directly on epoll.
+
+// QNetworkAccessManager is convenient, but every request is a QNetworkReply
+// with its own buffers and signal connections, and the managers themselves
+// are heavy (see NetworkPool). For the tens of thousands of long-poll GETs
+// that xhr-polling clients keep open, that overhead is what limits how many
+// clients one process can simulate.
+
+// This engine keeps one epoll set per thread and hooks it into that
+// thread's event loop with a single socket notifier. A Connection is a long-lived
+// object owned by its user: it holds the socket and two byte buffers that
+// are reused for every request, so making a request allocates nothing.
+// Connections use keep-alive and pipeline requests if several are queued.
+// Responses are delivered to a Listener callback, with the body pointing
+// straight into the connection's input buffer.
+
+// Only plain http is supported. Basic authentication is sent up front
+// instead of waiting for a challenge.
+
+class EpollHttp : public QObject, private Logger {
+    Q_OBJECT
+
+  public:
+    static void setEnabled(bool enabled) { c_enabled = enabled; }
+    static bool enabled() { return c_enabled; }
+    // Local addresses to connect from, used round-robin. Each local address
+    // has its own range of ephemeral ports, and one range is not enough
+    // for 50k clients against a single server address.
+    static bool setSourceAddresses(const QStringList & addresses);
+    // The engine of the calling thread
+    static EpollHttp *instance();
+
+    // Receives the results of requests made on a Connection.
+    // The channel number is whatever the listener gave the connection.
+    class Listener {
+      public:
+        virtual ~Listener() { }
+        // body is only valid during the call
+        virtual void http_reply(int channel, int status,
+                                const QByteArray & body) = 0;
+        virtual void http_error(int channel, const QString & error) = 0;
+        virtual void http_set_cookie(const QByteArray & header) = 0;
+    };
+
+    // Byte buffer that keeps its memory when emptied
+    class Buffer {
+      public:
+        Buffer() : data(0), size(0), capacity(0) { }
+        ~Buffer() { free(data); }
+
+        void reserve(int len);
+        void append(const char *bytes, int len);
+        void append(const QByteArray & bytes)
+            { append(bytes.constData(), bytes.size()); }
+        void appendNumber(qint64 number);
+        void consume(int len);  // drop len bytes from the front
+        void clear();
+        void swap(Buffer & other);
+
+        char *data;
+        int size;
+        int capacity;
+
+      private:
+        Q_DISABLE_COPY(Buffer)
+    };
+
+    class Connection {
+      public:
+        Connection(Listener *listener, int channel);
+        ~Connection();
+
+        // Where to connect, and the headers to send with every request
+        // (Host and Authorization are added here).
+        bool setTarget(const QUrl & url);
+        // Queue a request. A cache-busting t= parameter is added to the
+        // path, like socket.io.js does. extra_headers must end in \r\n.
+        void request(const char *method, const QByteArray & path,
+                     const QByteArray & extra_headers,
+                     const QByteArray & body = QByteArray());
+        // Close the connection and forget outstanding requests,
+        // without calling the listener.
+        void abort();
+        int pending() const { return m_pending; }
+
+      private:
+        friend class EpollHttp;
+
+        enum State { Closed, Connecting, Open };
+
+        void open();
+        void close_fd();
+        void fail(const QString & error);
+        void watch_output(bool enable);
+        void handle(quint32 events);
+        void flush();
+        void read();
+        void parse_responses();
+        void deliver(int status, const QByteArray & body);
+        bool parse_headers();
+        int dechunk(int *end);
+        void reset_response();
+
+        Listener *m_listener;
+        int m_channel;
+        int m_slot;  // index in the engine's connection table
+        // Bumped whenever the socket goes away, so that stale epoll
+        // events for an old socket can be recognized.
+        quint32 m_generation;
+        int m_fd;
+        State m_state;
+        bool m_watch_output;
+        bool m_eof;
+
+        struct sockaddr_storage m_addr;
+        socklen_t m_addrlen;
+        QByteArray m_headers;
+
+        Buffer m_out;
+        Buffer m_in;
+        int m_pending;  // requests sent or queued without a response
+
+        // state of the response being received
+        int m_header_len;  // 0 until the headers are complete
+        int m_status;
+        qint64 m_content_length;  // -1 if not given
+        bool m_chunked;
+        bool m_close;
+
+        Q_DISABLE_COPY(Connection)
+    };
+
+  private slots:
+    void process();
+
+  private:
+    EpollHttp();
+    virtual ~EpollHttp();
+
+    int attach(Connection *conn);
+    void detach(int slot);
+    void watch(Connection *conn, bool add);
+    void bind_source(int fd, int family);
+    bool resolve(const QString & host, int port,
+                 struct sockaddr_storage *addr, socklen_t *addrlen);
+
+    int m_epoll;
+    QSocketNotifier *m_notifier;
+    QVector<Connection *> m_connections;
+    QVector<int> m_free_slots;
+    QHash<QString, QByteArray> m_resolved;  // "host:port" -> sockaddr
+    int m_next_source;
+    char *m_scratch;  // shared receive buffer
+
+    static bool c_enabled;
+    static QList<QByteArray> c_sources;  // sockaddrs to bind to
+    static __thread EpollHttp *c_instance;  // one per thread
+};
+
+#endif
@@ -0,0 +1,109 @@
+#include "FrameDecoder.h"
+
+#include <cstring>
+
+// U+FFFD in UTF-8
+#define MULTIMSG "\xef\xbf\xbd"
+#define MULTIMSG_LEN 3
+
+FrameDecoder::FrameDecoder(const QByteArray & payload)
+  : m_data(payload.constData()), m_size(payload.size()), m_pos(0),
+    m_error(false) {
+    m_framed = m_size >= MULTIMSG_LEN
+        && memcmp(m_data, MULTIMSG, MULTIMSG_LEN) == 0;
+}
+
+bool FrameDecoder::next(QByteArray *packet) {
+    if (m_error || m_pos >= m_size)
+        return false;
+
+    if (!m_framed) {
+        *packet = QByteArray::fromRawData(m_data, m_size);
+        m_pos = m_size;
+        return true;
+    }
+
+    // separator, digits, separator
+    if (m_size - m_pos < MULTIMSG_LEN
+        || memcmp(m_data + m_pos, MULTIMSG, MULTIMSG_LEN) != 0) {
+        m_error = true;
+        return false;
+    }
+    int pos = m_pos + MULTIMSG_LEN;
+    int length = 0;
+    while (pos < m_size && m_data[pos] >= '0' && m_data[pos] <= '9') {
+        length = length * 10 + (m_data[pos] - '0');
+        pos++;
+    }
+    if (m_size - pos < MULTIMSG_LEN
+        || memcmp(m_data + pos, MULTIMSG, MULTIMSG_LEN) != 0) {
+        m_error = true;
+        return false;
+    }
+    pos += MULTIMSG_LEN;
+
+    // Walk forward until length UTF-16 code units are covered
+    int start = pos;
+    int units = 0;
+    while (units < length && pos < m_size) {
+        uchar c = m_data[pos];
+        if (c < 0x80) {
+            pos += 1;
+            units += 1;
+        } else if (c < 0xe0) {
+            pos += 2;
+            units += 1;
+        } else if (c < 0xf0) {
+            pos += 3;
+            units += 1;
+        } else {
+            pos += 4;
+            units += 2;  // surrogate pair
+        }
+    }
+    if (units != length || pos > m_size) {
+        m_error = true;
+        return false;
+    }
+
+    *packet = QByteArray::fromRawData(m_data + start, pos - start);
+    m_pos = pos;
+    return true;
+}
+
+int FrameDecoder::packetType(const QByteArray & packet, QByteArray *data) {
+    const char *bytes = packet.constData();
+    int size = packet.size();
+
+    int type = 0;
+    int pos = 0;
+    while (pos < size && bytes[pos] >= '0' && bytes[pos] <= '9') {
+        type = type * 10 + (bytes[pos] - '0');
+        pos++;
+    }
+
+    // The data starts after the third colon, if there is one
+    int colons = 0;
+    while (pos < size && colons < 3) {
+        if (bytes[pos] == ':')
+            colons++;
+        pos++;
+    }
+    if (colons < 3)
+        *data = QByteArray();
+    else
+        *data = QByteArray::fromRawData(bytes + pos, size - pos);
+    return type;
+}
+
+int FrameDecoder::utf16Length(const char *utf8, int len) {
+    int length = 0;
+    for (int i = 0; i < len; i++) {
+        uchar c = utf8[i];
+        if ((c & 0xc0) != 0x80)  // not a continuation byte
+            length++;
+        if (c >= 0xf0)  // needs a surrogate pair
+            length++;
+    }
+    return length;
+}
@@ -0,0 +1,42 @@
+#ifndef FRAMEDECODER_H
+#define FRAMEDECODER_H
+
+#include <QByteArray>
+
+// Split socket.io payloads into packets, working on the raw UTF-8 bytes.
+
+// A payload is either a single packet, or several packets each framed as
+// U+FFFD, decimal length, U+FFFD, packet. The length counts UTF-16 code
+// units (it comes from javascript's string length), so finding the end of
+// a packet means walking its UTF-8 bytes and counting, but nothing needs
+// to be converted.
+
+// The packets and their data are returned as QByteArray::fromRawData
+// slices of the payload, so they are only valid while the payload is,
+// and must not be kept around.
+
+class FrameDecoder {
+  public:
+    FrameDecoder(const QByteArray & payload);
+
+    // Returns false when there are no more packets
+    bool next(QByteArray *packet);
+    // True if the framing was broken; next() returns false after that
+    bool error() const { return m_error; }
+
+    // Split a packet "type:id:endpoint:data" into its type and data
+    static int packetType(const QByteArray & packet, QByteArray *data);
+
+    static int utf16Length(const char *utf8, int len);
+    static int utf16Length(const QByteArray & utf8)
+        { return utf16Length(utf8.constData(), utf8.size()); }
+
+  private:
+    const char *m_data;
+    int m_size;
+    int m_pos;
+    bool m_framed;
+    bool m_error;
+};
+
+#endif
@@ -0,0 +1,149 @@
+#include "Histogram.h"
+
+#include <QtGlobal>
+
+#include <cstring>  // for memcpy()
+
+// Bits of the value kept exactly; 2^SUB_BITS values get a bucket each
+#define SUB_BITS 7
+#define SUB_COUNT (1 << SUB_BITS)
+#define HALF_COUNT (SUB_COUNT / 2)
+// Values up to 2^40 (12 days in microseconds) are kept apart
+#define MAX_SHIFT (40 - SUB_BITS + 1)
+#define BUCKETS (SUB_COUNT + MAX_SHIFT * HALF_COUNT)
+
+Histogram::Histogram()
+  : m_counts(BUCKETS), m_count(0), m_min(0), m_max(0), m_sum(0) {
+}
+
+int Histogram::bucketFor(qint64 value) {
+    if (value < SUB_COUNT)
+        return value < 0 ? 0 : value;
+    // Shift until the value fits in SUB_BITS; its top bit is then set,
+    // so only the lower half of the sub-buckets is used at each shift.
+    int shift = 0;
+    while ((value >> shift) >= SUB_COUNT)
+        shift++;
+    if (shift > MAX_SHIFT)
+        return BUCKETS - 1;
+    return SUB_COUNT + (shift - 1) * HALF_COUNT
+           + (int) (value >> shift) - HALF_COUNT;
+}
+
+qint64 Histogram::highestValueIn(int bucket) {
+    if (bucket < SUB_COUNT)
+        return bucket;
+    int shift = (bucket - SUB_COUNT) / HALF_COUNT + 1;
+    qint64 top = (bucket - SUB_COUNT) % HALF_COUNT + HALF_COUNT;
+    return ((top + 1) << shift) - 1;
+}
+
+void Histogram::record(qint64 value) {
+    m_counts[bucketFor(value)]++;
+    if (m_count == 0 || value < m_min)
+        m_min = value;
+    if (value > m_max)
+        m_max = value;
+    m_count++;
+    m_sum += value;
+}
+
+void Histogram::add(const Histogram & other) {
+    if (other.m_count == 0)
+        return;
+    for (int i = 0; i < BUCKETS; i++)
+        m_counts[i] += other.m_counts[i];
+    if (m_count == 0 || other.m_min < m_min)
+        m_min = other.m_min;
+    if (other.m_max > m_max)
+        m_max = other.m_max;
+    m_count += other.m_count;
+    m_sum += other.m_sum;
+}
+
+void Histogram::subtract(const Histogram & earlier) {
+    if (earlier.m_count == 0)
+        return;
+    int lowest = -1;
+    int highest = -1;
+    for (int i = 0; i < BUCKETS; i++) {
+        m_counts[i] -= earlier.m_counts[i];
+        if (m_counts[i] > 0) {
+            if (lowest < 0)
+                lowest = i;
+            highest = i;
+        }
+    }
+    m_count -= earlier.m_count;
+    m_sum -= earlier.m_sum;
+    if (m_count <= 0) {
+        reset();
+        return;
+    }
+    m_min = lowest > 0 ? highestValueIn(lowest - 1) + 1 : 0;
+    m_max = qMin(highestValueIn(highest), m_max);
+}
+
+int Histogram::rawSize() {
+    return 4 + BUCKETS;
+}
+
+void Histogram::saveRaw(qint64 *raw) const {
+    raw[0] = m_count;
+    raw[1] = m_min;
+    raw[2] = m_max;
+    memcpy(&raw[3], &m_sum, sizeof(m_sum));
+    memcpy(&raw[4], m_counts.constData(), BUCKETS * sizeof(qint64));
+}
+
+void Histogram::loadRaw(const qint64 *raw) {
+    m_count = raw[0];
+    m_min = raw[1];
+    m_max = raw[2];
+    memcpy(&m_sum, &raw[3], sizeof(m_sum));
+    memcpy(m_counts.data(), &raw[4], BUCKETS * sizeof(qint64));
+}
+
+void Histogram::reset() {
+    m_counts.fill(0);
+    m_count = 0;
+    m_min = 0;
+    m_max = 0;
+    m_sum = 0;
+}
+
+double Histogram::mean() const {
+    return m_count ? m_sum / m_count : 0;
+}
+
+qint64 Histogram::countUpTo(qint64 value) const {
+    qint64 total = 0;
+    for (int i = 0; i < BUCKETS && highestValueIn(i) <= value; i++)
+        total += m_counts[i];
+    return total;
+}
+
+qint64 Histogram::percentile(double p) const {
+    if (m_count == 0)
+        return 0;
+    // rank of the value wanted, counting from 1
+    qint64 rank = qint64(p / 100 * m_count + 0.5);
+    if (rank < 1)
+        rank = 1;
+    qint64 seen = 0;
+    for (int i = 0; i < BUCKETS; i++) {
+        seen += m_counts[i];
+        if (seen >= rank)
+            return qMin(highestValueIn(i), m_max);
+    }
+    return m_max;
+}
+
+QString Histogram::summary(double scale) const {
+    return "count=" + QString::number(m_count)
+        + " p50=" + QString::number(percentile(50) / scale)
+        + " p90=" + QString::number(percentile(90) / scale)
+        + " p99=" + QString::number(percentile(99) / scale)
+        + " p99.9=" + QString::number(percentile(99.9) / scale)
+        + " max=" + QString::number(m_max / scale);
+}
@@ -0,0 +1,64 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <QString>
+#include <QVector>
+
+// A latency histogram with fixed relative precision, in the style of
+// HdrHistogram.
+
+// Values below 128 get a bucket each. Above that, every power of two is
+// split into 64 buckets, so a recorded value is off by less than 1.6%
+// from the value it is reported as, however large it is. That keeps the
+// whole range from microseconds to days in about 2300 counters, and
+// recording is just an index computation and an increment.
+
+// Values are whatever unit the caller uses; Stats records microseconds.
+
+class Histogram {
+  public:
+    Histogram();
+
+    void record(qint64 value);
+    // Fold another histogram's counts into this one
+    void add(const Histogram & other);
+    // Take out the counts of an earlier state of this histogram. The
+    // min and max become the bounds of the lowest and highest buckets
+    // left, since the exact values are not known any more.
+    void subtract(const Histogram & earlier);
+    void reset();
+
+    // A flat copy for shared memory: rawSize() values, the count, min,
+    // max and sum followed by the buckets
+    static int rawSize();
+    void saveRaw(qint64 *raw) const;
+    void loadRaw(const qint64 *raw);
+
+    qint64 count() const { return m_count; }
+    qint64 min() const { return m_count ? m_min : 0; }
+    qint64 max() const { return m_max; }
+    double mean() const;
+    double sum() const { return m_sum; }
+    // How many recorded values are at most value, counting only whole
+    // buckets, so values sharing the boundary bucket may be left out
+    qint64 countUpTo(qint64 value) const;
+    // p is a percentage like 99.9; returns the largest value that
+    // falls in the same bucket as the value at that rank
+    qint64 percentile(double p) const;
+
+    // "count=N p50=... p90=... p99=... p99.9=... max=..." with the
+    // values divided by scale (1000 turns microseconds into milliseconds)
+    QString summary(double scale = 1000) const;
+
+  private:
+    static int bucketFor(qint64 value);
+    static qint64 highestValueIn(int bucket);
+
+    QVector<qint64> m_counts;
+    qint64 m_count;
+    qint64 m_min;
+    qint64 m_max;
+    double m_sum;
+};
+
+#endif
@@ -0,0 +1,135 @@
+#include "LoadProfile.h"
+
+#include <QRegExp>
+#include <QStringList>
+
+#include <cmath>
+#include <unistd.h>  // for usleep()
+
+#include "Client.h"
+#include "OpenLoop.h"
+#include "Stats.h"
+
+// How often the level is recomputed
+#define TICK_MSECS 100
+
+LoadProfile::LoadProfile(QObject *parent)
+  : QObject(parent), Logger("profile"), m_shape(Constant), m_phase(-1),
+    m_started(0) {
+    m_params[0] = m_params[1] = m_params[2] = 0;
+    connect(&m_timer, SIGNAL(timeout()), SLOT(tick()));
+}
+
+bool LoadProfile::setProfile(const QString & spec) {
+    QStringList parts = spec.split(':');
+    QString shape = parts.takeFirst();
+    if (parts.length() > 3)
+        return false;
+    for (int i = 0; i < parts.length(); i++) {
+        bool ok;
+        m_params[i] = parts[i].toDouble(&ok);
+        if (!ok || m_params[i] < 0)
+            return false;
+    }
+
+    if (shape == "linear" && parts.length() == 1 && m_params[0] > 0) {
+        m_shape = Linear;
+    } else if (shape == "step" && parts.length() == 2 && m_params[0] > 0
+               && m_params[1] >= 1) {
+        m_shape = Step;
+    } else if (shape == "spike" && parts.length() == 3 && m_params[2] <= 100) {
+        m_shape = Spike;
+    } else if (shape == "sine" && parts.length() == 2 && m_params[0] > 0
+               && m_params[1] <= 100) {
+        m_shape = Sine;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool LoadProfile::setPhases(const QString & spec) {
+    if (!QRegExp("\\w+:\\d+(,\\w+:\\d+)*").exactMatch(spec))
+        return false;
+    Q_FOREACH(QString item, spec.split(',')) {
+        Phase phase;
+        phase.name = item.section(':', 0, 0);
+        phase.secs = item.section(':', 1).toInt();
+        m_phases << phase;
+    }
+    return true;
+}
+
+int LoadProfile::phasesSecs() const {
+    int secs = 0;
+    Q_FOREACH(const Phase & phase, m_phases)
+        secs += phase.secs;
+    return secs;
+}
+
+void LoadProfile::addClient(Client *client) {
+    m_clients << client;
+}
+
+double LoadProfile::level(double secs) const {
+    switch (m_shape) {
+        case Constant:
+            return 1;
+        case Linear:
+            return qMin(1.0, secs / m_params[0]);
+        case Step:
+            return qMin(1.0, (std::floor(secs / m_params[0]) + 1) / m_params[1]);
+        case Spike:
+            if (secs >= m_params[0] && secs < m_params[0] + m_params[1])
+                return 1;
+            return m_params[2] / 100;
+        case Sine: {
+            double low = m_params[1] / 100;
+            double wave = (1 - std::cos(2 * M_PI * secs / m_params[0])) / 2;
+            return low + (1 - low) * wave;
+        }
+    }
+    return 1;
+}
+
+void LoadProfile::start() {
+    m_elapsed.start();
+    tick();
+    // A constant level has nothing more to do after starting everyone,
+    // unless there are phases to switch
+    if (m_shape != Constant || !m_phases.isEmpty())
+        m_timer.start(TICK_MSECS);
+}
+
+void LoadProfile::tick() {
+    double secs = m_elapsed.elapsed() / 1000.0;
+
+    // Find the phase, stopping at the last one
+    int phase = -1;
+    double phase_end = 0;
+    for (int i = 0; i < m_phases.length(); i++) {
+        phase = i;
+        phase_end += m_phases[i].secs;
+        if (secs < phase_end)
+            break;
+    }
+    if (phase != m_phase) {
+        m_phase = phase;
+        log(Info, "phase " + m_phases[phase].name + " for "
+                  + QString::number(m_phases[phase].secs) + " seconds");
+        Stats::instance()->setPhase(m_phases[phase].name,
+                                    m_phases[phase].name != "warmup");
+    }
+
+    double load = level(secs);
+    OpenLoop::instance()->setLevel(load);
+
+    int target = int(std::ceil(load * m_clients.length()));
+    if (target > m_started)
+        log(Verbose, "load level " + QString::number(load) + ", starting "
+                     + QString::number(target - m_started) + " clients");
+    while (m_started < target) {
+        m_clients[m_started++]->start();
+        usleep(1000); // give XhrClient a unique microsecond-based url
+    }
+}
@@ -0,0 +1,72 @@
+#ifndef LOADPROFILE_H
+#define LOADPROFILE_H
+
+#include <QElapsedTimer>
+#include <QList>
+#include <QObject>
+#include <QString>
+#include <QTimer>
+
+#include "Logger.h"
+
+class Client;
+
+// Shapes the load over the run, and divides the run into named phases.
+
+// A profile gives a load level between 0 and 1 for each moment of the
+// run:
+//   linear:SECS          rises evenly from 0 to 1 over SECS, then stays
+//   step:SECS:N          rises in N equal steps, one every SECS
+//   spike:AT:LEN:BASE    BASE percent, except 100% from AT for LEN secs
+//   sine:PERIOD:MIN      swings between MIN percent and 100%, starting low
+// Without a profile the level is 1 throughout.
+
+// The level sets how many of the clients have been started: clients are
+// started as it rises, but never stopped when it falls, so after the
+// highest point all of them are running. In open-loop mode it also
+// scales the edit rate, which follows it both ways.
+
+// Phases are given as NAME:SECS,NAME:SECS,... and follow each other from
+// the start of the run. Stats keeps latencies per phase, and a phase
+// named warmup is left out of the totals for the whole run.
+
+class LoadProfile : public QObject, private Logger {
+    Q_OBJECT
+
+  public:
+    LoadProfile(QObject *parent = 0);
+
+    bool setProfile(const QString & spec);
+    bool setPhases(const QString & spec);
+    // Sum of the phase lengths, 0 without phases
+    int phasesSecs() const;
+
+    // Clients are started in the order they are added
+    void addClient(Client *client);
+
+  public slots:
+    void start();
+
+  private slots:
+    void tick();
+
+  private:
+    enum Shape { Constant, Linear, Step, Spike, Sine };
+    double level(double secs) const;
+
+    struct Phase {
+        QString name;
+        int secs;
+    };
+
+    Shape m_shape;
+    double m_params[3];
+    QList<Phase> m_phases;
+    int m_phase;  // index into m_phases, -1 before the first
+    QList<Client *> m_clients;
+    int m_started;  // clients started so far, from the front of m_clients
+    QElapsedTimer m_elapsed;
+    QTimer m_timer;
+};
+
+#endif
@@ -11,6 +11,8 @@ class Logger {
 
     enum levels { Error = 1, Warning, Info, Verbose, Trace };
     static void set_global_level(int level);
+    // Check before building an expensive message
+    static bool log_enabled(int level) { return level <= c_level; }
 
     void log(int level, const QString & message) const;
 
@@ -0,0 +1,568 @@
+#include "Message.h"
+
+#include <QHash>
+#include <QMap>
+
+namespace {
+
+    // A pull reader over the UTF-8 bytes of a JSON document.
+    // Objects are read with beginObject() followed by nextKey() until it
+    // returns false, arrays with beginArray() followed by nextElement()
+    // until it returns false. Each key or element must be consumed with
+    // one of the read or skip calls. After a syntax error every call
+    // returns false and error() is set.
+    class JsonReader {
+      public:
+        JsonReader(const QByteArray & json)
+          : m_p(json.constData()), m_end(json.constData() + json.size()),
+            m_error(false) { }
+
+        bool error() const { return m_error; }
+        bool atEnd() { skipSpace(); return m_p == m_end; }
+
+        bool beginObject() { return expect('{'); }
+        bool beginArray() { return expect('['); }
+        // key is a raw slice of the input, escapes are not decoded
+        bool nextKey(QByteArray *key);
+        bool nextElement();
+
+        // Strings are decoded; other scalars give their literal text,
+        // null and containers give an empty string.
+        void readString(QString *out);
+        // The raw bytes of a string value, for comparing against names
+        void readName(QByteArray *out);
+        // Numbers are truncated; numeric strings are converted
+        void readInt(int *out);
+        void readStringList(QStringList *out);
+        void skipValue();
+
+      private:
+        void skipSpace() {
+            while (m_p < m_end && (*m_p == ' ' || *m_p == '\t'
+                                   || *m_p == '\n' || *m_p == '\r'))
+                m_p++;
+        }
+        bool expect(char c);
+        bool fail() { m_error = true; m_p = m_end; return false; }
+        // Moves past a string starting at m_p; returns the closing quote
+        const char *skipString(bool *escaped);
+        const char *skipScalar();
+        static QString unescape(const char *p, const char *stop);
+
+        const char *m_p;
+        const char *m_end;
+        bool m_error;
+    };
+
+    bool JsonReader::expect(char c) {
+        skipSpace();
+        if (m_p == m_end || *m_p != c)
+            return fail();
+        m_p++;
+        return true;
+    }
+
+    bool JsonReader::nextKey(QByteArray *key) {
+        skipSpace();
+        if (m_p == m_end)
+            return fail();
+        if (*m_p == '}') {
+            m_p++;
+            return false;
+        }
+        if (*m_p == ',') {
+            m_p++;
+            skipSpace();
+        }
+        if (m_p == m_end || *m_p != '"')
+            return fail();
+        bool escaped;
+        const char *start = m_p + 1;
+        const char *stop = skipString(&escaped);
+        if (!stop)
+            return false;
+        *key = QByteArray::fromRawData(start, stop - start);
+        return expect(':');
+    }
+
+    bool JsonReader::nextElement() {
+        skipSpace();
+        if (m_p == m_end)
+            return fail();
+        if (*m_p == ']') {
+            m_p++;
+            return false;
+        }
+        if (*m_p == ',')
+            m_p++;
+        return true;
+    }
+
+    const char *JsonReader::skipString(bool *escaped) {
+        *escaped = false;
+        const char *p = m_p + 1;
+        while (p < m_end && *p != '"') {
+            if (*p == '\\') {
+                *escaped = true;
+                p++;
+            }
+            p++;
+        }
+        if (p >= m_end) {
+            fail();
+            return 0;
+        }
+        m_p = p + 1;
+        return p;
+    }
+
+    const char *JsonReader::skipScalar() {
+        while (m_p < m_end && *m_p != ',' && *m_p != '}' && *m_p != ']'
+               && *m_p != ' ' && *m_p != '\t' && *m_p != '\n' && *m_p != '\r')
+            m_p++;
+        return m_p;
+    }
+
+    QString JsonReader::unescape(const char *p, const char *stop) {
+        QString result;
+        result.reserve(stop - p);
+        const char *run = p;
+        while (p < stop) {
+            if (*p != '\\') {
+                p++;
+                continue;
+            }
+            result += QString::fromUtf8(run, p - run);
+            p++;
+            char c = *p++;
+            switch (c) {
+                case 'b': result += QChar('\b'); break;
+                case 'f': result += QChar('\f'); break;
+                case 'n': result += QChar('\n'); break;
+                case 'r': result += QChar('\r'); break;
+                case 't': result += QChar('\t'); break;
+                case 'u': {
+                    // Surrogate pairs come as two escapes, and since
+                    // QString is UTF-16 they can be appended one by one.
+                    ushort code = 0;
+                    for (int i = 0; i < 4 && p < stop; i++, p++) {
+                        char h = *p;
+                        code <<= 4;
+                        if (h >= '0' && h <= '9')
+                            code |= h - '0';
+                        else if (h >= 'a' && h <= 'f')
+                            code |= h - 'a' + 10;
+                        else if (h >= 'A' && h <= 'F')
+                            code |= h - 'A' + 10;
+                    }
+                    result += QChar(code);
+                    break;
+                }
+                default: // '"', '\\' and '/'
+                    result += QChar(c);
+                    break;
+            }
+            run = p;
+        }
+        result += QString::fromUtf8(run, stop - run);
+        return result;
+    }
+
+    void JsonReader::readString(QString *out) {
+        skipSpace();
+        if (m_p == m_end) {
+            fail();
+            return;
+        }
+        char c = *m_p;
+        if (c == '"') {
+            bool escaped;
+            const char *start = m_p + 1;
+            const char *stop = skipString(&escaped);
+            if (!stop)
+                return;
+            if (escaped)
+                *out = unescape(start, stop);
+            else
+                *out = QString::fromUtf8(start, stop - start);
+        } else if (c == '{' || c == '[' || c == 'n') {
+            skipValue();
+            out->clear();
+        } else {
+            const char *start = m_p;
+            *out = QString::fromUtf8(start, skipScalar() - start);
+        }
+    }
+
+    void JsonReader::readName(QByteArray *out) {
+        skipSpace();
+        if (m_p < m_end && *m_p == '"') {
+            bool escaped;
+            const char *start = m_p + 1;
+            const char *stop = skipString(&escaped);
+            if (stop)
+                *out = QByteArray::fromRawData(start, stop - start);
+        } else {
+            skipValue();
+            out->clear();
+        }
+    }
+
+    void JsonReader::readInt(int *out) {
+        skipSpace();
+        if (m_p == m_end) {
+            fail();
+            return;
+        }
+        if (*m_p == '"') {
+            QString s;
+            readString(&s);
+            *out = s.toInt();
+            return;
+        }
+        if (*m_p != '-' && (*m_p < '0' || *m_p > '9')) {
+            skipValue();
+            *out = 0;
+            return;
+        }
+        bool negative = *m_p == '-';
+        if (negative)
+            m_p++;
+        int value = 0;
+        while (m_p < m_end && *m_p >= '0' && *m_p <= '9')
+            value = value * 10 + (*m_p++ - '0');
+        skipScalar(); // fraction or exponent
+        *out = negative ? -value : value;
+    }
+
+    void JsonReader::readStringList(QStringList *out) {
+        out->clear();
+        skipSpace();
+        if (m_p == m_end || *m_p != '[') {
+            skipValue();
+            return;
+        }
+        m_p++;
+        while (nextElement()) {
+            QString s;
+            readString(&s);
+            *out << s;
+        }
+    }
+
+    void JsonReader::skipValue() {
+        skipSpace();
+        if (m_p == m_end) {
+            fail();
+            return;
+        }
+        bool escaped;
+        char c = *m_p;
+        if (c == '"') {
+            skipString(&escaped);
+        } else if (c == '{' || c == '[') {
+            // Only the nesting matters here, and strings so that
+            // brackets inside them are not counted.
+            int depth = 0;
+            while (m_p < m_end) {
+                c = *m_p;
+                if (c == '"') {
+                    if (!skipString(&escaped))
+                        return;
+                    continue;
+                }
+                m_p++;
+                if (c == '{' || c == '[') {
+                    depth++;
+                } else if (c == '}' || c == ']') {
+                    if (--depth == 0)
+                        return;
+                }
+            }
+            fail();
+        } else {
+            skipScalar();
+        }
+    }
+
+    // Every key Client cares about, at whatever level it occurs.
+    // Looking them up in one hash avoids a chain of string compares
+    // for each key in the message.
+    enum Field {
+        NoField,
+        FieldType, FieldData, FieldDisconnect,
+        FieldPadId, FieldGlobalPadId, FieldUserId, FieldUserName,
+        FieldUserColor, FieldColorPalette, FieldCollabClientVars,
+        FieldRev, FieldApool, FieldInitialAttributedText,
+        FieldText, FieldAttribs, FieldNumToAttrib, FieldNextNum,
+        FieldNewRev, FieldChangeset, FieldAuthor, FieldUserInfo, FieldName
+    };
+
+    struct Tables {
+        QHash<QByteArray, Field> fields;
+        QHash<QByteArray, Message::Type> types;
+
+        Tables() {
+            fields["type"] = FieldType;
+            fields["data"] = FieldData;
+            fields["disconnect"] = FieldDisconnect;
+            fields["padId"] = FieldPadId;
+            fields["globalPadId"] = FieldGlobalPadId;
+            fields["userId"] = FieldUserId;
+            fields["userName"] = FieldUserName;
+            fields["userColor"] = FieldUserColor;
+            fields["colorPalette"] = FieldColorPalette;
+            fields["collab_client_vars"] = FieldCollabClientVars;
+            fields["rev"] = FieldRev;
+            fields["apool"] = FieldApool;
+            fields["initialAttributedText"] = FieldInitialAttributedText;
+            fields["text"] = FieldText;
+            fields["attribs"] = FieldAttribs;
+            fields["numToAttrib"] = FieldNumToAttrib;
+            fields["nextNum"] = FieldNextNum;
+            fields["newRev"] = FieldNewRev;
+            fields["changeset"] = FieldChangeset;
+            fields["author"] = FieldAuthor;
+            fields["userInfo"] = FieldUserInfo;
+            fields["name"] = FieldName;
+
+            types["CLIENT_VARS"] = Message::ClientVars;
+            types["COLLABROOM"] = Message::Collabroom;
+            types["NEW_CHANGES"] = Message::NewChanges;
+            types["ACCEPT_COMMIT"] = Message::AcceptCommit;
+            types["USER_NEWINFO"] = Message::UserNewInfo;
+            types["USER_LEAVE"] = Message::UserLeave;
+        }
+    };
+
+    static const Tables & tables() {
+        static Tables t;
+        return t;
+    }
+
+    static Field field(const QByteArray & key) {
+        return tables().fields.value(key, NoField);
+    }
+
+    static Message::Type typeFor(const QByteArray & name) {
+        return tables().types.value(name, Message::Unknown);
+    }
+
+    //   apool["numToAttrib"]
+    //     map indexed by numeric strings, values are [attrib, value]
+    //   apool["nextNum"]    int, highest attrib + 1
+    static void decodeApool(JsonReader & reader, QList<Attribute> *apool) {
+        QMap<int, Attribute> attribs;
+        int nextNum = -1;
+        QByteArray key;
+        if (!reader.beginObject())
+            return;
+        while (reader.nextKey(&key)) {
+            switch (field(key)) {
+                case FieldNumToAttrib:
+                    if (!reader.beginObject())
+                        return;
+                    while (reader.nextKey(&key)) {
+                        QString attrib, value;
+                        if (!reader.beginArray())
+                            return;
+                        if (reader.nextElement())
+                            reader.readString(&attrib);
+                        if (reader.nextElement())
+                            reader.readString(&value);
+                        while (reader.nextElement())
+                            reader.skipValue();
+                        attribs.insert(key.toInt(), Attribute(attrib, value));
+                    }
+                    break;
+                case FieldNextNum:
+                    reader.readInt(&nextNum);
+                    break;
+                default:
+                    reader.skipValue();
+                    break;
+            }
+        }
+        if (nextNum < 0)
+            nextNum = attribs.isEmpty() ? 0 : attribs.lastKey() + 1;
+        apool->clear();
+        for (int i = 0; i < nextNum; i++)
+            *apool << attribs.value(i, Attribute(QString(), QString()));
+    }
+
+    // Known collab vars we don't care about
+    //   clientIp            string "127.0.0.1" (literally)
+    //   time                int (msecs since epoch)
+    //   historicalAuthorData
+    //     map indexed by author ids, values are maps with keys
+    //        colorId, name (can be null), padIds
+    static void decodeCollabVars(JsonReader & reader, Message *msg) {
+        QByteArray key;
+        if (!reader.beginObject())
+            return;
+        while (reader.nextKey(&key)) {
+            switch (field(key)) {
+                case FieldPadId:
+                    reader.readString(&msg->collabPadId);
+                    break;
+                case FieldGlobalPadId:
+                    reader.readString(&msg->collabGlobalPadId);
+                    break;
+                case FieldRev:
+                    reader.readInt(&msg->rev);
+                    break;
+                case FieldApool:
+                    decodeApool(reader, &msg->apool);
+                    break;
+                case FieldInitialAttributedText:
+                    if (!reader.beginObject())
+                        return;
+                    while (reader.nextKey(&key)) {
+                        Field f = field(key);
+                        if (f == FieldText)
+                            reader.readString(&msg->text);
+                        else if (f == FieldAttribs)
+                            reader.readString(&msg->attribs);
+                        else
+                            reader.skipValue();
+                    }
+                    break;
+                default:
+                    reader.skipValue();
+                    break;
+            }
+        }
+    }
+
+    static void decodeUserInfo(JsonReader & reader, Message *msg) {
+        QByteArray key;
+        if (!reader.beginObject())
+            return;
+        while (reader.nextKey(&key)) {
+            Field f = field(key);
+            if (f == FieldUserId)
+                reader.readString(&msg->infoUserId);
+            else if (f == FieldName)
+                reader.readString(&msg->infoName);
+            else
+                reader.skipValue();
+        }
+    }
+
+    // The keys of CLIENT_VARS data and of the various COLLABROOM data
+    // don't overlap in meaning, so all of them are handled here
+    // and the data type does not need to be known in advance.
+    static void decodeData(JsonReader & reader, Message *msg,
+                           QByteArray *data_type) {
+        QByteArray key;
+        if (!reader.beginObject())
+            return;
+        while (reader.nextKey(&key)) {
+            switch (field(key)) {
+                case FieldType:
+                    reader.readName(data_type);
+                    break;
+                case FieldPadId:
+                    reader.readString(&msg->padId);
+                    break;
+                case FieldGlobalPadId:
+                    reader.readString(&msg->globalPadId);
+                    break;
+                case FieldUserId:
+                    reader.readString(&msg->userId);
+                    break;
+                case FieldUserName:
+                    reader.readString(&msg->userName);
+                    break;
+                case FieldUserColor:
+                    reader.readInt(&msg->userColor);
+                    break;
+                case FieldColorPalette:
+                    reader.readStringList(&msg->colorPalette);
+                    break;
+                case FieldCollabClientVars:
+                    decodeCollabVars(reader, msg);
+                    break;
+                case FieldNewRev:
+                    reader.readInt(&msg->newRev);
+                    break;
+                case FieldChangeset:
+                    reader.readString(&msg->changeset);
+                    break;
+                case FieldApool:
+                    decodeApool(reader, &msg->apool);
+                    break;
+                case FieldAuthor:
+                    reader.readString(&msg->author);
+                    break;
+                case FieldUserInfo:
+                    decodeUserInfo(reader, msg);
+                    break;
+                default:
+                    reader.skipValue();
+                    break;
+            }
+        }
+    }
+
+}
+
+Message::Message()
+  : type(Unknown), userColor(0), rev(0), newRev(0) {
+}
+
+QString Message::typeName(Type type) {
+    switch (type) {
+        case Unknown: return "UNKNOWN";
+        case Disconnect: return "DISCONNECT";
+        case ClientVars: return "CLIENT_VARS";
+        case Collabroom: return "COLLABROOM";
+        case NewChanges: return "NEW_CHANGES";
+        case AcceptCommit: return "ACCEPT_COMMIT";
+        case UserNewInfo: return "USER_NEWINFO";
+        case UserLeave: return "USER_LEAVE";
+    }
+    return "UNKNOWN";
+}
+
+bool Message::decode(const QByteArray & json, Message *msg) {
+    JsonReader reader(json);
+    QByteArray type_name;
+    QByteArray data_type;
+    bool disconnect = false;
+    QByteArray key;
+
+    if (!reader.beginObject())
+        return false;
+    while (reader.nextKey(&key)) {
+        switch (field(key)) {
+            case FieldType:
+                reader.readName(&type_name);
+                break;
+            case FieldData:
+                decodeData(reader, msg, &data_type);
+                break;
+            case FieldDisconnect:
+                reader.readString(&msg->disconnect);
+                disconnect = true;
+                break;
+            default:
+                reader.skipValue();
+                break;
+        }
+    }
+    if (reader.error() || !reader.atEnd())
+        return false;
+
+    if (disconnect) {
+        msg->type = Disconnect;
+    } else {
+        msg->type = typeFor(type_name);
+        if (msg->type == Collabroom) {
+            Type sub = typeFor(data_type);
+            if (sub != Unknown && sub != ClientVars && sub != Collabroom)
+                msg->type = sub;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,73 @@
+#ifndef MESSAGE_H
+#define MESSAGE_H
+
+#include <QByteArray>
+#include <QList>
+#include <QString>
+#include <QStringList>
+
+#include "Changeset.h"
+
+// An inbound message from the server, decoded into the fields Client uses.
+
+// The server's JSON messages can be large (CLIENT_VARS for a big pad
+// carries the whole text, history and author data), and Client only looks
+// at a dozen fields. Instead of building a QVariant tree of everything,
+// decode() reads the JSON in a single pass, looks up each key it meets
+// in a hash table, fills in the fields it knows and skips over the rest
+// without materializing it.
+
+// Which fields are filled in depends on the type; the others keep their
+// defaults.
+
+class Message {
+  public:
+    enum Type {
+        Unknown,
+        Disconnect,   // any message with a "disconnect" key
+        ClientVars,
+        Collabroom,   // COLLABROOM with a type not listed below
+        NewChanges,
+        AcceptCommit,
+        UserNewInfo,
+        UserLeave
+    };
+
+    Message();
+
+    // The message type as the server names it, like "NEW_CHANGES"
+    static QString typeName(Type type);
+
+    // Returns false if json is not a well-formed JSON object
+    static bool decode(const QByteArray & json, Message *msg);
+
+    Type type;
+
+    QString disconnect;     // Disconnect
+
+    // CLIENT_VARS data
+    QString padId;
+    QString globalPadId;
+    QString userId;
+    QString userName;
+    int userColor;
+    QStringList colorPalette;
+    // CLIENT_VARS collab_client_vars
+    QString collabPadId;
+    QString collabGlobalPadId;
+    int rev;
+    QString text;           // initialAttributedText
+    QString attribs;
+
+    // COLLABROOM data
+    int newRev;             // NEW_CHANGES, ACCEPT_COMMIT
+    QString changeset;      // NEW_CHANGES
+    QString author;         // NEW_CHANGES
+    QString infoUserId;     // USER_NEWINFO, USER_LEAVE
+    QString infoName;       // USER_NEWINFO
+
+    // CLIENT_VARS collab_client_vars or NEW_CHANGES data
+    QList<Attribute> apool;
+};
+
+#endif
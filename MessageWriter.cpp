@@ -0,0 +1,133 @@
+#include "MessageWriter.h"
+
+// Enough for a USER_CHANGES with a few attributes and a short edit
+#define INITIAL_CAPACITY 512
+
+#define PACKET_PREFIX "4:::"
+#define PACKET_PREFIX_LEN 4
+
+#define COLLABROOM_START \
+    "{\"type\":\"COLLABROOM\",\"component\":\"pad\",\"data\":"
+
+MessageWriter::MessageWriter() {
+}
+
+void MessageWriter::begin() {
+    // Shrinking to the prefix rather than clearing keeps the allocation;
+    // if the transport still shares the last packet this detaches instead.
+    if (m_buf.size() < PACKET_PREFIX_LEN) {
+        m_buf = PACKET_PREFIX;
+        m_buf.reserve(INITIAL_CAPACITY);
+    } else {
+        m_buf.resize(PACKET_PREFIX_LEN);
+    }
+}
+
+void MessageWriter::appendNumber(int n) {
+    char digits[12];
+    int len = 0;
+    unsigned int u = n < 0 ? -(unsigned int) n : n;
+    do {
+        digits[len++] = '0' + u % 10;
+        u /= 10;
+    } while (u);
+    if (n < 0)
+        m_buf += '-';
+    while (len > 0)
+        m_buf += digits[--len];
+}
+
+void MessageWriter::appendString(const QString & s) {
+    static const char hex[] = "0123456789abcdef";
+    const QChar *chars = s.constData();
+    int len = s.length();
+
+    m_buf += '"';
+    for (int i = 0; i < len; i++) {
+        uint c = chars[i].unicode();
+        if (c < 0x80) {
+            switch (c) {
+                case '"': m_buf += "\\\""; break;
+                case '\\': m_buf += "\\\\"; break;
+                case '\n': m_buf += "\\n"; break;
+                case '\r': m_buf += "\\r"; break;
+                case '\t': m_buf += "\\t"; break;
+                default:
+                    if (c < 0x20) {
+                        m_buf += "\\u00";
+                        m_buf += hex[c >> 4];
+                        m_buf += hex[c & 0xf];
+                    } else {
+                        m_buf += char(c);
+                    }
+                    break;
+            }
+            continue;
+        }
+        if (c >= 0xd800 && c < 0xdc00 && i + 1 < len) {
+            uint low = chars[i + 1].unicode();
+            if (low >= 0xdc00 && low < 0xe000) {
+                c = 0x10000 + ((c - 0xd800) << 10) + (low - 0xdc00);
+                i++;
+            }
+        }
+        if (c < 0x800) {
+            m_buf += char(0xc0 | (c >> 6));
+        } else if (c < 0x10000) {
+            m_buf += char(0xe0 | (c >> 12));
+            m_buf += char(0x80 | ((c >> 6) & 0x3f));
+        } else {
+            m_buf += char(0xf0 | (c >> 18));
+            m_buf += char(0x80 | ((c >> 12) & 0x3f));
+            m_buf += char(0x80 | ((c >> 6) & 0x3f));
+        }
+        m_buf += char(0x80 | (c & 0x3f));
+    }
+    m_buf += '"';
+}
+
+const QByteArray & MessageWriter::userChanges(int base_rev,
+        const QString & changeset, const QList<Attribute> & apool) {
+    begin();
+    m_buf += COLLABROOM_START "{\"type\":\"USER_CHANGES\",\"baseRev\":";
+    appendNumber(base_rev);
+    m_buf += ",\"changeset\":";
+    appendString(changeset);
+    // The server rebuilds attribToNum from numToAttrib, so it is left out
+    m_buf += ",\"apool\":{\"numToAttrib\":{";
+    for (int i = 0; i < apool.length(); i++) {
+        if (i > 0)
+            m_buf += ',';
+        m_buf += '"';
+        appendNumber(i);
+        m_buf += "\":[";
+        appendString(apool[i].key);
+        m_buf += ',';
+        appendString(apool[i].value);
+        m_buf += ']';
+    }
+    m_buf += "},\"nextNum\":";
+    appendNumber(apool.length());
+    m_buf += "}}}";
+    return m_buf;
+}
+
+const QByteArray & MessageWriter::userInfoUpdate(const QString & user_id,
+        const QString & name, const QString & color_id,
+        const QString & disconnect) {
+    begin();
+    m_buf += COLLABROOM_START "{\"type\":\"USERINFO_UPDATE\",\"userInfo\":{";
+    m_buf += "\"userId\":";
+    appendString(user_id);
+    m_buf += ",\"name\":";
+    appendString(name);
+    m_buf += ",\"colorId\":";
+    appendString(color_id);
+    m_buf += ",\"ip\":\"127.0.0.1\",\"userAgent\":\"Anonymous\"}}";
+    if (!disconnect.isEmpty()) {
+        m_buf += ",\"disconnect\":";
+        appendString(disconnect);
+    }
+    m_buf += '}';
+    return m_buf;
+}
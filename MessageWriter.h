@@ -0,0 +1,43 @@
+#ifndef MESSAGEWRITER_H
+#define MESSAGEWRITER_H
+
+#include <QByteArray>
+#include <QList>
+#include <QString>
+
+#include "Changeset.h"
+
+// Writes the messages a client sends during editing as ready-made
+// socket.io packets ("4:::{json}").
+
+// These messages always have the same shape, so instead of building
+// nested QVariantMaps and serializing them, the fixed parts are copied
+// in as literal text and only the variable fields are escaped. The
+// packet is written into a buffer owned by the writer, which keeps its
+// allocation from one message to the next as long as the transport
+// didn't hold on to the previous packet.
+
+class MessageWriter {
+  public:
+    MessageWriter();
+
+    // The returned packet is only valid until the next call.
+
+    const QByteArray & userChanges(int base_rev, const QString & changeset,
+                                   const QList<Attribute> & apool);
+    // The disconnect field is only added if it is not empty
+    const QByteArray & userInfoUpdate(const QString & user_id,
+                                      const QString & name,
+                                      const QString & color_id,
+                                      const QString & disconnect = QString());
+
+  private:
+    void begin();
+    void appendNumber(int n);
+    // Appends s as a quoted JSON string
+    void appendString(const QString & s);
+
+    QByteArray m_buf;
+};
+
+#endif
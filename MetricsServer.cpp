@@ -0,0 +1,176 @@
+#include "MetricsServer.h"
+
+#include <QHostAddress>
+#include <QMap>
+#include <QTcpSocket>
+
+#include "Histogram.h"
+#include "Stats.h"
+
+#define CONTENT_TYPE \
+    "application/openmetrics-text; version=1.0.0; charset=utf-8"
+
+// Refuse to buffer more than this much of a request head
+#define MAX_REQUEST 8192
+
+MetricsServer::MetricsServer(QObject *parent)
+  : QObject(parent), Logger("metrics") {
+    connect(&m_server, SIGNAL(newConnection()), SLOT(accept_connection()));
+}
+
+bool MetricsServer::listen(quint16 port) {
+    if (!m_server.listen(QHostAddress::LocalHost, port)) {
+        log(Error, "cannot listen on port " + QString::number(port) + ": "
+                   + m_server.errorString());
+        return false;
+    }
+    return true;
+}
+
+void MetricsServer::accept_connection() {
+    while (m_server.hasPendingConnections()) {
+        QTcpSocket *socket = m_server.nextPendingConnection();
+        m_requests.insert(socket, QByteArray());
+        connect(socket, SIGNAL(readyRead()), SLOT(read_request()));
+        connect(socket, SIGNAL(disconnected()), SLOT(drop_connection()));
+    }
+}
+
+void MetricsServer::read_request() {
+    QTcpSocket *socket = qobject_cast<QTcpSocket *>(sender());
+    if (!socket || !m_requests.contains(socket))
+        return;
+    QByteArray & request = m_requests[socket];
+    request += socket->readAll();
+    if (request.size() > MAX_REQUEST) {
+        socket->abort();
+        return;
+    }
+    if (!request.contains("\r\n\r\n") && !request.contains("\n\n"))
+        return;
+
+    QByteArray reply;
+    if (request.startsWith("GET ")) {
+        QByteArray body = metrics();
+        reply = "HTTP/1.1 200 OK\r\nContent-Type: " CONTENT_TYPE "\r\n"
+                "Content-Length: " + QByteArray::number(body.size()) + "\r\n"
+                "Connection: close\r\n\r\n" + body;
+    } else {
+        reply = "HTTP/1.1 405 Method Not Allowed\r\n"
+                "Content-Length: 0\r\nConnection: close\r\n\r\n";
+    }
+    // Stop reading, and close once the reply is written
+    m_requests.remove(socket);
+    socket->write(reply);
+    socket->disconnectFromHost();
+}
+
+void MetricsServer::drop_connection() {
+    QTcpSocket *socket = qobject_cast<QTcpSocket *>(sender());
+    if (!socket)
+        return;
+    m_requests.remove(socket);
+    socket->deleteLater();
+}
+
+namespace {
+
+    static QByteArray label(const char *name, const QString & value) {
+        QByteArray escaped = value.toUtf8();
+        escaped.replace('\\', "\\\\");
+        escaped.replace('"', "\\\"");
+        escaped.replace('\n', "\\n");
+        return QByteArray(name) + "=\"" + escaped + "\"";
+    }
+
+    static void sample(QByteArray *out, const char *metric,
+                       const QByteArray & labels, const QByteArray & value) {
+        *out += metric;
+        *out += '{';
+        *out += labels;
+        *out += "} ";
+        *out += value;
+        *out += '\n';
+    }
+
+    // Bucket boundaries in seconds for the exported histograms
+    static const double c_bounds[] = {
+        0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5,
+        1, 2.5, 5, 10, 30, 60
+    };
+
+}
+
+QByteArray MetricsServer::metrics() const {
+    Stats::Snapshot totals = Stats::instance()->snapshot();
+    QByteArray out;
+
+    out += "# TYPE stresstest_clients gauge\n"
+           "# HELP stresstest_clients Clients in each state.\n";
+    QMapIterator<QString, qint64> gt(totals.gauges);
+    while (gt.hasNext()) {
+        gt.next();
+        if (gt.key().startsWith("clients."))
+            sample(&out, "stresstest_clients",
+                   label("state", gt.key().section('.', 1)),
+                   QByteArray::number(gt.value()));
+    }
+
+    // Split the counters by prefix into the families listed in the header
+    QByteArray sent, received, errors, events;
+    QMapIterator<QString, qint64> ct(totals.counters);
+    while (ct.hasNext()) {
+        ct.next();
+        QString group = ct.key().section('.', 0, 0);
+        QString rest = ct.key().section('.', 1);
+        QByteArray value = QByteArray::number(ct.value());
+        if (group == "sent")
+            sample(&sent, "stresstest_messages_sent_total",
+                   label("type", rest), value);
+        else if (group == "received")
+            sample(&received, "stresstest_messages_received_total",
+                   label("type", rest), value);
+        else if (group == "error")
+            sample(&errors, "stresstest_errors_total",
+                   label("category", rest), value);
+        else
+            sample(&events, "stresstest_events_total",
+                   label("name", ct.key()), value);
+    }
+    out += "# TYPE stresstest_messages_sent counter\n"
+           "# HELP stresstest_messages_sent Messages sent by type.\n" + sent;
+    out += "# TYPE stresstest_messages_received counter\n"
+           "# HELP stresstest_messages_received Messages received by type.\n"
+           + received;
+    out += "# TYPE stresstest_errors counter\n"
+           "# HELP stresstest_errors Errors by category.\n" + errors;
+    out += "# TYPE stresstest_events counter\n"
+           "# HELP stresstest_events Other events counted during the run.\n"
+           + events;
+
+    out += "# TYPE stresstest_latency_seconds histogram\n"
+           "# HELP stresstest_latency_seconds Commit and join latencies.\n";
+    QMapIterator<QString, Histogram> ht(totals.histograms);
+    while (ht.hasNext()) {
+        ht.next();
+        const Histogram & h = ht.value();
+        QByteArray name = label("name", ht.key());
+        for (unsigned i = 0; i < sizeof(c_bounds) / sizeof(c_bounds[0]); i++) {
+            // the histogram counts microseconds
+            qint64 count = h.countUpTo(qint64(c_bounds[i] * 1000000));
+            sample(&out, "stresstest_latency_seconds_bucket",
+                   name + "," + label("le", QString::number(c_bounds[i])),
+                   QByteArray::number(count));
+        }
+        sample(&out, "stresstest_latency_seconds_bucket",
+               name + "," + label("le", "+Inf"),
+               QByteArray::number(h.count()));
+        sample(&out, "stresstest_latency_seconds_count", name,
+               QByteArray::number(h.count()));
+        sample(&out, "stresstest_latency_seconds_sum", name,
+               QByteArray::number(h.sum() / 1000000, 'f', 6));
+    }
+
+    out += "# EOF\n";
+    return out;
+}
@@ -0,0 +1,49 @@
+#ifndef METRICSSERVER_H
+#define METRICSSERVER_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QObject>
+#include <QTcpServer>
+
+#include "Logger.h"
+
+class QTcpSocket;
+
+// Serves the current Stats in OpenMetrics text format, so that a long
+// run can be scraped by Prometheus while it's going on.
+
+// Any GET gets the same answer; there is nothing else to serve. Each
+// connection is closed after one response, which keeps the server down
+// to reading a request head and writing the reply. It listens on
+// localhost only.
+
+// Names map to metrics like this:
+//   gauges clients.STATE     stresstest_clients{state="STATE"}
+//   counters sent.TYPE       stresstest_messages_sent_total{type="TYPE"}
+//   counters received.TYPE   stresstest_messages_received_total{type="TYPE"}
+//   counters error.CATEGORY  stresstest_errors_total{category="CATEGORY"}
+//   other counters           stresstest_events_total{name="NAME"}
+//   latencies                stresstest_latency_seconds{name="NAME"}
+
+class MetricsServer : public QObject, private Logger {
+    Q_OBJECT
+
+  public:
+    MetricsServer(QObject *parent = 0);
+
+    bool listen(quint16 port);
+
+  private slots:
+    void accept_connection();
+    void read_request();
+    void drop_connection();
+
+  private:
+    QByteArray metrics() const;
+
+    QTcpServer m_server;
+    QHash<QTcpSocket *, QByteArray> m_requests;
+};
+
+#endif
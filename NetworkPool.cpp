@@ -0,0 +1,159 @@
+#include "NetworkPool.h"
+
+#include <QAuthenticator>
+#include <QEventLoop>
+#include <QFile>
+#include <QNetworkAccessManager>
+#include <QNetworkReply>
+#include <QNetworkRequest>
+#include <QTimer>
+
+#include "Transport.h"
+
+// Throwaway managers for measureManagerCost(), and how long to give
+// their threads to get going
+#define MEASURE_MANAGERS 16
+#define MEASURE_MSECS 200
+
+int NetworkPool::c_clients_per_manager = 0;
+double NetworkPool::c_manager_threads = -1;
+double NetworkPool::c_manager_kb = -1;
+QAtomicInt NetworkPool::c_managers(0);
+QAtomicInt NetworkPool::c_clients(0);
+__thread NetworkPool *NetworkPool::c_instance = 0;
+
+NetworkPool::NetworkPool() : Logger("pool") {
+}
+
+void NetworkPool::setClientsPerManager(int clients) {
+    c_clients_per_manager = clients;
+}
+
+NetworkPool *NetworkPool::instance() {
+    if (!c_instance)
+        c_instance = new NetworkPool;
+    return c_instance;
+}
+
+QNetworkAccessManager *NetworkPool::acquire() {
+    for (int i = 0; i < m_members.length(); i++) {
+        if (m_members[i].clients < c_clients_per_manager) {
+            m_members[i].clients++;
+            return m_members[i].manager;
+        }
+    }
+
+    Member member;
+    member.manager = new QNetworkAccessManager(this);
+    member.clients = 1;
+    // The requests carry their transport as originating object,
+    // so that the right credentials can be looked up.
+    connect(member.manager,
+      SIGNAL(authenticationRequired(QNetworkReply *, QAuthenticator *)),
+      SLOT(authenticate(QNetworkReply *, QAuthenticator *)));
+    m_members << member;
+    countManager(1);
+    log(Trace, "created network manager " + QString::number(m_members.length()));
+    return member.manager;
+}
+
+void NetworkPool::release(QNetworkAccessManager *manager) {
+    // The manager is kept even when its last client goes away;
+    // a new client will pick it up.
+    for (int i = 0; i < m_members.length(); i++) {
+        if (m_members[i].manager == manager) {
+            m_members[i].clients--;
+            return;
+        }
+    }
+    log(Error, "released a network manager that is not in the pool");
+}
+
+void NetworkPool::authenticate(QNetworkReply *reply, QAuthenticator *auth) {
+    Transport *transport =
+        qobject_cast<Transport *>(reply->request().originatingObject());
+    if (transport)
+        transport->authenticate(reply, auth);
+    else
+        log(Error, "authentication requested for unknown transport");
+}
+
+namespace {
+
+    // Read a numeric field like "Threads:  5" from /proc/self/status.
+    // Returns -1 if it's not available.
+    static int proc_status(const QByteArray & field) {
+        QFile status("/proc/self/status");
+        if (!status.open(QIODevice::ReadOnly))
+            return -1;
+        Q_FOREACH(QByteArray line, status.readAll().split('\n')) {
+            if (line.startsWith(field + ":"))
+                return line.mid(field.length() + 1).trimmed()
+                           .split(' ')[0].toInt();
+        }
+        return -1;
+    }
+
+}
+
+void NetworkPool::measureManagerCost() {
+    int threads = proc_status("Threads");
+    int rss_kb = proc_status("VmRSS");
+    if (threads < 0 || rss_kb < 0)
+        return;
+
+    // A manager starts its HTTP thread with its first request. Nothing
+    // listens on port 1, so the requests cost the server nothing.
+    QList<QNetworkAccessManager *> managers;
+    QList<QNetworkReply *> replies;
+    for (int i = 0; i < MEASURE_MANAGERS; i++) {
+        QNetworkAccessManager *manager = new QNetworkAccessManager;
+        replies << manager->get(QNetworkRequest(QUrl("http://127.0.0.1:1/")));
+        managers << manager;
+    }
+    QEventLoop loop;
+    QTimer::singleShot(MEASURE_MSECS, &loop, SLOT(quit()));
+    loop.exec();
+
+    c_manager_threads =
+        double(proc_status("Threads") - threads) / MEASURE_MANAGERS;
+    c_manager_kb = double(proc_status("VmRSS") - rss_kb) / MEASURE_MANAGERS;
+
+    qDeleteAll(replies);
+    qDeleteAll(managers);
+}
+
+void NetworkPool::report() {
+    int clients = c_clients;
+    if (clients <= 0)
+        return;
+    int threads = proc_status("Threads");
+    int rss_kb = proc_status("VmRSS");
+
+    log(Info, QString("%1 clients on %2 network managers, "
+                      "%3 threads (%4 per client), "
+                      "RSS %5 kB (%6 kB per client)")
+        .arg(clients).arg(int(c_managers))
+        .arg(threads).arg(double(threads) / clients, 0, 'f', 2)
+        .arg(rss_kb).arg(double(rss_kb) / clients, 0, 'f', 1));
+
+    if (c_clients_per_manager > 0) {
+        int avoided = clients - c_managers;
+        if (c_manager_threads < 0) {
+            log(Info, QString("pooling avoided %1 network managers")
+                .arg(avoided));
+            return;
+        }
+        // One manager per client would have taken avoided more of them
+        double threads_saved = avoided * c_manager_threads;
+        double kb_saved = avoided * c_manager_kb;
+        log(Info, QString("pooling avoided %1 network managers, "
+                          "saving about %2 threads (%3 per client) and "
+                          "%4 kB RSS (%5 kB per client)")
+            .arg(avoided)
+            .arg(threads_saved, 0, 'f', 0)
+            .arg(threads_saved / clients, 0, 'f', 2)
+            .arg(kb_saved, 0, 'f', 0)
+            .arg(kb_saved / clients, 0, 'f', 1));
+    }
+}
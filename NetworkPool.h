@@ -0,0 +1,93 @@
+#ifndef NETWORKPOOL_H
+#define NETWORKPOOL_H
+
+#include <QAtomicInt>
+#include <QList>
+#include <QObject>
+
+#include "Logger.h"
+
+class QAuthenticator;
+class QNetworkAccessManager;
+class QNetworkReply;
+
+// Hands out shared network access managers to the transports.
+
+// By default every transport gets its own QNetworkAccessManager, so that
+// simulated clients don't share connections. That is faithful, but each
+// manager brings its own HTTP thread, caches and bookkeeping, and at a few
+// thousand clients those are what limit the load box.
+
+// With pooling enabled, a manager is shared by a small fixed number of
+// clients. Left to itself, the manager would send any client's request
+// on whichever of its keep-alive connections is free, including ones
+// other clients opened. So pooled requests ask for "Connection: close"
+// (see Transport::make_request()): every connection carries a single
+// request of a single client, and no client ever uses a connection
+// another one opened. The price is a new connection for each request,
+// where an unpooled client keeps its connections alive, and a request
+// can wait for one of the manager's 6 connections per host when more
+// than that are in flight. Each client keeps the manager it was given
+// for its whole life, including restarts. Cookies are not shared: each
+// transport keeps its own jar and handles the cookie headers itself.
+
+// What pooling saves is measured rather than guessed: at the start,
+// measureManagerCost() runs a few throwaway managers to see how many
+// threads and how much memory one costs, and report() multiplies that
+// by the managers the pool didn't create.
+
+// Managers can only be used from the thread that created them, so each
+// worker thread has a pool of its own. The counts for the report are
+// shared by all of them.
+
+class NetworkPool : public QObject, private Logger {
+    Q_OBJECT
+
+  public:
+    // 0 means no pooling: one manager per client
+    static void setClientsPerManager(int clients);
+    static int clientsPerManager() { return c_clients_per_manager; }
+    // The pool of the calling thread
+    static NetworkPool *instance();
+    // Measure the threads and memory of a network manager, for the
+    // report. Call it before the clients start.
+    static void measureManagerCost();
+
+    QNetworkAccessManager *acquire();
+    void release(QNetworkAccessManager *manager);
+
+    // Count managers created outside the pool, and the transports
+    // using them, for the report
+    static void countManager(int change)
+        { c_managers.fetchAndAddOrdered(change); }
+    static void countClient(int change)
+        { c_clients.fetchAndAddOrdered(change); }
+
+  public slots:
+    // Log thread count and memory use per client, so that runs with
+    // and without pooling can be compared. Call it while the clients
+    // are still alive.
+    void report();
+
+  private slots:
+    void authenticate(QNetworkReply *reply, QAuthenticator *auth);
+
+  private:
+    NetworkPool();
+
+    struct Member {
+        QNetworkAccessManager *manager;
+        int clients;
+    };
+    QList<Member> m_members;
+
+    static int c_clients_per_manager;
+    // From measureManagerCost(); -1 if not measured
+    static double c_manager_threads;
+    static double c_manager_kb;
+    static QAtomicInt c_managers;  // live managers, pooled or not
+    static QAtomicInt c_clients;   // live transports
+    static __thread NetworkPool *c_instance;  // one per thread
+};
+
+#endif
@@ -0,0 +1,92 @@
+#include "OpenLoop.h"
+
+#include <QtGlobal>
+
+#include <cmath>
+#include <cstdlib>
+
+#include "Client.h"
+#include "Stats.h"
+
+double OpenLoop::c_rate = 0;
+bool OpenLoop::c_poisson = false;
+QAtomicInt OpenLoop::c_clients(0);
+__thread OpenLoop *OpenLoop::c_instance = 0;
+
+OpenLoop::OpenLoop()
+  : Logger("openloop"), m_rate(0), m_next_client(0), m_next_arrival(0), m_level(1),
+    m_credit(0) {
+    m_timer.setSingleShot(true);
+    connect(&m_timer, SIGNAL(timeout()), SLOT(arrive()));
+}
+
+OpenLoop *OpenLoop::instance() {
+    if (!c_instance)
+        c_instance = new OpenLoop;
+    return c_instance;
+}
+
+void OpenLoop::addClient(Client *client) {
+    client->setOpenLoop(true);
+    m_clients << client;
+    c_clients.fetchAndAddOrdered(1);
+}
+
+void OpenLoop::start() {
+    // a thread without drawing clients has nothing to drive
+    if (m_clients.isEmpty())
+        return;
+    m_rate = c_rate * m_clients.length() / int(c_clients);
+    log(Info, "starting " + QString(c_poisson ? "poisson" : "fixed")
+              + " arrivals at " + QString::number(m_rate) + " edits/sec over "
+              + QString::number(m_clients.length()) + " clients");
+    m_next_arrival = Stats::usecs() + nextGap();
+    schedule();
+}
+
+qint64 OpenLoop::nextGap() {
+    double mean = 1000000 / m_rate;
+    if (!c_poisson)
+        return qMax(qint64(1), qint64(mean));
+    // uniform in (0, 1], so the log is finite
+    double u = (qrand() + 1.0) / (RAND_MAX + 1.0);
+    return qint64(-std::log(u) * mean);
+}
+
+void OpenLoop::schedule() {
+    qint64 wait = m_next_arrival - Stats::usecs();
+    // round up, so that the timer doesn't fire just before the arrival
+    m_timer.start(wait > 0 ? int((wait + 999) / 1000) : 0);
+}
+
+void OpenLoop::arrive() {
+    qint64 now = Stats::usecs();
+    while (m_next_arrival <= now) {
+        bool keep;
+        if (c_poisson) {
+            keep = qrand() < m_level * (RAND_MAX + 1.0);
+        } else {
+            m_credit += m_level;
+            keep = m_credit >= 1;
+            if (keep)
+                m_credit -= 1;
+        }
+        if (keep)
+            dispatch(m_next_arrival);
+        m_next_arrival += nextGap();
+    }
+    schedule();
+}
+
+void OpenLoop::dispatch(qint64 intended_usecs) {
+    Stats::instance()->count("openloop.arrivals");
+    for (int tries = 0; tries < m_clients.length(); tries++) {
+        Client *client = m_clients[m_next_client];
+        m_next_client = (m_next_client + 1) % m_clients.length();
+        if (client->isActive()) {
+            client->edit(intended_usecs);
+            return;
+        }
+    }
+    Stats::instance()->count("openloop.missed");
+}
@@ -0,0 +1,81 @@
+#ifndef OPENLOOP_H
+#define OPENLOOP_H
+
+#include <QAtomicInt>
+#include <QList>
+#include <QObject>
+#include <QTimer>
+
+#include "Logger.h"
+
+class Client;
+
+// Drives edits at a fixed overall rate, whatever the server does.
+
+// Normally a drawing client makes an edit, sends it and waits 10 seconds
+// before the next one. When the server slows down, the clients simply
+// edit less, and the latencies look better than what users would see.
+// In open-loop mode this class decides when edits happen instead: it
+// generates arrival times at the target rate, either evenly spaced or
+// as a Poisson process, and hands each one to the next active client in
+// turn, with the time it was due.
+
+// If the event loop falls behind, the arrivals that were due in the
+// meantime are all handed out when it catches up, still carrying their
+// original times. The clients measure commit latency from that time, so
+// queueing in the load generator or behind a slow commit is counted.
+// Arrivals that find no active client are counted as openloop.missed.
+
+// The rate can be scaled down by a load level between 0 and 1 (see
+// LoadProfile). Arrivals are still generated at the full rate, and each
+// one is kept with a probability equal to the level (for Poisson) or
+// when the level adds up to a whole edit (for fixed spacing), so the
+// level can change at any time without waiting out a long gap.
+
+// With worker threads, each thread has its own instance driving the
+// clients of that thread, at its share of the rate. Independent Poisson
+// processes add up to a Poisson process at the sum of their rates.
+
+class OpenLoop : public QObject, private Logger {
+    Q_OBJECT
+
+  public:
+    // The instance of the calling thread
+    static OpenLoop *instance();
+
+    // Edits per second over all clients; 0 turns off open-loop mode
+    static void setRate(double rate) { c_rate = rate; }
+    static bool enabled() { return c_rate > 0; }
+    // Exponentially distributed gaps instead of fixed ones
+    static void setPoisson(bool poisson) { c_poisson = poisson; }
+
+    void addClient(Client *client);
+    void setLevel(double level) { m_level = level; }
+
+  public slots:
+    void start();
+
+  private slots:
+    void arrive();
+
+  private:
+    OpenLoop();
+    qint64 nextGap();  // usecs until the next arrival
+    void dispatch(qint64 intended_usecs);
+    void schedule();
+
+    QList<Client *> m_clients;
+    double m_rate;  // this instance's share of c_rate
+    int m_next_client;
+    qint64 m_next_arrival;  // Stats::usecs() time
+    double m_level;
+    double m_credit;  // fixed spacing: accumulated level, in edits
+    QTimer m_timer;
+
+    static double c_rate;
+    static bool c_poisson;
+    static QAtomicInt c_clients;  // over all instances
+    static __thread OpenLoop *c_instance;  // one per thread
+};
+
+#endif
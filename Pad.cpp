@@ -3,7 +3,15 @@
 #include <QtGlobal>
 
 Pad::Pad(const QString & clientName, QObject *parent)
-    : QObject(parent), Logger(clientName), m_rev(0) {
+    : QObject(parent), Logger(clientName), m_rev(0), m_submitting(false) {
+}
+
+void Pad::logErrors(const Changeset & changeset,
+                    const QString & what) const {
+    Q_FOREACH(const QString & err, changeset.errors()) {
+        log(Error, err + ": " + what);
+    }
+    changeset.clearErrors();
 }
 
 void Pad::setInitialText(int rev, const QString & text, const QString & attribstr, QList<Attribute> apool) {
@@ -11,29 +19,28 @@ void Pad::setInitialText(int rev, const QString & text, const QString & attribst
     // attribstr is basically a changeset with some parts left out.
     // Add them back in and it becomes the changeset from the empty document
     // to the current rev.
+    m_base.clear();
     m_base.parse("Z:0>" + QString::number(text.length(), 36)
                  + attribstr + "$" + text, apool);
-    Q_FOREACH(const QString & err, m_base.errors()) {
-        log(Error, err + ": " + attribstr);
-    }
-    m_base.clearErrors();
+    logErrors(m_base, attribstr);
 
-    m_changes.addKeep(text, QList<Attribute>());
-    m_text = text;
+    m_submitted.clear(text.length());
+    m_submitting = false;
+    m_changes.clear(text.length());
+    m_text.clear();
+    m_text.insert(0, text);
 }
 
 QString Pad::toChangeset() const {
     QString changeset = m_changes.toString();
-    Q_FOREACH(const QString & err, m_changes.errors()) {
-        log(Error, err + ": " + changeset);
-    }
-    m_changes.clearErrors();
+    logErrors(m_changes, changeset);
 
-    // Re-parse the changeset to catch client side errors
-    Changeset test;
-    test.parse(changeset, m_changes.attributes());
-    Q_FOREACH(const QString & err, test.errors()) {
-        log(Error, err + ": " + changeset);
+    // Re-parse the changeset to catch client side errors. The ops are
+    // assembled in canonical form, so this only needs doing when tracing.
+    if (log_enabled(Trace)) {
+        Changeset test;
+        test.parse(changeset, m_changes.attributes());
+        logErrors(test, changeset);
     }
 
     return changeset;
@@ -47,36 +54,143 @@ int Pad::getNewLen() const {
     return m_text.length();
 }
 
+void Pad::countLines(int start, int end, int *lines, int *whole) const {
+    int lines_before_end = m_text.linesBefore(end);
+    *lines = lines_before_end - m_text.linesBefore(start);
+    *whole = *lines > 0 ? m_text.lineStart(lines_before_end) - start : 0;
+}
+
 void Pad::insertAt(int pos, const QString & text,
                    const QList<Attribute> & attributes) {
+    int len = m_text.length();
+    int lines, whole;
     Changeset changes;
-    changes.addKeep(m_text.left(pos), QList<Attribute>());
+    countLines(0, pos, &lines, &whole);
+    changes.addKeep(lines, whole, QList<Attribute>());
+    changes.addKeep(0, pos - whole, QList<Attribute>());
     changes.addInsert(text, attributes);
-    changes.addKeep(m_text.mid(pos), QList<Attribute>());
+    countLines(pos, len, &lines, &whole);
+    changes.addKeep(lines, whole, QList<Attribute>());
+    changes.addKeep(0, len - pos - whole, QList<Attribute>());
     m_changes.apply(&changes);
     m_text.insert(pos, text);
 
     if (m_text.length() != m_changes.newLen())
         log(Error, "changeset and local text length do not match after insert");
-    Q_FOREACH(const QString & err, m_changes.errors()) {
-        log(Error, err);
-    }
-    m_changes.clearErrors();
+    logErrors(m_changes, "insert");
 }
 
 void Pad::deleteAt(int pos, int len) {
-    QString deleted = m_text.mid(pos, len);
+    int text_len = m_text.length();
+    int lines, whole;
     Changeset changes;
-    changes.addKeep(m_text.left(pos), QList<Attribute>());
-    changes.addDelete(deleted);
-    changes.addKeep(m_text.mid(pos + len), QList<Attribute>());
+    countLines(0, pos, &lines, &whole);
+    changes.addKeep(lines, whole, QList<Attribute>());
+    changes.addKeep(0, pos - whole, QList<Attribute>());
+    countLines(pos, pos + len, &lines, &whole);
+    changes.addDelete(lines, whole);
+    changes.addDelete(0, len - whole);
+    countLines(pos + len, text_len, &lines, &whole);
+    changes.addKeep(lines, whole, QList<Attribute>());
+    changes.addKeep(0, text_len - pos - len - whole, QList<Attribute>());
     m_changes.apply(&changes);
     m_text.remove(pos, len);
 
     if (m_text.length() != m_changes.newLen())
         log(Error, "changeset and local text length do not match after delete");
-    Q_FOREACH(const QString & err, m_changes.errors()) {
-        log(Error, err);
+    logErrors(m_changes, "delete");
+}
+
+void Pad::submit() {
+    if (m_submitting) {
+        log(Error, "submitting changes while others are not accepted yet");
+        unsubmit();
     }
-    m_changes.clearErrors();
+    m_submitted.assign(&m_changes);
+    m_submitting = true;
+    m_changes.clear(m_text.length());
+}
+
+void Pad::unsubmit() {
+    if (!m_submitting)
+        return;
+    m_submitted.apply(&m_changes);
+    logErrors(m_submitted, "unsubmit");
+    m_changes.assign(&m_submitted);
+    m_submitting = false;
+}
+
+void Pad::acceptCommit(int new_rev) {
+    if (!m_submitting) {
+        log(Warning, "commit accepted without submitted changes");
+        return;
+    }
+    if (new_rev != m_rev + 1)
+        log(Warning, "commit accepted as rev " + QString::number(new_rev)
+                     + " on top of rev " + QString::number(m_rev));
+    m_base.apply(&m_submitted);
+    logErrors(m_base, "accept commit");
+    m_submitted.clear(m_base.newLen());
+    m_submitting = false;
+    m_rev = new_rev;
+}
+
+void Pad::newChanges(int new_rev, const QString & changeset,
+                     const QList<Attribute> & apool) {
+    if (new_rev <= m_rev) {
+        log(Verbose, "skipping rev " + QString::number(new_rev)
+                     + ", already at " + QString::number(m_rev));
+        return;
+    }
+    if (new_rev != m_rev + 1)
+        log(Warning, "got rev " + QString::number(new_rev)
+                     + " on top of rev " + QString::number(m_rev));
+
+    Changeset server;
+    server.parse(changeset, apool);
+    if (!server.errors().isEmpty()) {
+        logErrors(server, changeset);
+        return;
+    }
+    if (server.origLen() != m_base.newLen()) {
+        log(Error, "rev " + QString::number(new_rev) + " is for a text of "
+                   + QString::number(server.origLen()) + " chars, not "
+                   + QString::number(m_base.newLen()));
+        return;
+    }
+
+    // The server's changes, rebased over the submitted and then the
+    // local changes, which in turn get rebased over the server's. The
+    // server's text goes first where both insert at the same place,
+    // the same way the server itself will follow the submitted changes.
+    Changeset incoming;
+    incoming.assign(&server);
+    if (m_submitting) {
+        Changeset after_submitted;
+        after_submitted.assign(&incoming);
+        after_submitted.follow(&m_submitted, true);
+        m_submitted.follow(&incoming);
+        logErrors(m_submitted, "follow");
+        incoming.assign(&after_submitted);
+    }
+    if (m_changes.isIdentity()) {
+        m_changes.clear(incoming.newLen());
+    } else {
+        Changeset after_changes;
+        after_changes.assign(&incoming);
+        after_changes.follow(&m_changes, true);
+        m_changes.follow(&incoming);
+        logErrors(m_changes, "follow");
+        incoming.assign(&after_changes);
+    }
+    incoming.applyTo(&m_text);
+    logErrors(incoming, "new changes");
+
+    m_base.apply(&server);
+    logErrors(m_base, "new changes");
+    m_rev = new_rev;
+
+    if (m_text.length() != m_changes.newLen())
+        log(Error, "changeset and local text length do not match after rev "
+                   + QString::number(new_rev));
 }
@@ -7,6 +7,17 @@
 
 #include "Changeset.h"
 #include "Logger.h"
+#include "Rope.h"
+
+// The client's copy of a pad, kept the way the etherpad editor keeps it.
+
+// There are three changesets on top of each other: the pad at the last
+// revision the client knows of, the changes submitted to the server and
+// not accepted yet, and the local changes made since then. When changes
+// from other clients come in, the submitted and local changes are
+// rebased over them with Changeset::follow(), so the next submission is
+// always based on the latest revision, and the server doesn't have to
+// do that work itself.
 
 class Pad : public QObject, private Logger {
     Q_OBJECT
@@ -18,8 +29,10 @@ class Pad : public QObject, private Logger {
 
     int rev() const { return m_rev; }
 
+    // The local changes
     QString toChangeset() const;
     QList<Attribute> attributes() const;
+    bool hasChanges() const { return !m_changes.isIdentity(); }
     int getNewLen() const;
 
     // For both of these, pos is an index into the new text
@@ -27,11 +40,33 @@ class Pad : public QObject, private Logger {
                   const QList<Attribute> & attributes);
     void deleteAt(int pos, int len);
 
+    // Move the local changes to the submitted ones; there must be none
+    // of those
+    void submit();
+    bool isSubmitting() const { return m_submitting; }
+    // Put the submitted changes back with the local ones, when the
+    // server is not going to accept them
+    void unsubmit();
+
+    // ACCEPT_COMMIT for the submitted changes
+    void acceptCommit(int new_rev);
+    // NEW_CHANGES from another client
+    void newChanges(int new_rev, const QString & changeset,
+                    const QList<Attribute> & apool);
+
   private:
+    void logErrors(const Changeset & changeset, const QString & what) const;
+    // The newlines in m_text from start to end, and the number of
+    // characters up to and including the last of them, which is what
+    // a multiline op covers
+    void countLines(int start, int end, int *lines, int *whole) const;
+
     int m_rev;
     Changeset m_base; // changeset from empty document to m_rev
-    Changeset m_changes; // local changes on top of m_rev
-    QString m_text; // text after local changes
+    Changeset m_submitted; // submitted changes on top of m_rev
+    bool m_submitting;
+    Changeset m_changes; // local changes on top of m_submitted
+    Rope m_text; // text after local changes
 };
 
 #endif
@@ -0,0 +1,87 @@
+#include "PadSet.h"
+
+#include <QStringList>
+#include <QtAlgorithms>
+
+#include <cmath>
+
+// Fractional part of the golden ratio, for spreading the quantiles
+#define GOLDEN 0.6180339887498949
+
+PadSet::PadSet() : m_cdf(1, 1.0) {
+}
+
+bool PadSet::setPads(const QString & url_template, int pads) {
+    if (pads < 1)
+        return false;
+    m_template = url_template;
+    m_cdf.resize(pads);
+    return setDistribution("uniform");
+}
+
+bool PadSet::setDistribution(const QString & spec) {
+    QStringList parts = spec.split(':');
+    QString shape = parts.takeFirst();
+    int n = m_cdf.size();
+    QVector<double> weights(n);
+
+    if (shape == "uniform" && parts.isEmpty()) {
+        weights.fill(1);
+    } else if (shape == "zipf" && parts.length() == 1) {
+        bool ok;
+        double s = parts[0].toDouble(&ok);
+        if (!ok || s < 0)
+            return false;
+        for (int k = 0; k < n; k++)
+            weights[k] = 1 / std::pow(k + 1.0, s);
+    } else if (shape == "hot" && parts.length() == 2) {
+        bool ok_k, ok_p;
+        int hot = parts[0].toInt(&ok_k);
+        double percent = parts[1].toDouble(&ok_p);
+        if (!ok_k || !ok_p || hot < 1 || hot > n || percent < 0
+            || percent > 100 || (hot == n && percent < 100))
+            return false;
+        for (int k = 0; k < n; k++)
+            weights[k] = k < hot ? percent / hot
+                                 : (100 - percent) / (n - hot);
+    } else {
+        return false;
+    }
+
+    double total = 0;
+    for (int k = 0; k < n; k++)
+        total += weights[k];
+    double sum = 0;
+    for (int k = 0; k < n; k++) {
+        sum += weights[k];
+        m_cdf[k] = sum / total;
+    }
+    m_cdf[n - 1] = 1;  // no rounding gap at the top
+    return true;
+}
+
+int PadSet::padFor(int i) const {
+    double u = std::fmod((i + 1) * GOLDEN, 1.0);
+    QVector<double>::const_iterator it =
+        qLowerBound(m_cdf.constBegin(), m_cdf.constEnd(), u);
+    return qMin(int(it - m_cdf.constBegin()), m_cdf.size() - 1);
+}
+
+QUrl PadSet::url(int pad) const {
+    QString number = QString::number(pad + 1);
+    QString url = m_template;
+    if (url.contains("{n}"))
+        url.replace("{n}", number);
+    else if (m_cdf.size() > 1)
+        url += number;
+    return QUrl(url);
+}
+
+QString PadSet::bucket(int pad) const {
+    if (m_cdf.size() == 1)
+        return QString();
+    qint64 top = 1;
+    while (top < pad + 1)
+        top *= 10;
+    return "top" + QString::number(top);
+}
@@ -0,0 +1,48 @@
+#ifndef PADSET_H
+#define PADSET_H
+
+#include <QString>
+#include <QUrl>
+#include <QVector>
+
+// The drawings a run spreads its clients over, and how popular each is.
+
+// The drawings come from a URL template: {n} in it is replaced by the
+// drawing number from 1 to N, or without {n} the number is appended to
+// the URL. With one drawing, {n} becomes 1, and a URL without {n} is
+// used as it is.
+
+// Clients are assigned with one of these distributions, drawing 1 being
+// the most popular:
+//   uniform         the same share for each
+//   zipf:S          share of drawing k proportional to 1/k^S
+//   hot:K:PERCENT   PERCENT of the clients on K hot drawings, the rest
+//                   spread evenly over the others
+// The assignment is deterministic: client i takes the drawing at
+// quantile i times the golden ratio, modulo 1, so every slice of the
+// start order (and every worker process or agent) gets the same mix.
+
+// For the stats, the drawings are grouped by popularity rank in powers
+// of ten: top1 is the most popular drawing, top10 ranks 2 to 10, top100
+// ranks 11 to 100 and so on.
+
+class PadSet {
+  public:
+    PadSet();
+
+    bool setPads(const QString & url_template, int pads);
+    bool setDistribution(const QString & spec);
+
+    int pads() const { return m_cdf.size(); }
+    // The drawing for client number i, from 0 for the most popular
+    int padFor(int i) const;
+    QUrl url(int pad) const;
+    // Popularity bucket of a drawing, empty with a single drawing
+    QString bucket(int pad) const;
+
+  private:
+    QString m_template;
+    QVector<double> m_cdf;  // share of the clients on drawings 0..k
+};
+
+#endif
@@ -0,0 +1,144 @@
+#include "Replay.h"
+
+#include <QFile>
+#include <QtGlobal>
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Capture.h"
+#include "Client.h"
+#include "Stats.h"
+
+// Records to handle before letting the event loop run again, when
+// behind
+#define MAX_BATCH 10000
+
+const char *Replay::c_data = 0;
+const char *Replay::c_end = 0;
+double Replay::c_speed = 1;
+int Replay::c_part = 0;
+int Replay::c_parts = 1;
+int Replay::c_clients = 0;
+__thread Replay *Replay::c_instance = 0;
+
+bool Replay::open(const QString & path, double speed) {
+    int fd = ::open(QFile::encodeName(path).constData(), O_RDONLY);
+    if (fd < 0) {
+        qCritical("cannot open %s: %s", qPrintable(path), strerror(errno));
+        return false;
+    }
+    struct stat st;
+    void *data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= qint64(sizeof(Capture::c_magic)))
+        data = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);  // the mapping stays
+    if (data == MAP_FAILED || memcmp(data, Capture::c_magic,
+                                     sizeof(Capture::c_magic)) != 0) {
+        qCritical("%s is not a capture file", qPrintable(path));
+        return false;
+    }
+    // read once, front to back
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+    c_data = static_cast<const char *>(data);
+    c_end = c_data + st.st_size;
+    c_speed = speed;
+    return true;
+}
+
+void Replay::setShare(int part, int parts) {
+    c_part = part;
+    c_parts = parts;
+}
+
+Replay::Replay()
+  : Logger("replay"), m_pos(0), m_trace_start(0), m_run_start(0) {
+    m_timer.setSingleShot(true);
+    connect(&m_timer, SIGNAL(timeout()), SLOT(play()));
+}
+
+Replay *Replay::instance() {
+    if (!c_instance)
+        c_instance = new Replay;
+    return c_instance;
+}
+
+void Replay::addClient(Client *client, int number) {
+    m_clients.insert(number, client);
+}
+
+void Replay::start() {
+    // a thread without replay clients has nothing to send
+    if (m_clients.isEmpty() || c_clients == 0)
+        return;
+    m_pos = c_data + sizeof(Capture::c_magic);
+    if (m_pos + sizeof(Capture::Record) <= c_end) {
+        Capture::Record first;
+        memcpy(&first, m_pos, sizeof(first));
+        m_trace_start = first.usecs;
+    }
+    m_run_start = Stats::usecs();
+    log(Info, "replaying " + QString::number((c_end - c_data) >> 20)
+              + " MB at " + QString::number(c_speed) + "x over "
+              + QString::number(m_clients.size()) + " clients");
+    play();
+}
+
+void Replay::schedule(qint64 due) {
+    qint64 wait = due - Stats::usecs();
+    // round up, so that the timer doesn't fire just before the record
+    m_timer.start(wait > 0 ? int((wait + 999) / 1000) : 0);
+}
+
+void Replay::play() {
+    qint64 now = Stats::usecs();
+    for (int batch = 0; batch < MAX_BATCH; batch++) {
+        Capture::Record record;
+        if (m_pos + sizeof(record) > c_end)
+            break;
+        // records aren't aligned
+        memcpy(&record, m_pos, sizeof(record));
+        const char *payload = m_pos + sizeof(record);
+        if (record.length > quint64(c_end - payload)) {
+            m_pos = c_end;  // cut off
+            break;
+        }
+
+        // Step over the records of other shares and threads without
+        // waiting for their time, so the timer only wakes us for our own
+        Client *client = 0;
+        if (int(record.client % c_parts) == c_part)
+            client = m_clients.value((record.client / c_parts) % c_clients);
+        if (!client) {
+            m_pos = payload + record.length;
+            continue;
+        }
+
+        qint64 due = m_run_start
+                     + qint64((record.usecs - m_trace_start) / c_speed);
+        if (due > now) {
+            schedule(due);
+            return;
+        }
+        m_pos = payload + record.length;
+
+        Stats::instance()->count("replay.records");
+        if (!client->isActive()) {
+            Stats::instance()->count("replay.missed");
+            continue;
+        }
+        client->replay(Capture::Type(record.type),
+                       QByteArray::fromRawData(payload, record.length), due);
+    }
+    if (m_pos + sizeof(Capture::Record) <= c_end) {
+        // behind, or stepping over a long run of other records; carry
+        // on after the event loop had a turn
+        schedule(now);
+        return;
+    }
+    log(Info, "end of the trace");
+}
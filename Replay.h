@@ -0,0 +1,78 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <QHash>
+#include <QObject>
+#include <QString>
+#include <QTimer>
+
+#include "Logger.h"
+
+class Client;
+
+// Sends the traffic of a capture file (see Capture) again, through the
+// clients of type replay.
+
+// The file is mapped into memory rather than read, so a trace of many
+// gigabytes costs no more memory than the pages the kernel keeps
+// around, and a record is only ever looked at in place. Each record is
+// sent at its time in the trace, counted from the first record and
+// divided by the speed, by the client it falls to: recorded client
+// number c goes to replay client c % N of the N in the run. A
+// USER_CHANGES is made again as the same edits on the replay client's
+// own copy of the drawing, so that it still applies when the drawing is
+// not the one recorded; its commit latency counts from the time it was
+// due. Records for a client that isn't active are counted as
+// replay.missed.
+
+// Like OpenLoop, each thread has an instance of its own, which goes
+// through the whole file and picks out the records for its clients.
+// It only reads the headers of the other records, to step over them,
+// and its timer only fires for its own.
+// With agents, each agent replays the records of every agents'th
+// recorded client.
+
+class Replay : public QObject, private Logger {
+    Q_OBJECT
+
+  public:
+    // Map the capture file; before forking or starting threads
+    static bool open(const QString & path, double speed);
+    static bool enabled() { return c_data != 0; }
+    // Take the records of recorded clients c with c % parts == part
+    static void setShare(int part, int parts);
+    // Number of replay clients in the whole run
+    static void setClients(int clients) { c_clients = clients; }
+
+    // The instance of the calling thread
+    static Replay *instance();
+
+    // number is the client's place among all replay clients
+    void addClient(Client *client, int number);
+
+  public slots:
+    void start();
+
+  private slots:
+    void play();
+
+  private:
+    Replay();
+    void schedule(qint64 due);
+
+    QHash<int, Client *> m_clients;
+    const char *m_pos;  // next record
+    qint64 m_trace_start;  // usecs of the first record
+    qint64 m_run_start;  // Stats::usecs() at start()
+    QTimer m_timer;
+
+    static const char *c_data;
+    static const char *c_end;
+    static double c_speed;
+    static int c_part;
+    static int c_parts;
+    static int c_clients;
+    static __thread Replay *c_instance;  // one per thread
+};
+
+#endif
@@ -0,0 +1,234 @@
+#include "Rope.h"
+
+// Chunks don't grow past this many characters
+#define ROPE_CHUNK 512
+// New chunks are made this big, to leave room for edits
+#define ROPE_FILL 256
+
+namespace {
+
+    static int countLines(const QChar *text, int len) {
+        int lines = 0;
+        for (int i = 0; i < len; i++) {
+            if (text[i] == '\n')
+                lines++;
+        }
+        return lines;
+    }
+
+}
+
+Rope::Rope() : m_root(0), m_seed(2463534242u) {
+}
+
+Rope::~Rope() {
+    destroy(m_root);
+}
+
+void Rope::clear() {
+    destroy(m_root);
+    m_root = 0;
+}
+
+void Rope::destroy(Node *node) {
+    if (!node)
+        return;
+    destroy(node->left);
+    destroy(node->right);
+    delete node;
+}
+
+void Rope::update(Node *node) {
+    node->chars = chars(node->left) + node->text.length()
+                  + chars(node->right);
+    node->lines = lines(node->left) + node->text_lines + lines(node->right);
+}
+
+Rope::Node *Rope::newNode(const QChar *text, int len) {
+    Node *node = new Node;
+    node->text = QString(text, len);
+    node->text_lines = countLines(text, len);
+    // xorshift; the priorities only need to be spread out
+    m_seed ^= m_seed << 13;
+    m_seed ^= m_seed >> 17;
+    m_seed ^= m_seed << 5;
+    node->priority = m_seed;
+    node->left = 0;
+    node->right = 0;
+    update(node);
+    return node;
+}
+
+void Rope::split(Node *node, int pos, Node **left, Node **right) {
+    if (!node) {
+        *left = 0;
+        *right = 0;
+        return;
+    }
+    int before = chars(node->left);
+    int len = node->text.length();
+    if (pos <= before) {
+        split(node->left, pos, left, &node->left);
+        update(node);
+        *right = node;
+    } else if (pos >= before + len) {
+        split(node->right, pos - before - len, &node->right, right);
+        update(node);
+        *left = node;
+    } else {
+        // the split is inside this chunk
+        int cut = pos - before;
+        Node *tail = newNode(node->text.constData() + cut, len - cut);
+        // with a new priority the tail could end up above an ancestor
+        tail->priority = node->priority;
+        node->text.truncate(cut);
+        node->text_lines -= tail->text_lines;
+        Node *after = node->right;
+        node->right = 0;
+        update(node);
+        *left = node;
+        *right = merge(tail, after);
+    }
+}
+
+Rope::Node *Rope::merge(Node *left, Node *right) {
+    if (!left)
+        return right;
+    if (!right)
+        return left;
+    if (left->priority > right->priority) {
+        left->right = merge(left->right, right);
+        update(left);
+        return left;
+    }
+    right->left = merge(left, right->left);
+    update(right);
+    return right;
+}
+
+bool Rope::insertInChunk(Node *node, int pos, const QChar *text, int len,
+                         int text_lines) {
+    if (!node)
+        return false;
+    int before = chars(node->left);
+    int here = node->text.length();
+    bool done;
+    if (pos < before) {
+        done = insertInChunk(node->left, pos, text, len, text_lines);
+    } else if (pos > before + here) {
+        done = insertInChunk(node->right, pos - before - here, text, len,
+                             text_lines);
+    } else if (here + len <= ROPE_CHUNK) {
+        node->text.insert(pos - before, text, len);
+        node->text_lines += text_lines;
+        done = true;
+    } else {
+        done = false;
+    }
+    if (done) {
+        node->chars += len;
+        node->lines += text_lines;
+    }
+    return done;
+}
+
+int Rope::removeInChunk(Node *node, int pos, int len) {
+    if (!node)
+        return -1;
+    int before = chars(node->left);
+    int here = node->text.length();
+    int removed;
+    if (pos + len <= before) {
+        removed = removeInChunk(node->left, pos, len);
+    } else if (pos >= before + here) {
+        removed = removeInChunk(node->right, pos - before - here, len);
+    } else if (pos >= before && pos + len <= before + here && len < here) {
+        removed = countLines(node->text.constData() + pos - before, len);
+        node->text.remove(pos - before, len);
+        node->text_lines -= removed;
+    } else {
+        removed = -1;  // across chunks, or all of this one
+    }
+    if (removed >= 0) {
+        node->chars -= len;
+        node->lines -= removed;
+    }
+    return removed;
+}
+
+void Rope::insert(int pos, const QChar *text, int len) {
+    if (len <= 0)
+        return;
+    if (insertInChunk(m_root, pos, text, len, countLines(text, len)))
+        return;
+
+    Node *middle = 0;
+    for (int i = 0; i < len; i += ROPE_FILL)
+        middle = merge(middle, newNode(text + i, qMin(ROPE_FILL, len - i)));
+    Node *left;
+    Node *right;
+    split(m_root, pos, &left, &right);
+    m_root = merge(merge(left, middle), right);
+}
+
+void Rope::remove(int pos, int len) {
+    if (len <= 0)
+        return;
+    if (removeInChunk(m_root, pos, len) >= 0)
+        return;
+
+    Node *left;
+    Node *rest;
+    Node *middle;
+    Node *right;
+    split(m_root, pos, &left, &rest);
+    split(rest, len, &middle, &right);
+    destroy(middle);
+    m_root = merge(left, right);
+}
+
+int Rope::linesBefore(int pos) const {
+    int result = 0;
+    const Node *node = m_root;
+    while (node) {
+        int before = chars(node->left);
+        if (pos <= before) {
+            node = node->left;
+            continue;
+        }
+        result += lines(node->left);
+        pos -= before;
+        if (pos <= node->text.length())
+            return result + countLines(node->text.constData(), pos);
+        result += node->text_lines;
+        pos -= node->text.length();
+        node = node->right;
+    }
+    return result;
+}
+
+int Rope::lineStart(int line) const {
+    if (line <= 0)
+        return 0;
+    int pos = 0;
+    const Node *node = m_root;
+    while (node) {
+        if (line <= lines(node->left)) {
+            node = node->left;
+            continue;
+        }
+        line -= lines(node->left);
+        pos += chars(node->left);
+        if (line <= node->text_lines) {
+            const QChar *text = node->text.constData();
+            for (int i = 0; ; i++) {
+                if (text[i] == '\n' && --line == 0)
+                    return pos + i + 1;
+            }
+        }
+        line -= node->text_lines;
+        pos += node->text.length();
+        node = node->right;
+    }
+    return pos;
+}
@@ -0,0 +1,72 @@
+#ifndef ROPE_H
+#define ROPE_H
+
+#include <QString>
+#include <QtGlobal>
+
+// The text of a pad, for making changes to it in the middle.
+
+// The text is cut into chunks of at most ROPE_CHUNK characters, which
+// are kept in a balanced tree in text order (a treap, balanced by
+// random priorities). Each node knows the number of characters and
+// newlines in its subtree, so finding a position, counting the lines
+// before it or finding where a line starts takes time logarithmic in
+// the size of the text, and an edit only copies characters within a
+// chunk. A small edit goes into the chunk where it falls, if that has
+// room; otherwise the tree is split at the edit and put back together
+// around it.
+
+class Rope {
+  public:
+    Rope();
+    ~Rope();
+
+    int length() const { return chars(m_root); }
+    // The number of newlines
+    int lines() const { return lines(m_root); }
+    // The number of newlines before pos
+    int linesBefore(int pos) const;
+    // The position just after the line'th newline, 0 for line 0
+    int lineStart(int line) const;
+
+    void clear();
+    void insert(int pos, const QChar *text, int len);
+    void insert(int pos, const QString & text) {
+        insert(pos, text.constData(), text.length());
+    }
+    void remove(int pos, int len);
+
+  private:
+    Q_DISABLE_COPY(Rope)
+
+    struct Node {
+        QString text;
+        int text_lines;  // newlines in text
+        int chars;  // in the subtree
+        int lines;  // in the subtree
+        quint32 priority;  // not more than the parent's
+        Node *left;
+        Node *right;
+    };
+
+    static int chars(const Node *node) { return node ? node->chars : 0; }
+    static int lines(const Node *node) { return node ? node->lines : 0; }
+    static void update(Node *node);
+    static void destroy(Node *node);
+
+    Node *newNode(const QChar *text, int len);
+    // Split the text of node at pos into *left and *right
+    void split(Node *node, int pos, Node **left, Node **right);
+    static Node *merge(Node *left, Node *right);
+    // Edit the chunk that holds pos in place, if it has room or keeps
+    // some text, and update the counts on the way. removeInChunk()
+    // returns the number of newlines removed, or -1 if it couldn't.
+    static bool insertInChunk(Node *node, int pos, const QChar *text,
+                              int len, int text_lines);
+    static int removeInChunk(Node *node, int pos, int len);
+
+    Node *m_root;
+    quint32 m_seed;  // for the priorities
+};
+
+#endif
@@ -0,0 +1,147 @@
+#include "Scenario.h"
+
+#include <QFile>
+#include <QRegExp>
+#include <QSet>
+#include <QStringList>
+
+#include <qjson/parser.h>
+
+bool Scenario::fail(const QString & error) {
+    m_classes.clear();
+    m_error = error;
+    return false;
+}
+
+bool Scenario::setClients(const QString & spec) {
+    m_classes.clear();
+    Q_FOREACH(QString type, spec.split(',', QString::SkipEmptyParts)) {
+        QString name = type.section(':', 0, 0);
+        Behaviour::Action action;
+        QVariantMap source;
+        source["name"] = name;
+        // any other type name has always meant a lurker
+        source["behaviour"] = Behaviour::parseAction(name, &action)
+                              ? name : "lurk";
+        source["count"] = type.section(':', 1).toInt();
+        if (!addClass(source))
+            return false;
+    }
+    return true;
+}
+
+bool Scenario::load(const QString & path) {
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly))
+        return fail("cannot read " + path + ": " + file.errorString());
+    bool ok;
+    QJson::Parser parser;
+    QVariant scenario = parser.parse(file.readAll(), &ok);
+    if (!ok)
+        return fail(path + " line " + QString::number(parser.errorLine())
+                    + ": " + parser.errorString());
+    return setVariant(scenario);
+}
+
+bool Scenario::setVariant(const QVariant & scenario) {
+    m_classes.clear();
+    QVariantMap map = scenario.toMap();
+    if (!map.contains("classes") || map["classes"].type() != QVariant::List)
+        return fail("a scenario needs a list of classes");
+    Q_FOREACH(const QVariant & source, map["classes"].toList()) {
+        if (source.type() != QVariant::Map)
+            return fail("a client class must be an object");
+        if (!addClass(source.toMap()))
+            return false;
+    }
+    if (m_classes.isEmpty())
+        return fail("a scenario needs at least one client class");
+    return true;
+}
+
+bool Scenario::addClass(const QVariantMap & source) {
+    static const QSet<QString> keys = QSet<QString>()
+        << "name" << "behaviour" << "count" << "think" << "edits"
+        << "edit_size" << "reconnect";
+
+    ClientClass cc;
+    cc.name = source["name"].toString();
+    cc.source = source;
+    if (!QRegExp("\\w+").exactMatch(cc.name))
+        return fail("client class name must be a word, not '"
+                    + cc.name + "'");
+    Q_FOREACH(const ClientClass & other, m_classes)
+        if (other.name == cc.name)
+            return fail("client class " + cc.name + " appears twice");
+    Q_FOREACH(QString key, source.keys())
+        if (!keys.contains(key))
+            return fail(cc.name + ": unknown key " + key);
+
+    QString where = cc.name + ": ";
+    bool ok;
+    cc.count = source["count"].toInt(&ok);
+    if (!ok || cc.count < 0)
+        return fail(where + "count must be a number of clients");
+    if (!Behaviour::parseAction(source["behaviour"].toString(),
+                                &cc.behaviour.action))
+        return fail(where + "behaviour must be lurk, draw, badfollow,"
+                    " oldreconnect, disconnect, blackhat or replay");
+
+    if (source.contains("think") && !cc.behaviour.think.parse(source["think"]))
+        return fail(where + "bad think distribution");
+    if (source.contains("edits") && !cc.behaviour.edits.parse(source["edits"]))
+        return fail(where + "bad edits distribution");
+    if (source.contains("edit_size")
+        && !cc.behaviour.edit_size.parse(source["edit_size"]))
+        return fail(where + "bad edit_size distribution");
+
+    if (source.contains("reconnect")) {
+        QVariant reconnect = source["reconnect"];
+        if (reconnect.type() == QVariant::Bool) {
+            cc.behaviour.reconnect = reconnect.toBool();
+        } else if (reconnect.type() == QVariant::Map) {
+            QVariantMap policy = reconnect.toMap();
+            if (policy.contains("delay")
+                && !cc.behaviour.reconnect_delay.parse(policy["delay"]))
+                return fail(where + "bad reconnect delay distribution");
+            if (policy.contains("session")
+                && !cc.behaviour.session.parse(policy["session"]))
+                return fail(where + "bad reconnect session distribution");
+        } else {
+            return fail(where + "reconnect must be false, true or an object"
+                        " with a delay and a session");
+        }
+    }
+
+    m_classes << cc;
+    return true;
+}
+
+QVariant Scenario::toVariant() const {
+    QVariantList classes;
+    Q_FOREACH(const ClientClass & cc, m_classes) {
+        QVariantMap source = cc.source;
+        source["count"] = cc.count;
+        classes << source;
+    }
+    QVariantMap scenario;
+    scenario["classes"] = classes;
+    return scenario;
+}
+
+Scenario Scenario::slice(int number, int of) const {
+    Scenario share(*this);
+    for (int i = 0; i < share.m_classes.length(); i++) {
+        int total = share.m_classes[i].count;
+        share.m_classes[i].count = total / of + (number < total % of ? 1 : 0);
+    }
+    return share;
+}
+
+int Scenario::drawers() const {
+    int drawers = 0;
+    Q_FOREACH(const ClientClass & cc, m_classes)
+        if (cc.behaviour.action == Behaviour::Draw)
+            drawers += cc.count;
+    return drawers;
+}
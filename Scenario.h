@@ -0,0 +1,62 @@
+#ifndef SCENARIO_H
+#define SCENARIO_H
+
+#include <QList>
+#include <QString>
+#include <QVariant>
+
+#include "Behaviour.h"
+
+// The client classes of a run, from --clients or a --scenario file.
+
+// A scenario file is a JSON object with a list of classes:
+//   {"classes": [
+//     {"name": "reader", "behaviour": "lurk", "count": 1000},
+//     {"name": "artist", "behaviour": "draw", "count": 100,
+//      "think": {"dist": "exponential", "mean": 5},
+//      "edits": {"dist": "uniform", "min": 1, "max": 5},
+//      "edit_size": 10,
+//      "reconnect": {"delay": {"dist": "uniform", "min": 1, "max": 10},
+//                    "session": {"dist": "normal", "mean": 300,
+//                                "stddev": 60}}}
+//   ]}
+// The behaviour is one of the client types of --clients, and the name
+// takes the place of the type in client names, --transport and the
+// commit.TYPE latencies. Distributions are in the forms Distribution
+// takes; "reconnect" can also be false, to stay away once disconnected.
+// Whatever is left out keeps the value the client type has.
+
+class Scenario {
+  public:
+    struct ClientClass {
+        QString name;
+        int count;
+        Behaviour behaviour;
+        QVariantMap source;  // the class as given, to hand on to agents
+    };
+
+    // A --clients value like lurk:10,draw:50
+    bool setClients(const QString & spec);
+    // Read a scenario file
+    bool load(const QString & path);
+    bool setVariant(const QVariant & scenario);
+    QVariant toVariant() const;
+
+    // Share number of `of` of every class, the first ones getting one
+    // more client of a class that doesn't divide evenly
+    Scenario slice(int number, int of) const;
+
+    const QList<ClientClass> & classes() const { return m_classes; }
+    int drawers() const;
+    // Why the last set or load failed
+    QString error() const { return m_error; }
+
+  private:
+    bool addClass(const QVariantMap & source);
+    bool fail(const QString & error);
+
+    QList<ClientClass> m_classes;
+    QString m_error;
+};
+
+#endif
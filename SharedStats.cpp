@@ -0,0 +1,209 @@
+#include "SharedStats.h"
+
+#include <QAtomicInt>
+#include <QByteArray>
+#include <QMap>
+#include <QtGlobal>
+
+#include <cstring>
+#include <sched.h>  // for sched_yield()
+#include <sys/mman.h>
+
+// Bytes for a name, including the terminating 0
+#define NAME_LEN 56
+// Entries per slot
+#define MAX_COUNTERS 256
+#define MAX_GAUGES 64
+#define MAX_HISTOGRAMS 128
+
+// Histogram kinds besides phase numbers
+#define KIND_TOTAL -1
+#define KIND_INTERVAL -2
+
+namespace {
+
+    struct Header {
+        QAtomicInt seq;
+        qint32 counters;
+        qint32 gauges;
+        qint32 histograms;
+    };
+
+    struct Value {
+        char name[NAME_LEN];
+        qint64 value;
+    };
+
+    struct HistogramHeader {
+        char name[NAME_LEN];
+        qint32 kind;
+        qint32 unused;
+    };
+
+    static size_t histogramSize() {
+        return sizeof(HistogramHeader) + Histogram::rawSize() * sizeof(qint64);
+    }
+
+    static Value *counters(char *slot) {
+        return reinterpret_cast<Value *>(slot + sizeof(Header));
+    }
+
+    static Value *gauges(char *slot) {
+        return counters(slot) + MAX_COUNTERS;
+    }
+
+    static char *histogram(char *slot, int i) {
+        return reinterpret_cast<char *>(gauges(slot) + MAX_GAUGES)
+               + i * histogramSize();
+    }
+
+    static void setName(char *name, const QString & value) {
+        QByteArray utf8 = value.toUtf8().left(NAME_LEN - 1);
+        memcpy(name, utf8.constData(), utf8.size());
+        name[utf8.size()] = 0;
+    }
+
+    static bool warned = false;
+
+    static void warnFull() {
+        if (!warned)
+            qWarning("shared stats slot is full, dropping entries");
+        warned = true;
+    }
+
+    // Write map into values, returning how many fitted
+    static int writeValues(Value *values, int max,
+                           const QMap<QString, qint64> & map) {
+        int n = 0;
+        QMapIterator<QString, qint64> it(map);
+        while (it.hasNext()) {
+            it.next();
+            if (n == max) {
+                warnFull();
+                break;
+            }
+            setName(values[n].name, it.key());
+            values[n].value = it.value();
+            n++;
+        }
+        return n;
+    }
+
+    static void readValues(const Value *values, int n,
+                           QMap<QString, qint64> *map) {
+        for (int i = 0; i < n; i++)
+            (*map)[QString::fromUtf8(values[i].name)] += values[i].value;
+    }
+
+    static void writeHistograms(char *slot, int *n, int kind,
+                                const QMap<QString, Histogram> & map) {
+        QMapIterator<QString, Histogram> it(map);
+        while (it.hasNext()) {
+            it.next();
+            if (*n == MAX_HISTOGRAMS) {
+                warnFull();
+                return;
+            }
+            char *entry = histogram(slot, *n);
+            HistogramHeader *header =
+                reinterpret_cast<HistogramHeader *>(entry);
+            setName(header->name, it.key());
+            header->kind = kind;
+            it.value().saveRaw(
+                reinterpret_cast<qint64 *>(entry + sizeof(HistogramHeader)));
+            (*n)++;
+        }
+    }
+
+}
+
+SharedStats::SharedStats(char *segment, int workers, size_t slot_size)
+  : m_segment(segment), m_workers(workers), m_worker(-1),
+    m_slot_size(slot_size) {
+}
+
+SharedStats *SharedStats::create(int workers) {
+    size_t slot_size = sizeof(Header)
+                       + (MAX_COUNTERS + MAX_GAUGES) * sizeof(Value)
+                       + MAX_HISTOGRAMS * histogramSize();
+    // Anonymous shared pages start out zeroed, which is a valid empty
+    // slot with an even sequence number
+    void *segment = mmap(0, workers * slot_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (segment == MAP_FAILED)
+        return 0;
+    return new SharedStats(static_cast<char *>(segment), workers, slot_size);
+}
+
+void SharedStats::publish(const Snapshot & snapshot) {
+    char *s = slot(m_worker);
+    Header *header = reinterpret_cast<Header *>(s);
+
+    header->seq.fetchAndAddOrdered(1);
+    header->counters = writeValues(counters(s), MAX_COUNTERS,
+                                   snapshot.counters);
+    header->gauges = writeValues(gauges(s), MAX_GAUGES, snapshot.gauges);
+    int n = 0;
+    writeHistograms(s, &n, KIND_TOTAL, snapshot.histograms);
+    writeHistograms(s, &n, KIND_INTERVAL, snapshot.interval);
+    QMapIterator<int, QMap<QString, Histogram> > pt(snapshot.phases);
+    while (pt.hasNext()) {
+        pt.next();
+        writeHistograms(s, &n, pt.key(), pt.value());
+    }
+    header->histograms = n;
+    header->seq.fetchAndAddOrdered(1);
+}
+
+void SharedStats::readSlot(int worker, char *copy) const {
+    char *s = slot(worker);
+    Header *header = reinterpret_cast<Header *>(s);
+    forever {
+        int before = header->seq.fetchAndAddOrdered(0);
+        if (before % 2 == 0) {
+            // The header first, to copy only the entries in use
+            memcpy(copy, s, sizeof(Header));
+            Header *h = reinterpret_cast<Header *>(copy);
+            int n = qBound(0, int(h->histograms), MAX_HISTOGRAMS);
+            memcpy(copy, s, histogram(s, n) - s);
+            if (header->seq.fetchAndAddOrdered(0) == before)
+                return;
+        }
+        sched_yield();
+    }
+}
+
+SharedStats::Snapshot SharedStats::read() const {
+    Snapshot total;
+    QByteArray buffer(m_slot_size, 0);
+    char *copy = buffer.data();
+    for (int worker = 0; worker < m_workers; worker++) {
+        readSlot(worker, copy);
+        const Header *header = reinterpret_cast<const Header *>(copy);
+
+        Snapshot snapshot;
+        readValues(counters(copy),
+                   qBound(0, int(header->counters), MAX_COUNTERS),
+                   &snapshot.counters);
+        readValues(gauges(copy), qBound(0, int(header->gauges), MAX_GAUGES),
+                   &snapshot.gauges);
+        int n = qBound(0, int(header->histograms), MAX_HISTOGRAMS);
+        for (int i = 0; i < n; i++) {
+            const char *entry = histogram(copy, i);
+            const HistogramHeader *hh =
+                reinterpret_cast<const HistogramHeader *>(entry);
+            Histogram h;
+            h.loadRaw(reinterpret_cast<const qint64 *>(
+                entry + sizeof(HistogramHeader)));
+            QString name = QString::fromUtf8(hh->name);
+            if (hh->kind == KIND_TOTAL)
+                snapshot.histograms[name] = h;
+            else if (hh->kind == KIND_INTERVAL)
+                snapshot.interval[name] = h;
+            else
+                snapshot.phases[hh->kind][name] = h;
+        }
+        total.add(snapshot);
+    }
+    return total;
+}
@@ -0,0 +1,51 @@
+#ifndef SHAREDSTATS_H
+#define SHAREDSTATS_H
+
+#include <cstddef>
+
+#include "Stats.h"
+
+// A shared memory segment through which worker processes hand their
+// stats to the parent (see WorkerProcesses).
+
+// The segment is mapped before forking, with a fixed-size slot for each
+// worker. A worker publishes a snapshot of everything it has counted and
+// recorded into its own slot every second and when it quits; nothing is
+// sent per event. Each slot is a seqlock: the sequence number is odd
+// while the worker writes, and the parent copies the slot until it gets
+// the same even number before and after the copy.
+
+// Snapshots are cumulative. The interval latencies are never reset in the
+// workers, so the parent gets the latencies of an interval as the
+// difference between two snapshots.
+
+// Names are cut to fit, and entries beyond the slot's capacity are
+// dropped with a warning.
+
+class SharedStats : public Stats::Source, public Stats::Sink {
+  public:
+    typedef Stats::Snapshot Snapshot;
+
+    // Map a segment with one slot per worker; call before forking
+    static SharedStats *create(int workers);
+
+    int workers() const { return m_workers; }
+    // In a worker process, the slot to publish to
+    void setWorker(int worker) { m_worker = worker; }
+
+    void publish(const Snapshot & snapshot);
+    // Merge the latest snapshots of all workers
+    Snapshot read() const;
+
+  private:
+    SharedStats(char *segment, int workers, size_t slot_size);
+    char *slot(int worker) const { return m_segment + worker * m_slot_size; }
+    void readSlot(int worker, char *copy) const;
+
+    char *m_segment;
+    int m_workers;
+    int m_worker;
+    size_t m_slot_size;
+};
+
+#endif
@@ -0,0 +1,408 @@
+#include "Stats.h"
+
+#include <QDateTime>
+#include <QStringList>
+#include <QVector>
+
+#include <cstdio>
+#include <cstring>  // for memcpy()
+#include <time.h>
+
+// How often a snapshot is published to the sink
+#define PUBLISH_MSECS 1000
+
+bool Stats::c_keep_interval = false;
+QAtomicInt Stats::c_phase(-1);
+QList<QString> Stats::c_phase_names;
+QMutex Stats::c_shards_lock;
+QList<Stats *> Stats::c_shards;
+__thread Stats *Stats::c_instance = 0;
+
+Stats::Stats()
+  : Logger("stats"), m_interval_secs(0), m_sink(0) {
+    connect(&m_interval_timer, SIGNAL(timeout()), SLOT(reportInterval()));
+    connect(&m_publish_timer, SIGNAL(timeout()), SLOT(publish()));
+}
+
+Stats *Stats::instance() {
+    if (!c_instance) {
+        c_instance = new Stats;
+        QMutexLocker lock(&c_shards_lock);
+        c_shards << c_instance;
+    }
+    return c_instance;
+}
+
+QList<Stats *> Stats::shards() {
+    QMutexLocker lock(&c_shards_lock);
+    return c_shards;
+}
+
+qint64 Stats::usecs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return qint64(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+void Stats::count(const QString & name, qint64 n) {
+    QMutexLocker lock(&m_lock);
+    m_counters[name] += n;
+}
+
+void Stats::gauge(const QString & name, qint64 delta) {
+    QMutexLocker lock(&m_lock);
+    m_gauges[name] += delta;
+}
+
+void Stats::record(const QString & name, qint64 usecs) {
+    int phase = c_phase;
+    QMutexLocker lock(&m_lock);
+    if (phase < 0 || phase % 2)
+        m_histograms[name].record(usecs);
+    if (phase >= 0)
+        m_phases[phase / 2][name].record(usecs);
+    if (c_keep_interval)
+        m_interval[name].record(usecs);
+}
+
+namespace {
+
+    static void merge(QMap<QString, qint64> *into,
+                      const QMap<QString, qint64> & from) {
+        QMapIterator<QString, qint64> it(from);
+        while (it.hasNext()) {
+            it.next();
+            (*into)[it.key()] += it.value();
+        }
+    }
+
+    static void merge(QMap<QString, Histogram> *into,
+                      const QMap<QString, Histogram> & from) {
+        QMapIterator<QString, Histogram> it(from);
+        while (it.hasNext()) {
+            it.next();
+            (*into)[it.key()].add(it.value());
+        }
+    }
+
+}
+
+void Stats::Snapshot::add(const Snapshot & other) {
+    merge(&counters, other.counters);
+    merge(&gauges, other.gauges);
+    merge(&histograms, other.histograms);
+    merge(&interval, other.interval);
+    QMapIterator<int, QMap<QString, Histogram> > it(other.phases);
+    while (it.hasNext()) {
+        it.next();
+        merge(&phases[it.key()], it.value());
+    }
+}
+
+namespace {
+
+    static QVariantMap encodeValues(const QMap<QString, qint64> & values) {
+        QVariantMap map;
+        QMapIterator<QString, qint64> it(values);
+        while (it.hasNext()) {
+            it.next();
+            map[it.key()] = it.value();
+        }
+        return map;
+    }
+
+    static QMap<QString, qint64> decodeValues(const QVariant & variant) {
+        QMap<QString, qint64> values;
+        QMapIterator<QString, QVariant> it(variant.toMap());
+        while (it.hasNext()) {
+            it.next();
+            values[it.key()] = it.value().toLongLong();
+        }
+        return values;
+    }
+
+    // [count, min, max, sum, bucket, count, bucket, count, ...]
+    static QVariantMap encodeHistograms(
+            const QMap<QString, Histogram> & histograms) {
+        QVector<qint64> raw(Histogram::rawSize());
+        QVariantMap map;
+        QMapIterator<QString, Histogram> it(histograms);
+        while (it.hasNext()) {
+            it.next();
+            const Histogram & h = it.value();
+            h.saveRaw(raw.data());
+            QVariantList list;
+            list << h.count() << h.min() << h.max() << h.sum();
+            for (int i = 4; i < raw.size(); i++)
+                if (raw[i] != 0)
+                    list << i - 4 << raw[i];
+            map[it.key()] = list;
+        }
+        return map;
+    }
+
+    static QMap<QString, Histogram> decodeHistograms(const QVariant & variant) {
+        QVector<qint64> raw(Histogram::rawSize());
+        QMap<QString, Histogram> histograms;
+        QMapIterator<QString, QVariant> it(variant.toMap());
+        while (it.hasNext()) {
+            it.next();
+            QVariantList list = it.value().toList();
+            if (list.length() < 4)
+                continue;
+            raw.fill(0);
+            raw[0] = list[0].toLongLong();
+            raw[1] = list[1].toLongLong();
+            raw[2] = list[2].toLongLong();
+            double sum = list[3].toDouble();
+            memcpy(&raw[3], &sum, sizeof(sum));
+            for (int i = 4; i + 1 < list.length(); i += 2) {
+                int bucket = list[i].toInt();
+                if (bucket >= 0 && bucket + 4 < raw.size())
+                    raw[bucket + 4] = list[i + 1].toLongLong();
+            }
+            histograms[it.key()].loadRaw(raw.constData());
+        }
+        return histograms;
+    }
+
+}
+
+QVariantMap Stats::Snapshot::toVariant() const {
+    QVariantMap map;
+    map["counters"] = encodeValues(counters);
+    map["gauges"] = encodeValues(gauges);
+    map["histograms"] = encodeHistograms(histograms);
+    map["interval"] = encodeHistograms(interval);
+    QVariantMap by_phase;
+    QMapIterator<int, QMap<QString, Histogram> > it(phases);
+    while (it.hasNext()) {
+        it.next();
+        by_phase[QString::number(it.key())] = encodeHistograms(it.value());
+    }
+    map["phases"] = by_phase;
+    return map;
+}
+
+Stats::Snapshot Stats::Snapshot::fromVariant(const QVariantMap & map) {
+    Snapshot snapshot;
+    snapshot.counters = decodeValues(map["counters"]);
+    snapshot.gauges = decodeValues(map["gauges"]);
+    snapshot.histograms = decodeHistograms(map["histograms"]);
+    snapshot.interval = decodeHistograms(map["interval"]);
+    QMapIterator<QString, QVariant> it(map["phases"].toMap());
+    while (it.hasNext()) {
+        it.next();
+        snapshot.phases[it.key().toInt()] = decodeHistograms(it.value());
+    }
+    return snapshot;
+}
+
+Stats::Snapshot Stats::snapshot() const {
+    Snapshot total;
+    Q_FOREACH(Stats *shard, shards()) {
+        QMutexLocker lock(&shard->m_lock);
+        merge(&total.counters, shard->m_counters);
+        merge(&total.gauges, shard->m_gauges);
+        merge(&total.histograms, shard->m_histograms);
+        merge(&total.interval, shard->m_interval);
+        QMapIterator<int, QMap<QString, Histogram> > it(shard->m_phases);
+        while (it.hasNext()) {
+            it.next();
+            merge(&total.phases[it.key()], it.value());
+        }
+    }
+    Q_FOREACH(Source *source, m_sources)
+        total.add(source->read());
+    return total;
+}
+
+void Stats::setPhase(const QString & name, bool counted) {
+    int number = c_phase_names.indexOf(name);
+    if (number < 0) {
+        number = c_phase_names.length();
+        c_phase_names << name;
+    }
+    c_phase = number * 2 + (counted ? 1 : 0);
+}
+
+void Stats::setInterval(int secs) {
+    m_interval_secs = secs;
+    c_keep_interval = secs > 0;
+    if (secs > 0) {
+        m_interval_timer.start(secs * 1000);
+        m_interval_clock.start();
+    } else {
+        m_interval_timer.stop();
+    }
+}
+
+bool Stats::setMetricsFile(const QString & path) {
+    if (path == "-")
+        return m_metrics.open(stdout, QIODevice::WriteOnly);
+    m_metrics.setFileName(path);
+    return m_metrics.open(QIODevice::WriteOnly | QIODevice::Truncate);
+}
+
+void Stats::addSource(Source *source) {
+    m_sources << source;
+}
+
+void Stats::setSink(Sink *sink) {
+    m_sink = sink;
+    // keep every latency, for the receiving end to take differences
+    c_keep_interval = true;
+    m_publish_timer.start(PUBLISH_MSECS);
+}
+
+void Stats::publish() {
+    m_sink->publish(snapshot());
+}
+
+void Stats::report() {
+    // finish the last, partial interval
+    if (m_interval_timer.isActive())
+        reportInterval();
+
+    Snapshot totals = snapshot();
+    QMapIterator<QString, qint64> gt(totals.gauges);
+    while (gt.hasNext()) {
+        gt.next();
+        log(Info, gt.key() + " " + QString::number(gt.value()));
+    }
+    QMapIterator<QString, qint64> it(totals.counters);
+    while (it.hasNext()) {
+        it.next();
+        log(Info, it.key() + " " + QString::number(it.value()));
+    }
+    QMapIterator<QString, Histogram> hit(totals.histograms);
+    while (hit.hasNext()) {
+        hit.next();
+        log(Info, hit.key() + " ms " + hit.value().summary());
+    }
+
+    for (int number = 0; number < c_phase_names.length(); number++) {
+        QMapIterator<QString, Histogram> pit(totals.phases[number]);
+        while (pit.hasNext()) {
+            pit.next();
+            log(Info, "phase " + c_phase_names[number] + " " + pit.key()
+                      + " ms " + pit.value().summary());
+        }
+    }
+}
+
+namespace {
+
+    // Object members for the metrics line; the names are plain
+    // identifiers so they need no escaping.
+    static QString member(const QString & name, const QString & value) {
+        return "\"" + name + "\":" + value;
+    }
+
+    static QString object(const QStringList & members) {
+        return "{" + members.join(",") + "}";
+    }
+
+}
+
+void Stats::writeMetrics(const Snapshot & totals,
+                         const QMap<QString, Histogram> & interval) {
+    double secs = m_interval_clock.restart() / 1000.0;
+
+    QStringList gauges;
+    QMapIterator<QString, qint64> gt(totals.gauges);
+    while (gt.hasNext()) {
+        gt.next();
+        // client state gauges are named clients.STATE
+        gauges << member(gt.key().section('.', -1), QString::number(gt.value()));
+    }
+
+    QMap<QString, QStringList> groups;
+    QMapIterator<QString, qint64> it(totals.counters);
+    while (it.hasNext()) {
+        it.next();
+        qint64 delta = it.value() - m_last_counters.value(it.key());
+        QString group = it.key().section('.', 0, 0);
+        if (group == "sent" || group == "received")
+            groups[group] << member(it.key().section('.', 1), QString::number(delta));
+        else if (group == "error")
+            groups["errors"] << member(it.key().section('.', 1), QString::number(delta));
+        else
+            groups["counters"] << member(it.key(), QString::number(delta));
+    }
+    m_last_counters = totals.counters;
+
+    QStringList latency;
+    qint64 commits = 0;
+    QMapIterator<QString, Histogram> ht(interval);
+    while (ht.hasNext()) {
+        ht.next();
+        const Histogram & h = ht.value();
+        if (ht.key().startsWith("commit."))
+            commits += h.count();
+        QStringList values;
+        values << member("count", QString::number(h.count()))
+               << member("p50", QString::number(h.percentile(50) / 1000.0))
+               << member("p90", QString::number(h.percentile(90) / 1000.0))
+               << member("p99", QString::number(h.percentile(99) / 1000.0))
+               << member("p99.9", QString::number(h.percentile(99.9) / 1000.0))
+               << member("max", QString::number(h.max() / 1000.0));
+        latency << member(ht.key(), object(values));
+    }
+
+    int number = c_phase;
+    QString phase = number < 0 ? QString() : c_phase_names[number / 2];
+
+    QStringList line;
+    line << member("time", QString::number(QDateTime::currentMSecsSinceEpoch()))
+         << member("interval", QString::number(secs))
+         << member("phase", "\"" + phase + "\"")
+         << member("clients", object(gauges))
+         << member("sent", object(groups["sent"]))
+         << member("received", object(groups["received"]))
+         << member("errors", object(groups["errors"]))
+         << member("counters", object(groups["counters"]))
+         << member("commits_per_sec",
+                   QString::number(secs > 0 ? commits / secs : 0))
+         << member("latency_ms", object(latency));
+    m_metrics.write(object(line).toUtf8());
+    m_metrics.write("\n");
+    m_metrics.flush();
+}
+
+void Stats::reportInterval() {
+    // take the interval latencies out of every shard
+    QMap<QString, Histogram> interval;
+    Q_FOREACH(Stats *shard, shards()) {
+        QMutexLocker lock(&shard->m_lock);
+        QMutableMapIterator<QString, Histogram> sit(shard->m_interval);
+        while (sit.hasNext()) {
+            sit.next();
+            interval[sit.key()].add(sit.value());
+            sit.value().reset();
+        }
+    }
+
+    // The sources never reset theirs, so take the difference from the
+    // last time
+    Snapshot totals = snapshot();
+    if (!m_sources.isEmpty()) {
+        QMapIterator<QString, Histogram> wit(totals.interval);
+        while (wit.hasNext()) {
+            wit.next();
+            Histogram latest = wit.value();
+            latest.subtract(m_sources_interval.value(wit.key()));
+            interval[wit.key()].add(latest);
+        }
+        m_sources_interval = totals.interval;
+    }
+
+    if (m_metrics.isOpen())
+        writeMetrics(totals, interval);
+
+    QMapIterator<QString, Histogram> it(interval);
+    while (it.hasNext()) {
+        it.next();
+        log(Info, "interval " + it.key() + " ms " + it.value().summary());
+    }
+}
@@ -0,0 +1,151 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <QAtomicInt>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QList>
+#include <QMap>
+#include <QMutex>
+#include <QObject>
+#include <QString>
+#include <QTimer>
+#include <QVariant>
+
+#include "Histogram.h"
+#include "Logger.h"
+
+// Global counters and latency histograms for the whole run, reported
+// at the end.
+
+// Counters are identified by dotted names like "xhr.posts" so that
+// new ones can be added where they happen without registering them.
+// Latencies work the same way, with names like "commit.draw". They are
+// also collected per interval if an interval is set, and the interval
+// percentiles are logged and reset each time it expires.
+
+// Gauges are values that go up and down, like the number of clients in
+// each state.
+
+// With a metrics file, each interval also writes one JSON line with the
+// gauges, the counter increments during the interval and the interval
+// percentiles. Counters named "sent.X", "received.X" and "error.X" are
+// grouped under "sent", "received" and "errors".
+
+// While a phase is set (see LoadProfile), latencies are also collected
+// per phase, and reported per phase at the end.
+
+// With worker threads, each thread counts into a shard of its own, so
+// that the threads don't contend on one lock. The totals, the interval
+// reports and the final report are merged from all shards, and are only
+// made from the main thread, which is also the only one to set the
+// interval, the metrics file and the phase.
+
+// Other processes can hand their totals over: a worker process publishes
+// a snapshot to a sink every second and at the end instead of reporting,
+// and the process that reports adds the latest snapshots from its sources
+// wherever it merges its own shards. Worker processes do this through
+// shared memory (see SharedStats), agents over TCP (see Coordinator).
+
+class Stats : public QObject, private Logger {
+    Q_OBJECT
+
+  public:
+    // The shard of the calling thread
+    static Stats *instance();
+
+    // Monotonic time in microseconds, comparable between clients
+    static qint64 usecs();
+
+    void count(const QString & name, qint64 n = 1);
+    void gauge(const QString & name, qint64 delta);
+    void record(const QString & name, qint64 usecs);
+
+    // Everything counted and recorded so far
+    struct Snapshot {
+        QMap<QString, qint64> counters;
+        QMap<QString, qint64> gauges;
+        QMap<QString, Histogram> histograms;
+        // since the last interval report, or since the start in a
+        // worker process
+        QMap<QString, Histogram> interval;
+        QMap<int, QMap<QString, Histogram> > phases;  // by phase number
+
+        // Fold in another snapshot
+        void add(const Snapshot & other);
+
+        // For sending as JSON; histograms only list their non-empty
+        // buckets
+        QVariantMap toVariant() const;
+        static Snapshot fromVariant(const QVariantMap & map);
+    };
+    // Totals over all threads and sources
+    Snapshot snapshot() const;
+
+    class Source {
+      public:
+        virtual ~Source() { }
+        // The latest totals of the processes behind this source
+        virtual Snapshot read() const = 0;
+    };
+
+    class Sink {
+      public:
+        virtual ~Sink() { }
+        virtual void publish(const Snapshot & snapshot) = 0;
+    };
+
+    // 0 turns off the interval reports
+    void setInterval(int secs);
+    int interval() const { return m_interval_secs; }
+    // Latencies from now on are also kept under this phase name, and
+    // only go into the whole-run totals if counted is set
+    void setPhase(const QString & name, bool counted);
+
+    // Write JSON lines to path, or to stdout if path is "-"
+    bool setMetricsFile(const QString & path);
+
+    void addSource(Source *source);
+    void setSink(Sink *sink);
+
+  public slots:
+    void report();
+    void reportInterval();
+    void publish();
+
+  private:
+    Stats();
+    static QList<Stats *> shards();
+    void writeMetrics(const Snapshot & totals,
+                      const QMap<QString, Histogram> & interval);
+
+    // The owning thread writes these and the main thread reads them
+    mutable QMutex m_lock;
+    QMap<QString, qint64> m_counters;
+    QMap<QString, Histogram> m_histograms;
+    QMap<QString, qint64> m_gauges;
+    QMap<QString, Histogram> m_interval;
+    QMap<int, QMap<QString, Histogram> > m_phases;  // by phase number
+
+    // Main thread only
+    QMap<QString, qint64> m_last_counters;  // as of the last interval
+    QTimer m_interval_timer;
+    QElapsedTimer m_interval_clock;
+    int m_interval_secs;
+    QFile m_metrics;
+    QList<Source *> m_sources;
+    Sink *m_sink;
+    QTimer m_publish_timer;
+    // The sources' interval latencies as of the last interval
+    QMap<QString, Histogram> m_sources_interval;
+
+    static bool c_keep_interval;  // set up before any threads start
+    // Current phase number times 2, plus 1 if it is counted; -1 for none
+    static QAtomicInt c_phase;
+    static QList<QString> c_phase_names;  // by phase number
+    static QMutex c_shards_lock;
+    static QList<Stats *> c_shards;
+    static __thread Stats *c_instance;  // one per thread
+};
+
+#endif
@@ -0,0 +1,269 @@
+#include "Transport.h"
+
+#include <QAuthenticator>
+#include <QDateTime>
+#include <QList>
+#include <QNetworkAccessManager>
+#include <QNetworkCookie>
+#include <QNetworkCookieJar>
+#include <QNetworkRequest>
+
+#include <qjson/serializer.h>
+
+#include "FrameDecoder.h"
+#include "NetworkPool.h"
+#include "Stats.h"
+#include "WsClient.h"
+#include "XhrClient.h"
+
+QString Transport::kindName(Kind kind) {
+    switch (kind) {
+        case Xhr: return "xhr";
+        case WebSocket: return "ws";
+    }
+    return "unknown";
+}
+
+Transport *Transport::create(Kind kind, QUrl padurl, QUrl baseurl,
+                             const QString & name, QObject *parent) {
+    if (kind == WebSocket)
+        return new WsClient(padurl, baseurl, name, parent);
+    return new XhrClient(padurl, baseurl, name, parent);
+}
+
+Transport::Transport(QUrl padurl, QUrl baseurl, const QString & name,
+                     QObject *parent)
+  : QObject(parent), Logger(name), m_padurl(padurl), m_baseurl(baseurl)  {
+
+    m_network = 0;
+    m_pooled = false;
+    m_cookies = new QNetworkCookieJar(this);
+    m_cookie_header_valid = false;
+    m_join_clock.invalidate();
+    NetworkPool::countClient(1);
+
+    if (m_baseurl.userName() != "") {
+        m_username = m_baseurl.userName();
+        m_baseurl.setUserName("");
+    }
+    if (m_baseurl.password() != "") {
+        m_password = m_baseurl.password();
+        m_baseurl.setPassword("");
+    }
+    m_padurl.setUserName("");
+    m_padurl.setPassword("");
+}
+
+Transport::~Transport() {
+    NetworkPool::countClient(-1);
+    if (m_pooled) {
+        NetworkPool::instance()->release(m_network);
+    } else if (m_network) {
+        delete m_network;
+        NetworkPool::countManager(-1);
+    }
+}
+
+void Transport::authenticate(QNetworkReply *, QAuthenticator *auth) {
+    log(Trace, QString("authenticating ") + auth->realm());
+    auth->setUser(m_username);
+    auth->setPassword(m_password);
+}
+
+void Transport::reset_network() {
+    if (NetworkPool::clientsPerManager() > 0) {
+        // Stick with the same shared manager across restarts
+        if (!m_network) {
+            m_network = NetworkPool::instance()->acquire();
+            m_pooled = true;
+        }
+        return;
+    }
+
+    if (m_network) {
+        log(Trace, "cleaning up old transport");
+        m_network->deleteLater();
+        NetworkPool::countManager(-1);
+    }
+
+    m_network = new QNetworkAccessManager(this);
+    NetworkPool::countManager(1);
+    connect(m_network,
+      SIGNAL(authenticationRequired(QNetworkReply *, QAuthenticator *)),
+      SLOT(authenticate(QNetworkReply *, QAuthenticator *)));
+}
+
+QNetworkRequest Transport::make_request(QUrl url) {
+    url.addQueryItem("t", QString::number(QDateTime::currentMSecsSinceEpoch()));
+    QNetworkRequest request(url);
+    request.setOriginatingObject(this);
+
+    // Keep the manager's own cookie jar out of it, it may be shared
+    request.setAttribute(QNetworkRequest::CookieLoadControlAttribute,
+                         QNetworkRequest::Manual);
+    request.setAttribute(QNetworkRequest::CookieSaveControlAttribute,
+                         QNetworkRequest::Manual);
+    // A shared manager would reuse the connection for whichever of its
+    // clients asks next, so use it for this request only
+    if (m_pooled)
+        request.setRawHeader("Connection", "close");
+    QList<QNetworkCookie> cookies = m_cookies->cookiesForUrl(url);
+    if (!cookies.isEmpty())
+        request.setHeader(QNetworkRequest::CookieHeader,
+                          qVariantFromValue(cookies));
+    return request;
+}
+
+QNetworkReply *Transport::http_get(QUrl url) {
+    QNetworkRequest request = make_request(url);
+    log(Trace, "GET " + request.url().toString());
+    QNetworkReply *reply = m_network->get(request);
+    reply->ignoreSslErrors();
+    connect(reply, SIGNAL(finished()), SLOT(store_cookies()));
+    return reply;
+}
+
+QNetworkReply *Transport::http_post(QUrl url, const QByteArray & data) {
+    QNetworkReply *reply = m_network->post(make_request(url), data);
+    reply->ignoreSslErrors();
+    connect(reply, SIGNAL(finished()), SLOT(store_cookies()));
+    return reply;
+}
+
+void Transport::store_cookies() {
+    QNetworkReply *reply = qobject_cast<QNetworkReply *>(sender());
+    if (!reply)
+        return;
+    QList<QNetworkCookie> cookies = qvariant_cast<QList<QNetworkCookie> >(
+        reply->header(QNetworkRequest::SetCookieHeader));
+    if (!cookies.isEmpty()) {
+        m_cookies->setCookiesFromUrl(cookies, reply->url());
+        m_cookie_header_valid = false;
+    }
+}
+
+QByteArray Transport::cookie_header() {
+    if (!m_cookie_header_valid) {
+        m_cookie_header.clear();
+        QList<QNetworkCookie> cookies = m_cookies->cookiesForUrl(m_baseurl);
+        for (int i = 0; i < cookies.size(); i++) {
+            m_cookie_header += i == 0 ? "Cookie: " : "; ";
+            m_cookie_header +=
+                cookies[i].toRawForm(QNetworkCookie::NameAndValueOnly);
+        }
+        if (!cookies.isEmpty())
+            m_cookie_header += "\r\n";
+        m_cookie_header_valid = true;
+    }
+    return m_cookie_header;
+}
+
+void Transport::store_cookie_header(const QByteArray & set_cookie) {
+    m_cookies->setCookiesFromUrl(QNetworkCookie::parseCookies(set_cookie),
+                                 m_baseurl);
+    m_cookie_header_valid = false;
+}
+
+QUrl Transport::socketio_url(const QString & path) const {
+    QUrl url(m_baseurl);
+    url.setPath(m_baseurl.path() + "socket.io/1/" + path);
+    return url;
+}
+
+void Transport::parse_payload(const QByteArray & payload) {
+    FrameDecoder decoder(payload);
+    QByteArray message;
+    while (decoder.next(&message))
+        parse_message(message);
+    if (decoder.error()) {
+        Stats::instance()->count("error.bad_payload");
+        log(Error, "received badly framed payload: "
+                   + QString::fromUtf8(payload));
+    }
+}
+
+void Transport::join_started() {
+    m_join_clock.start();
+}
+
+void Transport::join_step(const char *step, bool last) {
+    if (!m_join_clock.isValid())
+        return;
+    Stats::instance()->record(QString("join.") + step,
+                              m_join_clock.nsecsElapsed() / 1000);
+    if (last)
+        m_join_clock.invalidate();
+    else
+        m_join_clock.restart();
+}
+
+void Transport::send(const QVariant & msg) {
+    QByteArray packet("4:::");
+    packet += QJson::Serializer().serialize(msg);
+    send_raw(packet);
+}
+
+void Transport::parse_message(const QByteArray & message) {
+    QByteArray payload;
+    int msg_type = FrameDecoder::packetType(message, &payload);
+    if (log_enabled(Trace))
+        log(Trace, "received " + QString::fromUtf8(message));
+    switch (msg_type) {
+        case 4: { // json payload
+            Message decoded;
+            if (!Message::decode(payload, &decoded)) {
+                Stats::instance()->count("error.bad_message");
+                log(Error, "received bad message: " + QString::fromUtf8(message));
+            } else {
+                emit received_message(decoded, payload);
+            }
+            break;
+        }
+
+        case 3: // string payload
+            emit received_message(Message(), payload);
+            break;
+
+        case 0: // disconnect
+            Stats::instance()->count("error.server_disconnect");
+            log(Warning, "received disconnect message "
+                         + QString::fromUtf8(message));
+            received_close();
+            emit disconnected();
+            break;
+
+        case 2: // heartbeat
+            received_heartbeat();
+            break;
+
+        case 1: // connect
+        case 8: // noop
+            break;
+
+        default:
+            log(Info, "received " + QString::fromUtf8(message));
+            break;
+    }
+}
+
+void Transport::received_heartbeat() {
+    // The xhr-polling backend doesn't need to answer heartbeats,
+    // because every new poll request shows the server we're alive.
+}
+
+QString Transport::getCookie(const QString & name) const {
+    QByteArray comparableName = name.toUtf8();
+    Q_FOREACH(QNetworkCookie cookie,
+              m_cookies->cookiesForUrl(m_baseurl)) {
+        if (cookie.name() == comparableName)
+            return QString::fromUtf8(cookie.value());
+    }
+    return QString();
+}
+
+void Transport::setCookie(const QString & name, const QString & value) {
+    QList<QNetworkCookie> cookies;
+    cookies.append(QNetworkCookie(name.toUtf8(), value.toUtf8()));
+    m_cookies->setCookiesFromUrl(cookies, m_baseurl);
+    m_cookie_header_valid = false;
+}
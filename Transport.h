@@ -0,0 +1,120 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <QElapsedTimer>
+#include <QObject>
+#include <QNetworkReply>
+#include <QUrl>
+#include <QVariant>
+
+#include "Logger.h"
+#include "Message.h"
+
+class QAuthenticator;
+class QNetworkAccessManager;
+class QNetworkCookieJar;
+class QNetworkRequest;
+
+// Common base for the socket.io transports.
+
+// socket.io can carry its messages over several backends. Whichever one
+// is used, the session starts the same way: the client fetches the pad
+// url to get a session cookie, then asks socket.io/1/ for a session id.
+// After that the backends differ in how the packets travel, but the
+// packets themselves ("4:::{json}", "0::" and so on) are the same.
+
+// This class holds the parts that are shared: the urls, credentials,
+// cookies, the network access manager used for the plain HTTP requests,
+// and the decoding of received packets. The cookies are handled here
+// rather than by the manager, because the manager may be shared with
+// other clients (see NetworkPool). Subclasses implement the
+// actual packet transport and emit the same signals, so that Client
+// doesn't need to know which one it's talking to.
+
+class Transport : public QObject, protected Logger {
+    Q_OBJECT
+
+  public:
+    enum Kind { Xhr, WebSocket };
+    static QString kindName(Kind kind);
+    static Transport *create(Kind kind, QUrl padurl, QUrl baseurl,
+                             const QString & name, QObject *parent = 0);
+
+    Transport(QUrl padurl, QUrl baseurl,
+              const QString & name, QObject *parent = 0);
+    virtual ~Transport();
+
+    QString getCookie(const QString & name) const;
+    void setCookie(const QString & name, const QString & value);
+
+  signals:
+    void ready();
+    void disconnected();
+    // message and orig_text may point into the transport's receive
+    // buffer, so they are only valid during the call.
+    void received_message(const Message & message, QByteArray orig_text);
+
+  public slots:
+    virtual void start() = 0;
+    // Serializes msg and passes it to send_raw()
+    virtual void send(const QVariant & msg);
+    // Send a complete packet such as "4:::{json}"
+    virtual void send_raw(const QByteArray & packet) = 0;
+    virtual void disconnect() = 0;
+
+    // public so that NetworkPool can pass on requests from a shared manager
+    void authenticate(QNetworkReply *, QAuthenticator *);
+
+  protected slots:
+    void store_cookies();
+
+  protected:
+    // Get a network access manager for a (re)start. Without pooling this
+    // is a fresh one each time; with pooling the client keeps the one
+    // the pool gave it.
+    void reset_network();
+    // GET and POST with the cache-busting timestamp that socket.io.js adds
+    QNetworkReply *http_get(QUrl url);
+    QNetworkReply *http_post(QUrl url, const QByteArray & data);
+    QNetworkRequest make_request(QUrl url);
+    QUrl socketio_url(const QString & path) const;
+
+    // For transports that write their own HTTP requests:
+    // a "Cookie: ...\r\n" line (or nothing), and storing a Set-Cookie value
+    QByteArray cookie_header();
+    void store_cookie_header(const QByteArray & set_cookie);
+
+    // Split a payload that may hold several packets and decode them
+    void parse_payload(const QByteArray & payload);
+    void parse_message(const QByteArray & message);
+
+    // Timing of the steps of a join, recorded in Stats as join.STEP:
+    // join_started() when (re)starting, then join_step() as each step
+    // completes, with last set for the final one.
+    void join_started();
+    void join_step(const char *step, bool last = false);
+
+    // Hooks for packets that affect the transport itself
+    virtual void received_close() = 0;
+    virtual void received_heartbeat();
+
+    QUrl m_padurl;
+    QUrl m_baseurl;
+    // Normally one network access manager would be enough for the
+    // whole application, but the point here is to simulate multiple
+    // clients so they shouldn't share connections. NetworkPool can
+    // share managers while keeping each connection to one client.
+    QNetworkAccessManager *m_network;
+    bool m_pooled;  // m_network belongs to NetworkPool
+    QNetworkCookieJar *m_cookies;
+    QByteArray m_cookie_header;  // cached result of cookie_header()
+    bool m_cookie_header_valid;
+    QElapsedTimer m_join_clock;  // invalid when not joining
+    // socket.io session id received from server; used in url
+    QString m_id;
+
+    QString m_username;
+    QString m_password;
+};
+
+#endif
@@ -0,0 +1,81 @@
+#include "Worker.h"
+
+#include <QCoreApplication>
+#include <QtGlobal>
+
+#include <cstring>  // for strerror()
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>  // for sysconf()
+
+#include "Client.h"
+#include "LoadProfile.h"
+#include "OpenLoop.h"
+#include "Replay.h"
+
+bool Worker::c_pin = false;
+
+Worker::Worker(int number, const QString & profile, QObject *parent)
+  : QThread(parent), Logger("worker" + QString::number(number)),
+    m_number(number), m_profile(profile), m_loop(0) {
+}
+
+void Worker::pinCurrentThread(int number) {
+    if (!c_pin)
+        return;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(number % qMax(1L, cpus), &set);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err != 0)
+        qWarning("cannot pin thread to cpu %ld: %s",
+                 number % qMax(1L, cpus), strerror(err));
+}
+
+void Worker::createClients(const QList<ClientSpec> & specs,
+                           LoadProfile *load) {
+    Q_FOREACH(const ClientSpec & spec, specs) {
+        Client *cl = new Client(spec.padurl, spec.name, spec.transport);
+        cl->setBehaviour(spec.logic, spec.behaviour);
+        cl->setPadBucket(spec.bucket);
+        cl->setTraceId(spec.trace_id);
+        if (OpenLoop::enabled() && spec.behaviour->action == Behaviour::Draw)
+            OpenLoop::instance()->addClient(cl);
+        if (Replay::enabled() && spec.behaviour->action == Behaviour::Replay)
+            Replay::instance()->addClient(cl, spec.replay_number);
+        cl->connect(qApp, SIGNAL(aboutToQuit()), SLOT(end()));
+        load->addClient(cl);
+    }
+}
+
+void Worker::run() {
+    pinCurrentThread(m_number);
+    // qrand() keeps its state per thread
+    qsrand(uint(time(0)) ^ (uint(m_number + 1) * 2654435761u));
+
+    LoadProfile load;
+    if (!m_profile.isEmpty())
+        load.setProfile(m_profile);
+    createClients(m_specs, &load);
+    log(Verbose, QString::number(m_specs.length()) + " clients");
+
+    QEventLoop loop;
+    m_loop = &loop;
+    m_ready.release();
+    m_go.acquire();
+
+    load.start();
+    if (OpenLoop::enabled())
+        OpenLoop::instance()->start();
+    if (Replay::enabled())
+        Replay::instance()->start();
+    loop.exec();
+}
+
+void Worker::finish() {
+    // queued behind the end() calls posted when the application quit
+    QMetaObject::invokeMethod(m_loop, "quit", Qt::QueuedConnection);
+    wait();
+}
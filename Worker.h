@@ -0,0 +1,81 @@
+#ifndef WORKER_H
+#define WORKER_H
+
+#include <QEventLoop>
+#include <QList>
+#include <QSemaphore>
+#include <QString>
+#include <QThread>
+#include <QUrl>
+
+#include "Behaviour.h"
+#include "Logger.h"
+#include "Transport.h"
+
+class LoadProfile;
+
+// A thread running a share of the clients in an event loop of its own.
+
+// One event loop can only drive so many clients before a single core is
+// saturated. With worker threads, the clients are dealt out to the
+// workers in start order, and each worker creates its clients itself so
+// that they, their timers and their network stack (see NetworkPool,
+// EpollHttp and OpenLoop) belong to its thread. Every worker ramps up
+// its own clients with the same load profile, while the main thread
+// keeps the phases, the reports and the timer that ends the run.
+
+// Workers can be pinned to a CPU each, counting round-robin over the
+// online CPUs.
+
+class Worker : public QThread, private Logger {
+    Q_OBJECT
+
+  public:
+    struct ClientSpec {
+        QUrl padurl;
+        QString name;
+        QString logic;  // client type or scenario class
+        const Behaviour *behaviour;
+        QString bucket;  // see PadSet
+        quint32 trace_id;  // see Capture
+        int replay_number;  // place among the replay clients (see Replay)
+        Transport::Kind transport;
+    };
+
+    Worker(int number, const QString & profile, QObject *parent = 0);
+
+    static void setPinning(bool pin) { c_pin = pin; }
+    // Pin the calling thread to CPU number modulo the CPU count, if
+    // pinning is on
+    static void pinCurrentThread(int number);
+
+    // Create the clients in the calling thread and add them to load
+    static void createClients(const QList<ClientSpec> & specs,
+                              LoadProfile *load);
+
+    // Before start()
+    void addClient(const ClientSpec & spec) { m_specs << spec; }
+
+    // Wait until the worker has created its clients
+    void waitReady() { m_ready.acquire(); }
+    // Let the worker start its clients
+    void go() { m_go.release(); }
+    // Stop the event loop and wait for the thread to end. Clients are
+    // told to end when the application quits, so call this after that.
+    void finish();
+
+  protected:
+    void run();
+
+  private:
+    int m_number;
+    QString m_profile;
+    QList<ClientSpec> m_specs;
+    QEventLoop *m_loop;
+    QSemaphore m_ready;
+    QSemaphore m_go;
+
+    static bool c_pin;
+};
+
+#endif
@@ -0,0 +1,70 @@
+#include "WorkerProcesses.h"
+
+#include <QCoreApplication>
+
+#include <cerrno>
+#include <csignal>
+#include <cstdio>   // for fflush()
+#include <cstdlib>  // for exit()
+#include <cstring>  // for strerror()
+#include <sys/wait.h>
+#include <unistd.h>
+
+// How often the parent checks for exited workers
+#define REAP_MSECS 100
+
+QList<pid_t> WorkerProcesses::c_pids;
+
+int WorkerProcesses::fork(int count) {
+    // don't let buffered output be written once per process
+    fflush(stdout);
+    fflush(stderr);
+    for (int worker = 0; worker < count; worker++) {
+        pid_t pid = ::fork();
+        if (pid == 0) {
+            c_pids.clear();
+            return worker;
+        }
+        if (pid < 0) {
+            qCritical("cannot fork worker %d: %s", worker, strerror(errno));
+            stopAll();
+            exit(1);
+        }
+        c_pids << pid;
+    }
+    return -1;
+}
+
+WorkerProcesses::WorkerProcesses(int deadline_secs, QObject *parent)
+  : QObject(parent), Logger("procs") {
+    connect(&m_reap_timer, SIGNAL(timeout()), SLOT(reap()));
+    m_reap_timer.start(REAP_MSECS);
+    QTimer::singleShot(deadline_secs * 1000, this, SLOT(stopWorkers()));
+}
+
+void WorkerProcesses::reap() {
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        c_pids.removeAll(pid);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            log(Warning, "worker " + QString::number(pid)
+                         + " ended abnormally");
+    }
+    if (c_pids.isEmpty()) {
+        m_reap_timer.stop();
+        qApp->quit();
+    }
+}
+
+void WorkerProcesses::stopAll() {
+    Q_FOREACH(pid_t pid, c_pids)
+        kill(pid, SIGTERM);
+}
+
+void WorkerProcesses::stopWorkers() {
+    if (!c_pids.isEmpty())
+        log(Warning, "stopping " + QString::number(c_pids.length())
+                     + " workers still running");
+    stopAll();
+}
@@ -0,0 +1,48 @@
+#ifndef WORKERPROCESSES_H
+#define WORKERPROCESSES_H
+
+#include <QList>
+#include <QObject>
+#include <QTimer>
+
+#include <sys/types.h>
+
+#include "Logger.h"
+
+// Runs slices of the clients in forked worker processes.
+
+// Threads (see Worker) share one process, with its file descriptor table
+// and whatever global state Qt and the load generator keep. Worker
+// processes are forked before the QCoreApplication exists, so each one is
+// a complete load generator of its own, running its share of the clients.
+// They hand their stats to the parent through shared memory (see
+// SharedStats), and the parent reports for all of them.
+
+// The parent runs no clients. It quits when all workers have exited, and
+// stops any worker still running well after the end of the run.
+
+class WorkerProcesses : public QObject, private Logger {
+    Q_OBJECT
+
+  public:
+    // Fork count workers. Returns the worker number in a worker, and -1
+    // in the parent.
+    static int fork(int count);
+    // Send every worker still running SIGTERM
+    static void stopAll();
+
+    // In the parent: watch the workers, giving them until deadline_secs
+    // from now to exit
+    WorkerProcesses(int deadline_secs, QObject *parent = 0);
+
+  private slots:
+    void reap();
+    void stopWorkers();
+
+  private:
+    QTimer m_reap_timer;
+
+    static QList<pid_t> c_pids;
+};
+
+#endif
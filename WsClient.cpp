@@ -0,0 +1,401 @@
+#include "WsClient.h"
+
+#include <QCryptographicHash>
+#include <QSslSocket>
+#include <QStringList>
+#include <QTcpSocket>
+#include <QTimer>
+
+#include <QtGlobal>
+
+#include "Stats.h"
+
+#define START_RETRY_SECS 1
+
+// Fixed GUID from RFC 6455, used to compute Sec-WebSocket-Accept
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+
+WsClient::WsClient(QUrl padurl, QUrl baseurl, const QString & name,
+                   QObject *parent)
+  : Transport(padurl, baseurl, name, parent) {
+
+    m_state = WsInit;
+
+    m_receive = 0;
+    m_socket = 0;
+}
+
+WsClient::~WsClient() {
+    log(Trace, "transport disconnecting");
+    delete m_receive;
+    if (m_socket)
+        m_socket->abort();
+}
+
+void WsClient::get(QUrl url) {
+    if (m_receive)
+        log(Error, QString("ws getting url while waiting for reply: ")
+                   + url.toString());
+    m_receive = http_get(url);
+    connect(m_receive, SIGNAL(finished()), SLOT(get_reply()));
+    connect(m_receive, SIGNAL(error(QNetworkReply::NetworkError)),
+                       SLOT(error(QNetworkReply::NetworkError)));
+}
+
+void WsClient::start() {
+    // Clean up, in case this is a restart
+    if (m_receive) {
+        m_receive->deleteLater();
+        m_receive = 0;
+    }
+    close_socket();
+    reset_network();
+
+    log(Trace, "transport opening session");
+    join_started();
+    // first contact padurl to get the session cookie
+    m_state = WsOpenSession;
+    get(m_padurl);
+}
+
+void WsClient::retry_start() {
+    QTimer::singleShot(START_RETRY_SECS * 1000, this, SLOT(start()));
+    m_state = WsInit;
+}
+
+void WsClient::close_socket() {
+    if (m_socket) {
+        m_socket->abort();
+        m_socket->deleteLater();
+        m_socket = 0;
+    }
+    m_buffer.clear();
+    m_fragments.clear();
+}
+
+void WsClient::request_id() {
+    m_state = WsGetId;
+    get(socketio_url(""));
+}
+
+void WsClient::get_reply() {
+    if (!m_receive)
+        return;
+    QString reply = QString::fromUtf8(m_receive->readAll());
+    m_receive->deleteLater();
+    m_receive = 0;
+
+    switch (m_state) {
+        case WsOpenSession:
+            join_step("session");
+            request_id();
+            break;
+
+        case WsGetId:
+            // reply is sessionid:heartbeat:closetimeout:transports
+            m_id = reply.section(':', 0, 0);
+            if (m_id == "") {
+                Stats::instance()->count("error.handshake");
+                log(Error, QString("ws init error: ") + reply);
+                retry_start();
+            } else if (!reply.section(':', 3, 3).split(',')
+                              .contains("websocket")) {
+                Stats::instance()->count("error.handshake");
+                log(Error, QString("server does not offer websocket: ")
+                           + reply);
+                m_id = "";
+                retry_start();
+            } else {
+                log(Info, QString("ws init ") + reply);
+                join_step("handshake");
+                upgrade();
+            }
+            break;
+
+        default:
+            Stats::instance()->count("error.unexpected_reply");
+            log(Error, "unexpected message: " + reply);
+            m_state = WsDisconnected;
+            emit disconnected();
+            break;
+    }
+}
+
+void WsClient::error(QNetworkReply::NetworkError) {
+    if (!m_receive)
+        return;
+    Stats::instance()->count("error.http_get");
+    log(Error, "HTTP GET error: " + m_receive->errorString());
+    m_receive->deleteLater();
+    m_receive = 0;
+    m_id = "";
+    retry_start();
+}
+
+void WsClient::upgrade() {
+    close_socket();
+    m_state = WsUpgrading;
+
+    bool secure = m_baseurl.scheme() == "https";
+    int port = m_baseurl.port(secure ? 443 : 80);
+    if (secure) {
+        QSslSocket *socket = new QSslSocket(this);
+        socket->ignoreSslErrors();
+        m_socket = socket;
+    } else {
+        m_socket = new QTcpSocket(this);
+    }
+    connect(m_socket, SIGNAL(error(QAbstractSocket::SocketError)),
+                      SLOT(socket_error(QAbstractSocket::SocketError)));
+    connect(m_socket, SIGNAL(readyRead()), SLOT(socket_read()));
+
+    log(Trace, "websocket connecting to " + m_baseurl.host()
+               + ":" + QString::number(port));
+    if (secure) {
+        connect(m_socket, SIGNAL(encrypted()), SLOT(socket_connected()));
+        static_cast<QSslSocket *>(m_socket)
+            ->connectToHostEncrypted(m_baseurl.host(), port);
+    } else {
+        connect(m_socket, SIGNAL(connected()), SLOT(socket_connected()));
+        m_socket->connectToHost(m_baseurl.host(), port);
+    }
+}
+
+void WsClient::socket_connected() {
+    QUrl url = socketio_url("websocket/" + m_id);
+
+    QByteArray nonce(16, 0);
+    for (int i = 0; i < nonce.size(); i++)
+        nonce[i] = qrand() & 0xff;
+    m_key = nonce.toBase64();
+
+    QByteArray host = m_baseurl.host().toUtf8();
+    if (m_baseurl.port() != -1)
+        host += ":" + QByteArray::number(m_baseurl.port());
+
+    QByteArray request;
+    request += "GET " + url.encodedPath() + " HTTP/1.1\r\n";
+    request += "Host: " + host + "\r\n";
+    request += "Upgrade: websocket\r\n";
+    request += "Connection: Upgrade\r\n";
+    request += "Sec-WebSocket-Key: " + m_key + "\r\n";
+    request += "Sec-WebSocket-Version: 13\r\n";
+    request += "Origin: " + m_baseurl.scheme().toUtf8() + "://" + host + "\r\n";
+
+    request += cookie_header();
+
+    if (!m_username.isEmpty()) {
+        QByteArray credentials = (m_username + ":" + m_password).toUtf8();
+        request += "Authorization: Basic " + credentials.toBase64() + "\r\n";
+    }
+    request += "\r\n";
+
+    log(Trace, "websocket upgrade " + url.toString());
+    m_socket->write(request);
+}
+
+void WsClient::socket_error(QAbstractSocket::SocketError) {
+    if (!m_socket)
+        return;
+    Stats::instance()->count("error.websocket");
+    log(Error, "websocket error: " + m_socket->errorString());
+    State old_state = m_state;
+    close_socket();
+    if (old_state == WsUpgrading) {
+        m_id = "";
+        retry_start();
+    } else if (old_state == WsOpen) {
+        m_state = WsDisconnected;
+        emit disconnected();
+    }
+}
+
+void WsClient::socket_read() {
+    if (!m_socket)
+        return;
+    m_buffer.append(m_socket->readAll());
+
+    if (m_state == WsUpgrading && !read_upgrade_reply())
+        return;
+
+    // Processing a frame can close the socket, so check every time
+    while (m_socket && m_state == WsOpen && read_frame())
+        ;
+}
+
+// Returns true if the upgrade completed and frames may follow
+bool WsClient::read_upgrade_reply() {
+    int end = m_buffer.indexOf("\r\n\r\n");
+    if (end < 0)
+        return false;  // wait for the rest of the headers
+
+    QList<QByteArray> lines = m_buffer.left(end).split('\n');
+    m_buffer.remove(0, end + 4);
+
+    QByteArray expected = QCryptographicHash::hash(m_key + WS_GUID,
+                              QCryptographicHash::Sha1).toBase64();
+    QByteArray accept;
+    for (int i = 1; i < lines.size(); i++) {
+        QByteArray line = lines[i].trimmed();
+        int colon = line.indexOf(':');
+        if (colon > 0 && line.left(colon).trimmed().toLower()
+                             == "sec-websocket-accept")
+            accept = line.mid(colon + 1).trimmed();
+    }
+
+    QByteArray status = lines[0].trimmed();
+    QList<QByteArray> status_parts = status.split(' ');
+    if (status_parts.size() < 2 || status_parts[1] != "101"
+        || accept != expected) {
+        Stats::instance()->count("error.upgrade");
+        log(Error, "websocket upgrade failed: " + QString::fromUtf8(status));
+        close_socket();
+        m_id = "";
+        retry_start();
+        return false;
+    }
+
+    log(Trace, "websocket open");
+    join_step("upgrade", true);
+    m_state = WsOpen;
+    emit ready();
+    return m_state == WsOpen;
+}
+
+// Returns true if a whole frame was processed
+bool WsClient::read_frame() {
+    if (m_buffer.size() < 2)
+        return false;
+    const uchar *data = reinterpret_cast<const uchar *>(m_buffer.constData());
+
+    bool fin = data[0] & 0x80;
+    int opcode = data[0] & 0x0f;
+    bool masked = data[1] & 0x80;
+    quint64 length = data[1] & 0x7f;
+    int header = 2;
+    if (length == 126) {
+        if (m_buffer.size() < 4)
+            return false;
+        length = (data[2] << 8) | data[3];
+        header = 4;
+    } else if (length == 127) {
+        if (m_buffer.size() < 10)
+            return false;
+        length = 0;
+        for (int i = 2; i < 10; i++)
+            length = (length << 8) | data[i];
+        header = 10;
+    }
+    int mask_at = header;
+    if (masked)
+        header += 4;
+    if ((quint64) m_buffer.size() < header + length)
+        return false;
+
+    QByteArray payload = m_buffer.mid(header, length);
+    if (masked) {
+        // servers aren't supposed to mask, but unmasking is cheap
+        for (int i = 0; i < payload.size(); i++)
+            payload[i] = payload[i] ^ data[mask_at + (i % 4)];
+    }
+    m_buffer.remove(0, header + length);
+
+    switch (opcode) {
+        case WsText:
+        case WsBinary:
+        case WsContinuation:
+            m_fragments.append(payload);
+            if (fin) {
+                QByteArray message = m_fragments;
+                m_fragments.clear();
+                parse_payload(message);
+            }
+            break;
+
+        case WsPing:
+            send_frame(WsPong, payload);
+            break;
+
+        case WsPong:
+            break;
+
+        case WsClose:
+            Stats::instance()->count("error.server_disconnect");
+            log(Warning, "websocket closed by server");
+            send_frame(WsClose, payload.left(2));
+            close_socket();
+            m_state = WsDisconnected;
+            emit disconnected();
+            break;
+
+        default:
+            Stats::instance()->count("error.websocket");
+            log(Error, "websocket frame with unknown opcode "
+                       + QString::number(opcode));
+            break;
+    }
+    return true;
+}
+
+void WsClient::send_frame(Opcode opcode, const QByteArray & payload) {
+    QByteArray frame;
+    frame.reserve(payload.size() + 14);
+    frame.append(char(0x80 | opcode));  // FIN and opcode
+
+    // clients must always mask, with the mask bit in the length byte
+    int length = payload.size();
+    if (length < 126) {
+        frame.append(char(0x80 | length));
+    } else if (length < 65536) {
+        frame.append(char(0x80 | 126));
+        frame.append(char(length >> 8));
+        frame.append(char(length));
+    } else {
+        frame.append(char(0x80 | 127));
+        for (int shift = 56; shift >= 0; shift -= 8)
+            frame.append(char((quint64) length >> shift));
+    }
+
+    char mask[4];
+    for (int i = 0; i < 4; i++) {
+        mask[i] = qrand() & 0xff;
+        frame.append(mask[i]);
+    }
+    int start = frame.size();
+    frame.append(payload);
+    for (int i = 0; i < length; i++)
+        frame[start + i] = frame[start + i] ^ mask[i % 4];
+
+    m_socket->write(frame);
+}
+
+void WsClient::send_packet(const QByteArray & msg_string) {
+    if (m_state != WsOpen || !m_socket) {
+        Stats::instance()->count("error.send_dropped");
+        log(Error, "websocket not open, dropping " + QString::fromUtf8(msg_string));
+        return;
+    }
+    log(Trace, "SEND " + QString::fromUtf8(msg_string));
+    send_frame(WsText, msg_string);
+}
+
+void WsClient::send_raw(const QByteArray & packet) {
+    send_packet(packet);
+}
+
+void WsClient::disconnect() {
+    QByteArray msg_string = "0::";
+    send_packet(msg_string);
+}
+
+void WsClient::received_close() {
+    close_socket();
+    m_state = WsDisconnected;
+}
+
+void WsClient::received_heartbeat() {
+    // Over a websocket the server only knows we're alive if we answer
+    QByteArray msg_string = "2::";
+    send_packet(msg_string);
+}
@@ -0,0 +1,76 @@
+#ifndef WSCLIENT_H
+#define WSCLIENT_H
+
+#include <QAbstractSocket>
+#include <QByteArray>
+#include <QObject>
+#include <QNetworkReply>
+#include <QUrl>
+
+#include "Transport.h"
+
+class QTcpSocket;
+
+// Simulate the websocket backend of socket.io.js
+
+// The session is opened the same way as for xhr-polling: a GET of the
+// pad url for the session cookie, then a GET of socket.io/1/ for the
+// session id. After that, instead of polling, the client upgrades a
+// single TCP connection to a websocket (RFC 6455) and both sides send
+// their socket.io packets as text frames over it. There is no per-message
+// HTTP overhead, which is how most browsers talk to the server.
+
+// Qt 4 doesn't have a websocket class, so the handshake and framing
+// are done here directly on a QTcpSocket.
+
+class WsClient : public Transport {
+    Q_OBJECT
+
+  public:
+    WsClient(QUrl padurl, QUrl baseurl,
+             const QString & name, QObject *parent = 0);
+    virtual ~WsClient();
+
+  public slots:
+    virtual void start();
+    virtual void send_raw(const QByteArray & packet);
+    virtual void disconnect();
+
+  protected slots:
+    void error(QNetworkReply::NetworkError code);
+    void get_reply();
+    void socket_connected();
+    void socket_error(QAbstractSocket::SocketError code);
+    void socket_read();
+
+  protected:
+    virtual void received_close();
+    virtual void received_heartbeat();
+
+  private:
+    enum Opcode { WsContinuation = 0x0, WsText = 0x1, WsBinary = 0x2,
+                  WsClose = 0x8, WsPing = 0x9, WsPong = 0xa };
+
+    // the reply object for the session and handshake requests
+    QNetworkReply *m_receive;
+    QTcpSocket *m_socket;
+    QByteArray m_key;     // Sec-WebSocket-Key sent in the upgrade
+    QByteArray m_buffer;  // received bytes not yet processed
+    QByteArray m_fragments;  // payload of an unfinished fragmented message
+
+    enum State { WsInit, WsOpenSession, WsGetId,
+        WsUpgrading, WsOpen, WsDisconnected };
+    State m_state;
+
+    void get(QUrl url);
+    void request_id();
+    void upgrade();
+    void retry_start();
+    void close_socket();
+    bool read_upgrade_reply();
+    bool read_frame();
+    void send_frame(Opcode opcode, const QByteArray & payload);
+    void send_packet(const QByteArray & msg_string);
+};
+
+#endif
@@ -1,223 +1,237 @@
 #include "XhrClient.h"
 
-#include <QAuthenticator>
-#include <QChar>
-#include <QDateTime>
-#include <QList>
-#include <QNetworkAccessManager>
-#include <QNetworkCookie>
+#include <QByteArray>
 #include <QTimer>
 
-#include <qjson/serializer.h>
-#include <qjson/parser.h>
+#include "FrameDecoder.h"
+#include "Stats.h"
 
 #define START_RETRY_SECS 1
 
-#define MULTIMSG QChar(0xfffd)
+// U+FFFD in UTF-8, the separator for multi-message payloads
+#define MULTIMSG_UTF8 "\xef\xbf\xbd"
+
+int XhrClient::c_coalesce_msecs = 0;
 
 
 XhrClient::XhrClient(QUrl padurl, QUrl baseurl, const QString & name,
                      QObject *parent)
-  : QObject(parent), Logger(name), m_padurl(padurl), m_baseurl(baseurl)  {
+  : Transport(padurl, baseurl, name, parent) {
 
     m_state = XhrInit;
 
-    m_network = 0;
     m_receive = 0;
-
-    if (m_baseurl.userName() != "") {
-        m_username = m_baseurl.userName();
-        m_baseurl.setUserName("");
-    }
-    if (m_baseurl.password() != "") {
-        m_password = m_baseurl.password();
-        m_baseurl.setPassword("");
+    m_poll_conn = 0;
+    m_send_conn = 0;
+
+    m_flush.setSingleShot(true);
+    connect(&m_flush, SIGNAL(timeout()), SLOT(flush_queue()));
+
+    if (EpollHttp::enabled()) {
+        if (m_baseurl.scheme() == "http") {
+            m_poll_conn = new EpollHttp::Connection(this, PollChannel);
+            m_send_conn = new EpollHttp::Connection(this, SendChannel);
+        } else {
+            log(Warning, "epoll engine only does http, using Qt for "
+                         + m_baseurl.scheme());
+        }
     }
-    m_padurl.setUserName("");
-    m_padurl.setPassword("");
 }
 
 XhrClient::~XhrClient() {
     log(Trace, "transport disconnecting");
     delete m_receive;
-    delete m_network;
-}
-
-void XhrClient::authenticate(QNetworkReply *, QAuthenticator *auth) {
-    log(Trace, QString("authenticating ") + auth->realm());
-    auth->setUser(m_username);
-    auth->setPassword(m_password);
+    delete m_poll_conn;
+    delete m_send_conn;
 }
 
 void XhrClient::get(QUrl url) {
-    if (m_receive)
+    if (m_receive || (m_poll_conn && m_poll_conn->pending()))
         log(Error, QString("xhr getting url while waiting for reply: ")
                    + url.toString());
-    url.addQueryItem("t", QString::number(QDateTime::currentMSecsSinceEpoch()));
-    log(Trace, "GET " + url.toString());
-    m_receive = m_network->get(QNetworkRequest(url));
-    m_receive->ignoreSslErrors();
+    if (m_poll_conn) {
+        m_poll_conn->request("GET",
+            url.toEncoded(QUrl::RemoveScheme | QUrl::RemoveAuthority),
+            cookie_header());
+        return;
+    }
+    m_receive = http_get(url);
     connect(m_receive, SIGNAL(finished()), SLOT(get_reply()));
     connect(m_receive, SIGNAL(error(QNetworkReply::NetworkError)),
                        SLOT(error(QNetworkReply::NetworkError)));
 }
 
+// The long poll is the most frequent request, so with the epoll engine
+// it skips building a url.
+void XhrClient::poll() {
+    if (m_poll_conn)
+        m_poll_conn->request("GET", m_poll_path, cookie_header());
+    else
+        get(socketio_url("xhr-polling/" + m_id));
+}
+
 void XhrClient::send_packet(const QByteArray & msg_string) {
-    QUrl url(m_baseurl);
-    url.setPath(m_baseurl.path() + "socket.io/1/xhr-polling/" + m_id);
-    url.addQueryItem("t", QString::number(QDateTime::currentMSecsSinceEpoch()));
     log(Trace, "POST " + QString::fromUtf8(msg_string));
-    QNetworkReply *reply = m_network->post(QNetworkRequest(url), msg_string);
+    Stats::instance()->count("xhr.posts");
+    if (m_send_conn) {
+        m_send_conn->request("POST", m_poll_path, cookie_header(), msg_string);
+        return;
+    }
+    QNetworkReply *reply = http_post(socketio_url("xhr-polling/" + m_id),
+                                     msg_string);
     connect(reply, SIGNAL(error(QNetworkReply::NetworkError)),
                    SLOT(send_error(QNetworkReply::NetworkError)));
     // autodestruct reply object
     connect(reply, SIGNAL(finished()), reply, SLOT(deleteLater()));
 }
 
-void XhrClient::send(const QVariant & msg) {
-    QByteArray msg_string = QJson::Serializer().serialize(msg);
-    msg_string.prepend("4:::");
-    send_packet(msg_string);
+void XhrClient::send_raw(const QByteArray & packet) {
+    Stats::instance()->count("xhr.messages");
+    if (c_coalesce_msecs <= 0) {
+        send_packet(packet);
+        return;
+    }
+    m_queue << packet;
+    if (!m_flush.isActive())
+        m_flush.start(c_coalesce_msecs);
+}
+
+void XhrClient::flush_queue() {
+    m_flush.stop();
+    if (m_queue.length() == 1) {
+        send_packet(m_queue[0]);
+    } else if (m_queue.length() > 1) {
+        QByteArray payload;
+        Q_FOREACH(const QByteArray & msg_string, m_queue) {
+            payload += MULTIMSG_UTF8;
+            // the framing counts lengths the way javascript strings do
+            payload += QByteArray::number(
+                FrameDecoder::utf16Length(msg_string));
+            payload += MULTIMSG_UTF8;
+            payload += msg_string;
+        }
+        Stats::instance()->count("xhr.posts_saved", m_queue.length() - 1);
+        send_packet(payload);
+    }
+    m_queue.clear();
 }
 
 void XhrClient::disconnect() {
+    // don't let the disconnect overtake messages sent before it
+    flush_queue();
     QByteArray msg_string = "0::";
+    Stats::instance()->count("xhr.messages");
     send_packet(msg_string);
 }
 
 void XhrClient::start() {
-    QNetworkCookieJar *jar = 0;
-
     // Clean up, in case this is a restart
+    if (!m_queue.isEmpty()) {
+        log(Warning, "dropping " + QString::number(m_queue.length())
+                     + " unsent messages");
+        m_queue.clear();
+        m_flush.stop();
+    }
     if (m_receive) {
         m_receive->deleteLater();
         m_receive = 0;
     }
-    if (m_network) {
-        log(Trace, "cleaning up old transport");
-        // Reuse the cookie jar. It will be reparented to the new m_network.
-        jar = m_network->cookieJar();
-        m_network->deleteLater();
+    if (m_poll_conn) {
+        // Start over on fresh connections, like a new network manager would
+        QUrl target(m_baseurl);
+        target.setUserName(m_username);
+        target.setPassword(m_password);
+        m_poll_conn->abort();
+        m_send_conn->abort();
+        if (!m_poll_conn->setTarget(target) || !m_send_conn->setTarget(target)) {
+            QTimer::singleShot(START_RETRY_SECS * 1000, this, SLOT(start()));
+            m_state = XhrInit;
+            return;
+        }
+    } else {
+        reset_network();
     }
 
-    m_network = new QNetworkAccessManager(this);
-    connect(m_network,
-      SIGNAL(authenticationRequired(QNetworkReply *, QAuthenticator *)),
-      SLOT(authenticate(QNetworkReply *, QAuthenticator *)));
-    if (jar)
-        m_network->setCookieJar(jar);
-
     log(Trace, "transport opening session");
+    join_started();
     // first contact padurl to get the session cookie
     m_state = XhrOpenSession;
     get(m_padurl);
 }
 
 void XhrClient::request_id() {
-    QUrl url = m_baseurl;
-    url.setPath(m_baseurl.path() + "socket.io/1/");
     m_state = XhrGetId;
-    get(url);
-}
-
-void XhrClient::parse_message(const QString & message) {
-    int msg_type = message.section(':', 0, 0).toInt();
-    QString payload = message.section(':', 3);
-    switch (msg_type) {
-        case 4: { // json payload
-            log(Trace, "received " + message);
-            bool ok;
-            QVariant decoded = QJson::Parser().parse(payload.toUtf8(), &ok);
-            if (!ok) {
-                log(Error, "received bad message: " + message);
-            } else {
-                emit received_message(decoded, payload);
-            }
-            break;
-        }
-
-        case 3: // string payload
-            log(Trace, "received " + message);
-            emit received_message(payload, payload);
-            break;
-
-        case 0: // disconnect
-            log(Warning, "received disconnect message " + message);
-            m_state = XhrDisconnected;
-            emit disconnected();
-            break;
-
-        case 1: // connect
-        case 8: // noop
-            log(Trace, "received " + message);
-            break;
+    get(socketio_url(""));
+}
 
-        default:
-            log(Info, "received " + message);
-            break;
-    }
+void XhrClient::received_close() {
+    m_state = XhrDisconnected;
 }
 
 void XhrClient::get_reply() {
     if (!m_receive)
         return;
-    QString reply = QString::fromUtf8(m_receive->readAll());
+    QByteArray data = m_receive->readAll();
     m_receive->deleteLater();
     m_receive = 0;
+    handle_reply(data);
+}
 
+void XhrClient::handle_reply(const QByteArray & data) {
     switch (m_state) {
         case XhrOpenSession:
+            join_step("session");
             request_id();
             break;
 
-        case XhrGetId:
+        case XhrGetId: {
+            QString reply = QString::fromUtf8(data);
             m_id = reply.section(':', 0, 0);
             if (m_id == "") {
+                Stats::instance()->count("error.handshake");
                 log(Error, QString("xhr init error: ") + reply);
                 QTimer::singleShot(START_RETRY_SECS * 1000,
                                    this, SLOT(start()));
                 m_state = XhrInit;
             } else {
                 log(Info, QString("xhr init ") + reply);
+                m_poll_path = socketio_url("xhr-polling/" + m_id).encodedPath();
+                join_step("handshake");
                 m_state = XhrReceiving;
                 emit ready();
             }
             break;
+        }
 
         case XhrReceiving:
-            if (reply[0] == MULTIMSG) {
-                int i = 1;
-                while (i < reply.length()) {
-                    int nextsep = reply.indexOf(MULTIMSG, i);
-                    int length = reply.mid(i, nextsep - i).toInt();
-                    parse_message(reply.mid(nextsep + 1, length));
-                    i = nextsep + 1 + length + 1;
-                }
-            } else {
-                parse_message(reply);
-            }
+            join_step("first_poll", true);
+            parse_payload(data);
             break;
 
         default:
-            log(Error, "unexpected message: " + reply);
+            Stats::instance()->count("error.unexpected_reply");
+            log(Error, "unexpected message: " + QString::fromUtf8(data));
             m_state = XhrDisconnected;
             emit disconnected();
             break;
     }
 
-    if (m_state == XhrReceiving && m_id != "") {
-        QUrl url(m_baseurl);
-        url.setPath(m_baseurl.path() + "socket.io/1/xhr-polling/" + m_id);
-        get(url);
-    }
+    if (m_state == XhrReceiving && m_id != "")
+        poll();
 }
 
 void XhrClient::error(QNetworkReply::NetworkError) {
     if (!m_receive)
         return;
-    log(Error, "HTTP GET error: " + m_receive->errorString());
+    QString error = m_receive->errorString();
     m_receive->deleteLater();
     m_receive = 0;
+    handle_get_error(error);
+}
+
+void XhrClient::handle_get_error(const QString & error) {
+    Stats::instance()->count("error.http_get");
+    log(Error, "HTTP GET error: " + error);
     if (m_id == "") {
         QTimer::singleShot(START_RETRY_SECS * 1000, this, SLOT(start()));
         m_state = XhrInit;
@@ -228,6 +242,7 @@ void XhrClient::error(QNetworkReply::NetworkError) {
 }
 
 void XhrClient::send_error(QNetworkReply::NetworkError code) {
+    Stats::instance()->count("error.http_post");
     QNetworkReply *reply = qobject_cast<QNetworkReply *>(sender());
     if (reply)
         log(Error, "HTTP POST error: " + reply->errorString());
@@ -237,18 +252,22 @@ void XhrClient::send_error(QNetworkReply::NetworkError code) {
     // TODO: notify Client? should it affect the state machine?
 }
 
-QString XhrClient::getCookie(const QString & name) const {
-    QByteArray comparableName = name.toUtf8();
-    Q_FOREACH(QNetworkCookie cookie, 
-              m_network->cookieJar()->cookiesForUrl(m_baseurl)) {
-        if (cookie.name() == comparableName)
-            return QString::fromUtf8(cookie.value());
+
+void XhrClient::http_reply(int channel, int, const QByteArray & body) {
+    // POST replies carry nothing of interest
+    if (channel == PollChannel)
+        handle_reply(body);
+}
+
+void XhrClient::http_error(int channel, const QString & error) {
+    if (channel == PollChannel) {
+        handle_get_error(error);
+    } else {
+        Stats::instance()->count("error.http_post");
+        log(Error, "HTTP POST error: " + error);
     }
-    return QString();
 }
 
-void XhrClient::setCookie(const QString & name, const QString & value) {
-    QList<QNetworkCookie> cookies;
-    cookies.append(QNetworkCookie(name.toUtf8(), value.toUtf8()));
-    m_network->cookieJar()->setCookiesFromUrl(cookies, m_baseurl);
+void XhrClient::http_set_cookie(const QByteArray & header) {
+    store_cookie_header(header);
 }
@@ -1,13 +1,14 @@
 #ifndef XHRCLIENT_H
 #define XHRCLIENT_H
 
+#include <QList>
 #include <QObject>
 #include <QNetworkReply>
+#include <QTimer>
 #include <QUrl>
 
-#include "Logger.h"
-
-class QNetworkAccessManager;
+#include "EpollHttp.h"
+#include "Transport.h"
 
 // Simulate the xhr-polling backend of socket.io.js
 
@@ -28,7 +29,16 @@ class QNetworkAccessManager;
 // The task of this class is to encapsulate all that, and allow the
 // caller to send and receive JSON messages asynchronously.
 
-class XhrClient : public QObject, private Logger {
+// Optionally, messages sent within a short window are collected and sent
+// as one POST, using the same multi-message framing that the server uses
+// for its replies: each message prefixed by U+FFFD, its length in UTF-16
+// code units, and U+FFFD again.
+
+// The HTTP requests go through QNetworkAccessManager, or through the
+// lighter EpollHttp engine if that is enabled. With the engine, the
+// GET and POST requests each have a persistent connection of their own.
+
+class XhrClient : public Transport, private EpollHttp::Listener {
     Q_OBJECT
 
   public:
@@ -36,49 +46,52 @@ class XhrClient : public QObject, private Logger {
               const QString & name, QObject *parent = 0);
     virtual ~XhrClient();
 
-    QString getCookie(const QString & name) const;
-    void setCookie(const QString & name, const QString & value);
-
-
-  signals:
-    void ready();
-    void disconnected();
-    void received_message(QVariant message, QString orig_text);
+    // How long to hold outgoing messages for batching; 0 sends at once
+    static void setCoalesceWindow(int msecs) { c_coalesce_msecs = msecs; }
 
   public slots:
-    void start();
-    void send(const QVariant & msg);
-    void disconnect();
+    virtual void start();
+    virtual void send_raw(const QByteArray & packet);
+    virtual void disconnect();
 
   protected slots:
     void error(QNetworkReply::NetworkError code);
     void send_error(QNetworkReply::NetworkError code);
     void get_reply();
-    void authenticate(QNetworkReply *, QAuthenticator *);
     void send_packet(const QByteArray & msg_string);
+    void flush_queue();
+
+  protected:
+    virtual void received_close();
 
   private:
-    QUrl m_padurl;
-    QUrl m_baseurl;
-    // Normally one network access manager would be enough for the
-    // whole application, but the point here is to simulate multiple
-    // clients so they shouldn't share connections.
-    QNetworkAccessManager *m_network;
-    // socket.io session id received from server; used in url
-    QString m_id;
+    // EpollHttp::Listener
+    virtual void http_reply(int channel, int status, const QByteArray & body);
+    virtual void http_error(int channel, const QString & error);
+    virtual void http_set_cookie(const QByteArray & header);
+
     // the object representing the long-running http connection
     QNetworkReply *m_receive;
 
-    QString m_username;
-    QString m_password;
+    // connections used instead of m_network when EpollHttp is enabled
+    enum Channel { PollChannel, SendChannel };
+    EpollHttp::Connection *m_poll_conn;
+    EpollHttp::Connection *m_send_conn;
+    QByteArray m_poll_path;  // encoded path of the xhr-polling url
+
+    QList<QByteArray> m_queue;  // packets waiting to be coalesced
+    QTimer m_flush;
+    static int c_coalesce_msecs;
 
     enum State { XhrInit,
         XhrOpenSession, XhrGetId, XhrReceiving, XhrDisconnected };
     State m_state;
 
     void get(QUrl url);
+    void poll();
     void request_id();
-    void parse_message(const QString & message);
+    void handle_reply(const QByteArray & data);
+    void handle_get_error(const QString & error);
 };
 
 #endif
@@ -27,3 +27,75 @@ HEADERS += Changeset.h
 
 SOURCES += XhrClient.cpp
 HEADERS += XhrClient.h
+
+SOURCES += Transport.cpp
+HEADERS += Transport.h
+
+SOURCES += WsClient.cpp
+HEADERS += WsClient.h
+
+SOURCES += NetworkPool.cpp
+HEADERS += NetworkPool.h
+
+SOURCES += EpollHttp.cpp
+HEADERS += EpollHttp.h
+
+SOURCES += Stats.cpp
+HEADERS += Stats.h
+
+SOURCES += FrameDecoder.cpp
+HEADERS += FrameDecoder.h
+
+SOURCES += Message.cpp
+HEADERS += Message.h
+
+SOURCES += MessageWriter.cpp
+HEADERS += MessageWriter.h
+
+SOURCES += Histogram.cpp
+HEADERS += Histogram.h
+
+SOURCES += MetricsServer.cpp
+HEADERS += MetricsServer.h
+
+SOURCES += OpenLoop.cpp
+HEADERS += OpenLoop.h
+
+SOURCES += LoadProfile.cpp
+HEADERS += LoadProfile.h
+
+SOURCES += Worker.cpp
+HEADERS += Worker.h
+
+SOURCES += SharedStats.cpp
+HEADERS += SharedStats.h
+
+SOURCES += WorkerProcesses.cpp
+HEADERS += WorkerProcesses.h
+
+SOURCES += Coordinator.cpp
+HEADERS += Coordinator.h
+
+SOURCES += Agent.cpp
+HEADERS += Agent.h
+
+SOURCES += PadSet.cpp
+HEADERS += PadSet.h
+
+SOURCES += Behaviour.cpp
+HEADERS += Behaviour.h
+
+SOURCES += Scenario.cpp
+HEADERS += Scenario.h
+
+SOURCES += Capture.cpp
+HEADERS += Capture.h
+
+SOURCES += Replay.cpp
+HEADERS += Replay.h
+
+SOURCES += AttributePool.cpp
+HEADERS += AttributePool.h
+
+SOURCES += Rope.cpp
+HEADERS += Rope.h
@@ -1,4 +1,6 @@
 #include <QCoreApplication>
+#include <QList>
+#include <QMap>
 #include <QRegExp>
 #include <QStringList>
 #include <QTimer>
@@ -7,23 +9,130 @@
 #include <QtGlobal>
 
 #include <cstdlib>  // for exit()
-#include <unistd.h>  // for getpass() and usleep()
+#include <unistd.h>  // for getpass()
 #include <time.h>
 
-#include "Client.h"
+#include "Agent.h"
+#include "Capture.h"
+#include "Coordinator.h"
+#include "EpollHttp.h"
+#include "LoadProfile.h"
 #include "Logger.h"
+#include "MetricsServer.h"
+#include "NetworkPool.h"
+#include "OpenLoop.h"
+#include "PadSet.h"
+#include "Replay.h"
+#include "Scenario.h"
+#include "Stats.h"
+#include "SharedStats.h"
+#include "Transport.h"
+#include "Worker.h"
+#include "WorkerProcesses.h"
+#include "XhrClient.h"
+
+// Share of websocket vs. xhr-polling clients within a client type
+struct TransportMix {
+    TransportMix() : ws(0), xhr(1) { }
+    int ws;
+    int xhr;
+};
 
 static QString clientspec;
+static QString scenario_file;  // JSON client classes instead of clientspec
+static Scenario scenario;
+static QString transportspec;
+static TransportMix default_mix;
+static QMap<QString, TransportMix> logic_mix;  // per client type overrides
 static int verbosity = Logger::Info;
 static int duration = 300;  // run 300 seconds (5 minutes)
-static QUrl padurl;   // etherdraw URL to connect to (drawing must exist)
+static int pool = 0;  // clients per network manager, 0 for no sharing
+static QString engine = "qt";  // HTTP engine for xhr-polling
+static QString source_ips;  // local addresses for the epoll engine
+static int coalesce = 0;  // msecs to batch xhr messages, 0 for no batching
+static int stats_interval = 0;  // secs between latency reports, 0 for none
+static QString metrics_file;  // JSON lines per interval, "-" for stdout
+static int metrics_port = 0;  // OpenMetrics endpoint, 0 for none
+static double rate = 0;  // open-loop edits/sec over all drawers, 0 for off
+static QString arrival = "poisson";  // spacing of open-loop edits
+static QString profile;  // load shape, like linear:60
+static QString phases;  // named phases, like warmup:60,steady:600
+static int threads = 1;  // event loops to spread the clients over
+static bool pin = false;  // pin each thread to a cpu
+static int procs = 1;  // worker processes, 1 for running in this one
+static int coordinator_port = 0;  // hand the run out to agents, 0 for not
+static int agents = 1;  // agents the coordinator waits for
+static QString agent_address;  // coordinator HOST:PORT to get the run from
+static QString padurl;  // etherdraw URL to connect to (drawing must exist)
+static int pads = 1;  // drawings to spread the clients over
+static QString pad_dist = "uniform";  // how popular each drawing is
+static QString record_file;  // capture file to append sent messages to
+static QString replay_file;  // capture file for the replay clients
+static double replay_speed = 1;  // 2 for replaying twice as fast
+static int agent_number = 0;  // this agent's place among the agents
 // Authorization for etherdraw connection
 static QString username;
 static QString password;
 
 
-void parse_arguments() {
-    QStringList args = qApp->arguments();
+// Parse one of xhr, ws, mixed:WS/XHR
+static bool parse_mix(const QString & value, TransportMix *mix) {
+    if (value == "xhr") {
+        mix->ws = 0;
+        mix->xhr = 1;
+    } else if (value == "ws") {
+        mix->ws = 1;
+        mix->xhr = 0;
+    } else if (QRegExp("mixed:\\d+/\\d+").exactMatch(value)) {
+        mix->ws = value.section(':', 1).section('/', 0, 0).toInt();
+        mix->xhr = value.section('/', 1).toInt();
+    } else {
+        return false;
+    }
+    return mix->ws + mix->xhr > 0;
+}
+
+// Decide the transport for client number i (counting from 1) of a type.
+// The websocket clients are spread evenly through the sequence so that
+// a partial run still gets roughly the requested mix.
+static Transport::Kind transport_for(const QString & logic, int i) {
+    TransportMix mix = logic_mix.value(logic, default_mix);
+    int total = mix.ws + mix.xhr;
+    if (i * mix.ws / total > (i - 1) * mix.ws / total)
+        return Transport::WebSocket;
+    return Transport::Xhr;
+}
+
+static void set_padurl(const QString & url) {
+    padurl = url;
+    if (url.section('/', -2, -2) != "d") {
+        qCritical("draw url must end with /d/DRAWNAME to be valid");
+        exit(2);
+    }
+}
+
+// Replay clients and a capture file to replay go together
+static void check_replay() {
+    bool replayers = false;
+    Q_FOREACH(const Scenario::ClientClass & cc, scenario.classes())
+        if (cc.behaviour.action == Behaviour::Replay && cc.count > 0)
+            replayers = true;
+    if (replayers && replay_file.isEmpty()) {
+        qCritical("replay clients need a capture file to replay");
+        exit(2);
+    }
+    if (!replayers && !replay_file.isEmpty()) {
+        qCritical("replay value needs clients of type replay");
+        exit(2);
+    }
+}
+
+// This runs before the QCoreApplication exists, so that worker processes
+// can be forked before Qt sets anything up.
+void parse_arguments(int argc, char *argv[]) {
+    QStringList args;
+    for (int i = 0; i < argc; i++)
+        args << QString::fromLocal8Bit(argv[i]);
 
     int i;
     for (i = 1; i < args.length(); i++) {
@@ -53,23 +162,69 @@ void parse_arguments() {
 
         if (arg == "--clients")
             clientspec = value;
+        else if (arg == "--scenario")
+            scenario_file = value;
         else if (arg == "--duration")
             duration = value.toInt();
         else if (arg == "--verbosity")
             verbosity = value.toInt();
         else if (arg == "--user")
             username = value;
+        else if (arg == "--transport")
+            transportspec = value;
+        else if (arg == "--pool")
+            pool = value.toInt();
+        else if (arg == "--engine")
+            engine = value;
+        else if (arg == "--source-ips")
+            source_ips = value;
+        else if (arg == "--coalesce")
+            coalesce = value.toInt();
+        else if (arg == "--stats-interval")
+            stats_interval = value.toInt();
+        else if (arg == "--metrics-file")
+            metrics_file = value;
+        else if (arg == "--metrics-port")
+            metrics_port = value.toInt();
+        else if (arg == "--rate")
+            rate = value.toDouble();
+        else if (arg == "--arrival")
+            arrival = value;
+        else if (arg == "--profile")
+            profile = value;
+        else if (arg == "--phases")
+            phases = value;
+        else if (arg == "--threads")
+            threads = value.toInt();
+        else if (arg == "--pin")
+            pin = value == "yes";
+        else if (arg == "--procs")
+            procs = value.toInt();
+        else if (arg == "--coordinator")
+            coordinator_port = value.toInt();
+        else if (arg == "--agents")
+            agents = value.toInt();
+        else if (arg == "--agent")
+            agent_address = value;
+        else if (arg == "--pads")
+            pads = value.toInt();
+        else if (arg == "--pad-dist")
+            pad_dist = value;
+        else if (arg == "--record")
+            record_file = value;
+        else if (arg == "--replay")
+            replay_file = value;
+        else if (arg == "--replay-speed")
+            replay_speed = value.toDouble();
     }
 
-    if (i == args.length()) {
+    // An agent gets the URL from the coordinator
+    if (i < args.length()) {
+        set_padurl(args[i]);
+    } else if (agent_address.isEmpty()) {
         qCritical("Usage: %s [options] URL", qPrintable(args[0]));
         exit(2);
     }
-    padurl = args[i];
-    if (args[i].section('/', -2, -2) != "d") {
-        qCritical("draw url must end with /d/DRAWNAME to be valid");
-        exit(2);
-    }
 
     if (username != "") {
         // Blatantly break portability because there is no sane
@@ -77,7 +232,16 @@ void parse_arguments() {
         password = getpass("password: ");
     }
 
-    if (clientspec.isEmpty()) {
+    if (!scenario_file.isEmpty()) {
+        if (!clientspec.isEmpty()) {
+            qCritical("give either clients or scenario, not both");
+            exit(2);
+        }
+        if (!scenario.load(scenario_file)) {
+            qCritical("scenario: %s", qPrintable(scenario.error()));
+            exit(2);
+        }
+    } else if (clientspec.isEmpty()) {
         clientspec = "lurk:30";
     } else if (clientspec.toInt() != 0) {
         clientspec.prepend("lurk:");
@@ -85,33 +249,316 @@ void parse_arguments() {
         qCritical("clients value must be numeric or like foo:10,bar:20");
         exit(2);
     }
+    if (scenario_file.isEmpty())
+        scenario.setClients(clientspec);
+
+    if (agent_address.isEmpty() && coordinator_port == 0)
+        check_replay();
+    if (replay_speed <= 0) {
+        qCritical("replay-speed value must be more than 0");
+        exit(2);
+    }
+    // Mapped and opened before forking, for the worker processes to share
+    if (!replay_file.isEmpty() && !Replay::open(replay_file, replay_speed))
+        exit(2);
+    if (!record_file.isEmpty() && !Capture::open(record_file))
+        exit(2);
+
+    if (!metrics_file.isEmpty() && stats_interval <= 0)
+        stats_interval = 10;
+
+    PadSet pad_check;
+    if (!pad_check.setPads(padurl, pads)) {
+        qCritical("pads value must be at least 1");
+        exit(2);
+    }
+    if (!pad_check.setDistribution(pad_dist)) {
+        qCritical("pad-dist value must be uniform, zipf:S or hot:K:PERCENT");
+        exit(2);
+    }
+
+    LoadProfile check;
+    if (!profile.isEmpty() && !check.setProfile(profile)) {
+        qCritical("profile value must be linear:SECS, step:SECS:N,"
+                  " spike:AT:LEN:BASE%% or sine:PERIOD:MIN%%");
+        exit(2);
+    }
+    if (!phases.isEmpty()) {
+        if (!check.setPhases(phases)) {
+            qCritical("phases value must be like warmup:60,steady:600");
+            exit(2);
+        }
+        duration = check.phasesSecs();
+    }
+
+    if (threads < 1) {
+        qCritical("threads value must be at least 1");
+        exit(2);
+    }
+    if (procs < 1) {
+        qCritical("procs value must be at least 1");
+        exit(2);
+    }
+    if (agents < 1) {
+        qCritical("agents value must be at least 1");
+        exit(2);
+    }
+    if (coordinator_port > 0 && (!agent_address.isEmpty() || procs > 1)) {
+        qCritical("the coordinator runs no clients, give --agent and --procs"
+                  " to the agents");
+        exit(2);
+    }
+
+    if (arrival != "poisson" && arrival != "fixed") {
+        qCritical("arrival value must be poisson or fixed");
+        exit(2);
+    }
+
+    if (engine != "qt" && engine != "epoll") {
+        qCritical("engine value must be qt or epoll");
+        exit(2);
+    }
+    if (!source_ips.isEmpty()
+        && !EpollHttp::setSourceAddresses(source_ips.split(','))) {
+        qCritical("source-ips value must be a list of IP addresses");
+        exit(2);
+    }
+
+    // Either one transport for everyone, or a list like
+    // xhr,draw=ws,lurk=mixed:70/30 where an entry without a client type
+    // sets the default.
+    if (!transportspec.isEmpty()) {
+        Q_FOREACH(QString spec, transportspec.split(',')) {
+            bool ok;
+            if (spec.contains('=')) {
+                TransportMix mix;
+                ok = parse_mix(spec.section('=', 1), &mix);
+                logic_mix[spec.section('=', 0, 0)] = mix;
+            } else {
+                ok = parse_mix(spec, &default_mix);
+            }
+            if (!ok) {
+                qCritical("transport value must be xhr, ws or mixed:WS/XHR,"
+                          " optionally prefixed by a client type like draw=ws");
+                exit(2);
+            }
+        }
+    }
+}
+
+// Exit on a setup error, taking any worker processes along
+static void fail(const char *message) {
+    qCritical("%s", message);
+    WorkerProcesses::stopAll();
+    exit(2);
 }
 
 int main(int argc, char *argv[])
 {
+    parse_arguments(argc, argv);
+    Logger::set_global_level(verbosity);
+
+    // An agent runs its part of the run, starting with everyone else
+    Agent *agent = 0;
+    if (!agent_address.isEmpty()) {
+        agent = new Agent;
+        if (!agent->join(agent_address))
+            exit(1);
+        QVariantMap config = agent->config();
+        set_padurl(config["url"].toString());
+        if (!scenario.setVariant(config["scenario"])) {
+            qCritical("scenario from the coordinator: %s",
+                      qPrintable(scenario.error()));
+            exit(1);
+        }
+        rate = config["rate"].toDouble();
+        duration = config["duration"].toInt();
+        profile = config["profile"].toString();
+        phases = config["phases"].toString();
+        pads = config["pads"].toInt();
+        pad_dist = config["pad_dist"].toString();
+        agent_number = config["agent"].toInt();
+        check_replay();
+        Replay::setShare(agent_number, config["agents"].toInt());
+        if (!agent->waitStart())
+            exit(1);
+    }
+
+    // With worker processes, this one only collects and reports
+    SharedStats *shared = 0;
+    int proc = -1;
+    if (procs > 1) {
+        shared = SharedStats::create(procs);
+        if (!shared) {
+            qCritical("cannot map shared memory for %d workers", procs);
+            exit(1);
+        }
+        proc = WorkerProcesses::fork(procs);
+    }
+    bool collector = procs > 1 && proc < 0;
+
     QCoreApplication app(argc, argv);
-    qsrand(time(0));
+    qsrand(uint(time(0)) ^ (uint(proc + 2) * 2654435761u));
 
-    parse_arguments();
+    Coordinator *coordinator = 0;
+    if (coordinator_port > 0) {
+        Coordinator::Run run;
+        run.url = padurl;
+        run.pads = pads;
+        run.pad_dist = pad_dist;
+        run.scenario = scenario;
+        run.rate = rate;
+        run.duration = duration;
+        run.profile = profile;
+        run.phases = phases;
+        coordinator = new Coordinator(agents, run, &app);
+        if (!coordinator->listen(coordinator_port))
+            exit(2);
+    }
 
-    Logger::set_global_level(verbosity);
+    NetworkPool::setClientsPerManager(pool);
+    EpollHttp::setEnabled(engine == "epoll");
+    XhrClient::setCoalesceWindow(coalesce);
+    OpenLoop::setPoisson(arrival == "poisson");
+    if (proc >= 0) {
+        shared->setWorker(proc);
+        Stats::instance()->setSink(shared);
+    } else {
+        if (collector)
+            Stats::instance()->addSource(shared);
+        if (coordinator)
+            Stats::instance()->addSource(coordinator);
+        if (agent) {
+            // the coordinator makes the interval reports
+            Stats::instance()->setSink(agent);
+        } else {
+            Stats::instance()->setInterval(stats_interval);
+            if (!metrics_file.isEmpty()
+                && !Stats::instance()->setMetricsFile(metrics_file))
+                fail(qPrintable("cannot open metrics file " + metrics_file));
+            if (metrics_port > 0
+                && !(new MetricsServer(&app))->listen(metrics_port))
+                fail("cannot serve metrics");
+        }
+        // connect before the clients so that it runs before they end()
+        QObject::connect(&app, SIGNAL(aboutToQuit()),
+                         Stats::instance(), SLOT(report()));
+    }
+    if (!collector && !coordinator) {
+        if (pool > 0)
+            NetworkPool::measureManagerCost();
+        QObject::connect(&app, SIGNAL(aboutToQuit()),
+                         NetworkPool::instance(), SLOT(report()));
+    }
 
-    padurl.setUserName(username);
-    padurl.setPassword(password);
+    // The arguments were checked before forking
+    LoadProfile load(&app);
+    if (!profile.isEmpty())
+        load.setProfile(profile);
+    if (!phases.isEmpty())
+        load.setPhases(phases);
 
-    Q_FOREACH(QString spec, clientspec.split(',')) {
-        QString logic = spec.section(':', 0, 0);
-        QString clientid = logic[0].toUpper();
-        int clients = spec.section(':', 1).toInt();
+    if (coordinator) {
+        // the run starts, and ends, with the agents
+        QObject::connect(coordinator, SIGNAL(started()), &load, SLOT(start()));
+        return app.exec();
+    }
+
+    // Each client gets a start position spread evenly over the run of
+    // its type, so that a ramp starts the types in proportion. The
+    // clients share the behaviour of their class.
+    QMap<double, Worker::ClientSpec> start_order;
+    const QList<Scenario::ClientClass> & classes = scenario.classes();
+    for (int k = 0; k < classes.length(); k++) {
+        const Scenario::ClientClass & cc = classes[k];
+        QString clientid = cc.name[0].toUpper();
+        int clients = cc.count;
         for (int i = 1; i <= clients; i++) {
-            Client *cl = new Client(padurl, clientid + QString::number(i));
-            cl->setLogic(logic);
-            cl->connect(&app, SIGNAL(aboutToQuit()), SLOT(end()));
-            cl->start();
-            usleep(1000); // give XhrClient a unique microsecond-based url
+            Worker::ClientSpec cs;
+            cs.name = clientid + QString::number(i);
+            cs.logic = cc.name;
+            cs.behaviour = &cc.behaviour;
+            cs.transport = transport_for(cc.name, i);
+            start_order.insertMulti((i - 0.5) / clients, cs);
+        }
+    }
+
+    PadSet pad_set;
+    pad_set.setPads(padurl, pads);
+    pad_set.setDistribution(pad_dist);
+
+    // A worker process takes every procs'th client in start order, and
+    // drives its share of the open-loop rate. The drawings are handed out
+    // in start order too, so that a ramp loads them all alike.
+    // Clients are numbered in start order in capture files, with the
+    // agent number in the top byte.
+    QList<Worker::ClientSpec> mine;
+    int drawers = 0;
+    int my_drawers = 0;
+    int replayers = 0;
+    int next = 0;
+    Q_FOREACH(Worker::ClientSpec cs, start_order) {
+        bool taken = !collector && (proc < 0 || next % procs == proc);
+        if (cs.behaviour->action == Behaviour::Draw) {
+            drawers++;
+            if (taken)
+                my_drawers++;
+        }
+        cs.trace_id = (quint32(agent_number) << 24) | quint32(next);
+        cs.replay_number = -1;
+        if (cs.behaviour->action == Behaviour::Replay)
+            cs.replay_number = replayers++;
+        if (taken) {
+            int pad = pad_set.padFor(next);
+            cs.padurl = pad_set.url(pad);
+            cs.padurl.setUserName(username);
+            cs.padurl.setPassword(password);
+            cs.bucket = pad_set.bucket(pad);
+            if (!cs.bucket.isEmpty())
+                Stats::instance()->count("pads." + cs.bucket + ".clients");
+            mine << cs;
         }
+        next++;
     }
+    OpenLoop::setRate(drawers > 0 ? rate * my_drawers / drawers : 0);
+    Replay::setClients(replayers);
+
+    Worker::setPinning(pin);
+    QList<Worker *> workers;
+    if (threads == 1) {
+        Worker::pinCurrentThread(qMax(proc, 0));
+        Worker::createClients(mine, &load);
+    } else {
+        // Deal the clients out in start order, so that every worker
+        // ramps up the same mix
+        for (int i = 0; i < threads; i++)
+            workers << new Worker(qMax(proc, 0) * threads + i, profile, &app);
+        for (int i = 0; i < mine.length(); i++)
+            workers[i % threads]->addClient(mine[i]);
+        Q_FOREACH(Worker *worker, workers)
+            worker->start();
+        Q_FOREACH(Worker *worker, workers)
+            worker->waitReady();
+        Q_FOREACH(Worker *worker, workers)
+            worker->go();
+    }
+    load.start();
+
+    if (OpenLoop::enabled())
+        OpenLoop::instance()->start();
+    if (Replay::enabled())
+        Replay::instance()->start();
 
-    QTimer::singleShot(duration * 1000, &app, SLOT(quit()));
-    return app.exec();
+    if (collector)
+        new WorkerProcesses(duration + 30, &app);
+    else
+        QTimer::singleShot(duration * 1000, &app, SLOT(quit()));
+    int status = app.exec();
+    Q_FOREACH(Worker *worker, workers)
+        worker->finish();
+    Capture::flush();
+    // the final snapshot, after the clients have ended
+    if (proc >= 0 || agent)
+        Stats::instance()->publish();
+    return status;
 }